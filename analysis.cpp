@@ -0,0 +1,383 @@
+#include "analysis.hpp"
+#include "spirv.hpp"
+#include "GLSL.std.450.h"
+#include <stdexcept>
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cmath>
+
+OpClass classify(u32 opcode) {
+	switch(opcode) {
+		case spv::OpExtInst: return OpClass::eExtInst;
+		case spv::OpPhi: return OpClass::ePhi;
+		case spv::OpLabel: return OpClass::eLabel;
+		case spv::OpVariable:
+		case spv::OpLoad:
+		case spv::OpStore:
+		case spv::OpAccessChain:
+			return OpClass::eMemory;
+		case spv::OpLoopMerge:
+		case spv::OpSelectionMerge:
+		case spv::OpBranch:
+		case spv::OpBranchConditional:
+		case spv::OpSwitch:
+		case spv::OpKill:
+		case spv::OpReturn:
+		case spv::OpReturnValue:
+		case spv::OpUnreachable:
+		case spv::OpFunctionCall:
+			return OpClass::eControl;
+		default:
+			break;
+	}
+
+	if(opcode >= spv::OpSNegate && opcode <= spv::OpSMulExtended) {
+		return OpClass::eArithmetic;
+	} else if(opcode >= spv::OpAny && opcode <= spv::OpFUnordGreaterThanEqual) {
+		return OpClass::eLogic;
+	} else if(opcode >= spv::OpVectorExtractDynamic &&
+			opcode <= spv::OpCopyObject) {
+		return OpClass::eComposite;
+	}
+
+	return OpClass::eOther;
+}
+
+ModuleMetrics computeMetrics(const std::vector<u32>& spirv) {
+	constexpr auto headerSize = 5u;
+	if(spirv.size() < headerSize || spirv[0] != spv::MagicNumber) {
+		throw std::runtime_error("Invalid spirv header");
+	}
+
+	ModuleMetrics ret;
+	ret.idBound = spirv[3];
+	ret.bytes = spirv.size() * 4;
+
+	for(auto i = headerSize; i < spirv.size();) {
+		auto count = spirv[i] >> 16;
+		auto opcode = spirv[i] & 0xFFFFu;
+		if(count == 0 || i + count > spirv.size()) {
+			throw std::runtime_error("Invalid spirv instruction word count");
+		}
+
+		++ret.instructions;
+		switch(classify(opcode)) {
+			case OpClass::eArithmetic: ++ret.arithmetic; break;
+			case OpClass::eLogic: ++ret.logic; break;
+			case OpClass::eComposite: ++ret.composite; break;
+			case OpClass::eMemory: ++ret.memory; break;
+			case OpClass::eControl: ++ret.control; break;
+			case OpClass::eExtInst: ++ret.extInst; break;
+			case OpClass::ePhi: ++ret.phis; break;
+			case OpClass::eLabel: ++ret.blocks; break;
+			case OpClass::eOther: break;
+		}
+
+		if(opcode == spv::OpLoopMerge) {
+			++ret.loops;
+		}
+
+		i += count;
+	}
+
+	return ret;
+}
+
+unsigned resultIndex(u32 opcode) {
+	switch(opcode) {
+		case spv::OpExtInstImport:
+		case spv::OpString:
+		case spv::OpLabel:
+			return 1;
+		case spv::OpNop:
+		case spv::OpSource:
+		case spv::OpSourceContinued:
+		case spv::OpSourceExtension:
+		case spv::OpName:
+		case spv::OpMemberName:
+		case spv::OpLine:
+		case spv::OpExtension:
+		case spv::OpMemoryModel:
+		case spv::OpEntryPoint:
+		case spv::OpExecutionMode:
+		case spv::OpCapability:
+		case spv::OpTypeForwardPointer:
+		case spv::OpFunctionEnd:
+		case spv::OpStore:
+		case spv::OpDecorate:
+		case spv::OpMemberDecorate:
+		case spv::OpLoopMerge:
+		case spv::OpSelectionMerge:
+		case spv::OpBranch:
+		case spv::OpBranchConditional:
+		case spv::OpSwitch:
+		case spv::OpKill:
+		case spv::OpReturn:
+		case spv::OpReturnValue:
+		case spv::OpUnreachable:
+			return 0;
+		default:
+			break;
+	}
+
+	if(opcode >= spv::OpTypeVoid && opcode < spv::OpTypeForwardPointer) {
+		return 1;
+	}
+
+	return 2;
+}
+
+double glslWeight(u32 instr) {
+	if((instr >= GLSLstd450Sin && instr <= GLSLstd450Log2)) {
+		return 8.0;
+	} else if(instr == GLSLstd450Sqrt || instr == GLSLstd450InverseSqrt) {
+		return 4.0;
+	}
+
+	return 1.0;
+}
+
+double weight(const u32* instr) {
+	auto opcode = instr[0] & 0xFFFFu;
+	switch(opcode) {
+		case spv::OpFDiv:
+		case spv::OpFMod:
+		case spv::OpFRem:
+		case spv::OpUDiv:
+		case spv::OpSDiv:
+		case spv::OpUMod:
+		case spv::OpSMod:
+		case spv::OpSRem:
+			return 4.0;
+		case spv::OpExtInst:
+			return glslWeight(instr[4]);
+		case spv::OpBranchConditional:
+		case spv::OpSwitch:
+			return 2.0;
+		case spv::OpBranch:
+			return 1.0;
+		default:
+			break;
+	}
+
+	switch(classify(opcode)) {
+		case OpClass::eArithmetic:
+		case OpClass::eLogic:
+		case OpClass::eComposite:
+			return 1.0;
+		case OpClass::eMemory:
+			return 2.0;
+		default:
+			return 0.0;
+	}
+}
+
+// Tries to derive the trip count of the loop with the given header.
+// Recognizes the induction pattern generated for rec-funcs like
+// (if (eq n end) ... (rec (- n step) ...)) with constant start, end
+// and step. Returns 0 if it can't be derived.
+u32 tripCount(const std::vector<const u32*>& instrs, std::size_t header,
+		std::size_t end, const std::unordered_map<u32, const u32*>& defs,
+		const std::unordered_map<u32, float>& constants) {
+	auto constant = [&](u32 id, float& val) {
+		auto it = constants.find(id);
+		if(it == constants.end()) {
+			return false;
+		}
+
+		val = it->second;
+		return true;
+	};
+
+	for(auto i = header + 1; i < end; ++i) {
+		auto phi = instrs[i];
+		if((phi[0] & 0xFFFFu) != spv::OpPhi) {
+			break;
+		}
+
+		// OpPhi type result init preheader back continue
+		float start, step, target;
+		if((phi[0] >> 16) != 7 || !constant(phi[3], start)) {
+			continue;
+		}
+
+		// value coming from the continue block must be a phi
+		// with a single back edge: start +/- step
+		auto cont = defs.find(phi[5]);
+		if(cont == defs.end() || cont->second[0] != ((5u << 16) | spv::OpPhi)) {
+			continue;
+		}
+
+		auto next = defs.find(cont->second[3]);
+		if(next == defs.end()) {
+			continue;
+		}
+
+		auto op = next->second[0] & 0xFFFFu;
+		if((op != spv::OpFAdd && op != spv::OpFSub) ||
+				next->second[3] != phi[2] ||
+				!constant(next->second[4], step) || step == 0.f) {
+			continue;
+		}
+
+		if(op == spv::OpFSub) {
+			step = -step;
+		}
+
+		// exit condition: induction variable compared with constant
+		for(auto j = header + 1; j < end; ++j) {
+			auto cmp = instrs[j];
+			if((cmp[0] & 0xFFFFu) != spv::OpFOrdEqual) {
+				continue;
+			}
+
+			if(!(cmp[3] == phi[2] && constant(cmp[4], target)) &&
+					!(cmp[4] == phi[2] && constant(cmp[3], target))) {
+				continue;
+			}
+
+			auto trips = (target - start) / step;
+			if(trips >= 0.f && trips < 1e6f &&
+					std::abs(trips - std::round(trips)) < 1e-3f) {
+				return u32(std::round(trips)) + 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+CostEstimate estimateCost(const Codegen& cg, std::size_t begin, std::size_t end) {
+	std::vector<const u32*> instrs;
+	std::unordered_map<u32, const u32*> defs;
+	std::unordered_map<u32, std::size_t> defIndex;
+	std::unordered_map<u32, std::size_t> labels;
+	for(auto pos = begin; pos < end;) {
+		auto instr = &cg.buf[pos];
+		auto opcode = instr[0] & 0xFFFFu;
+		if(auto r = resultIndex(opcode); r) {
+			defs[instr[r]] = instr;
+			defIndex[instr[r]] = instrs.size();
+		}
+
+		if(opcode == spv::OpLabel) {
+			labels[instr[1]] = instrs.size();
+		}
+
+		instrs.push_back(instr);
+		pos += std::max(instr[0] >> 16, 1u);
+	}
+
+	// loops as [header label, merge label) instruction ranges
+	struct Loop {
+		std::size_t begin;
+		std::size_t end;
+		u32 trips;
+	};
+
+	// only needed for trip counts
+	std::unordered_map<u32, float> constants;
+	auto constantsInitialized = false;
+	auto initConstants = [&]{
+		constantsInitialized = true;
+		for(auto& c : cg.constants) {
+			if(c.type == cg.types.tf32 && !c.undef) {
+				float f;
+				std::memcpy(&f, &c.value, 4);
+				constants[c.id] = f;
+			}
+		}
+	};
+
+	CostEstimate ret;
+	std::vector<Loop> loops;
+	std::size_t lastLabel = 0u;
+	for(auto i = 0u; i < instrs.size(); ++i) {
+		auto opcode = instrs[i][0] & 0xFFFFu;
+		if(opcode == spv::OpLabel) {
+			lastLabel = i;
+		} else if(opcode == spv::OpBranchConditional || opcode == spv::OpSwitch) {
+			++ret.branches;
+		} else if(opcode == spv::OpLoopMerge) {
+			if(!constantsInitialized) {
+				initConstants();
+			}
+
+			auto it = labels.find(instrs[i][1]);
+			auto loopEnd = it == labels.end() ? instrs.size() : it->second;
+			auto trips = tripCount(instrs, lastLabel, loopEnd, defs, constants);
+			loops.push_back({lastLabel, loopEnd, trips ? trips : defaultTripCount});
+			ret.maxTrips = std::max(ret.maxTrips, loops.back().trips);
+		}
+	}
+
+	ret.loops = loops.size();
+
+	// weighted cost, loops are properly nested
+	std::vector<const Loop*> loopStack;
+	double multiplier = 1.0;
+	auto nextLoop = loops.begin();
+	for(auto i = 0u; i < instrs.size(); ++i) {
+		while(!loopStack.empty() && loopStack.back()->end == i) {
+			multiplier /= loopStack.back()->trips;
+			loopStack.pop_back();
+		}
+
+		while(nextLoop != loops.end() && nextLoop->begin == i) {
+			multiplier *= nextLoop->trips;
+			loopStack.push_back(&*nextLoop);
+			++nextLoop;
+		}
+
+		ret.cost += multiplier * weight(instrs[i]);
+	}
+
+	// liveness: a value is live from its definition up to its last use.
+	// Values used inside a loop they weren't defined in stay live
+	// for the whole loop.
+	std::unordered_map<u32, std::size_t> lastUse;
+	for(auto i = 0u; i < instrs.size(); ++i) {
+		auto instr = instrs[i];
+		auto r = resultIndex(instr[0] & 0xFFFFu);
+		auto resultWord = r ? &instr[r] : nullptr;
+		forEachId(instr, [&](const u32& id) {
+			if(&id == resultWord) {
+				return;
+			}
+
+			auto def = defIndex.find(id);
+			if(def == defIndex.end() ||
+					(instrs[def->second][0] & 0xFFFFu) == spv::OpLabel) {
+				return;
+			}
+
+			auto use = std::size_t(i);
+			for(auto& loop : loops) {
+				auto usedInside = loop.begin <= i && i < loop.end;
+				auto definedInside = loop.begin <= def->second &&
+					def->second < loop.end;
+				if(usedInside && (!definedInside || i < def->second)) {
+					use = std::max(use, loop.end);
+				}
+			}
+
+			auto& last = lastUse[id];
+			last = std::max({last, use, def->second});
+		});
+	}
+
+	std::vector<int> delta(instrs.size() + 2);
+	for(auto& [id, last] : lastUse) {
+		++delta[defIndex[id]];
+		--delta[last + 1];
+	}
+
+	int live = 0;
+	for(auto d : delta) {
+		live += d;
+		ret.peakLive = std::max(ret.peakLive, u32(live));
+	}
+
+	return ret;
+}
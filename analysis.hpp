@@ -0,0 +1,188 @@
+#pragma once
+
+#include "fwd.hpp"
+#include "spirv.hpp"
+#include <string>
+
+// Static analysis over generated spirv.
+
+// Rough classification of spirv opcodes, used for metrics.
+enum class OpClass {
+	eArithmetic, // float/int math, dot products and friends
+	eLogic, // comparisons, logical ops, select
+	eComposite, // construct, extract, shuffle
+	eMemory, // variables, loads, stores
+	eControl, // branches, merges, returns
+	eExtInst, // extended instruction set (GLSL.std.450)
+	ePhi,
+	eLabel,
+	eOther, // declarations, types, constants, debug info
+};
+
+OpClass classify(u32 opcode);
+
+// Metrics over a complete spirv module.
+struct ModuleMetrics {
+	u32 instructions {}; // total number of instructions
+	u32 arithmetic {};
+	u32 logic {};
+	u32 composite {};
+	u32 memory {};
+	u32 control {};
+	u32 extInst {};
+	u32 idBound {};
+	u32 blocks {}; // number of labels
+	u32 loops {}; // number of OpLoopMerge
+	u32 phis {};
+	u32 bytes {}; // size of the binary
+};
+
+// Throws std::runtime_error if the module is malformed.
+ModuleMetrics computeMetrics(const std::vector<u32>& spirv);
+
+// Calls the given function for all named fields in the metrics.
+// Allows to generically print/parse/compare them.
+template<typename F>
+void forEachMetric(ModuleMetrics& m, F&& f) {
+	f("instructions", m.instructions);
+	f("arithmetic", m.arithmetic);
+	f("logic", m.logic);
+	f("composite", m.composite);
+	f("memory", m.memory);
+	f("control", m.control);
+	f("ext-inst", m.extInst);
+	f("id-bound", m.idBound);
+	f("blocks", m.blocks);
+	f("loops", m.loops);
+	f("phis", m.phis);
+	f("bytes", m.bytes);
+}
+
+// Returns the number of words a string literal starting at words occupies.
+template<typename W>
+unsigned stringWords(W* words, unsigned max) {
+	for(auto i = 0u; i < max; ++i) {
+		if((words[i] >> 24) == 0u) {
+			return i + 1;
+		}
+	}
+
+	return max;
+}
+
+// Returns the word index of the result id in an instruction with the
+// given opcode or 0 if it has no result.
+unsigned resultIndex(u32 opcode);
+
+// Calls f(word) for every word of the given instruction that holds an
+// <id>, including result type and result. Literal operands are skipped.
+// Covers (at least) all instructions the compiler emits.
+template<typename W, typename F>
+void forEachId(W* instr, F&& f) {
+	auto count = instr[0] >> 16;
+	auto ids = [&](unsigned from, unsigned to) {
+		for(auto i = from; i < to && i < count; ++i) {
+			f(instr[i]);
+		}
+	};
+
+	switch(instr[0] & 0xFFFFu) {
+		case spv::OpNop:
+		case spv::OpCapability:
+		case spv::OpMemoryModel:
+		case spv::OpExtension:
+		case spv::OpSource:
+		case spv::OpSourceExtension:
+		case spv::OpReturn:
+		case spv::OpFunctionEnd:
+		case spv::OpKill:
+		case spv::OpUnreachable:
+			break;
+		case spv::OpEntryPoint: {
+			ids(2, 3);
+			auto name = 3 + stringWords(instr + 3, count - 3);
+			ids(name, count);
+			break;
+		}
+		case spv::OpExtInstImport:
+		case spv::OpName:
+		case spv::OpMemberName:
+		case spv::OpExecutionMode:
+		case spv::OpDecorate:
+		case spv::OpMemberDecorate:
+		case spv::OpTypeVoid:
+		case spv::OpTypeBool:
+		case spv::OpTypeInt:
+		case spv::OpTypeFloat:
+		case spv::OpSelectionMerge:
+		case spv::OpLabel:
+		case spv::OpBranch:
+			ids(1, 2);
+			break;
+		case spv::OpTypeVector:
+		case spv::OpTypeMatrix:
+		case spv::OpLoopMerge:
+		case spv::OpStore:
+			ids(1, 3);
+			break;
+		case spv::OpTypePointer:
+			ids(1, 2);
+			ids(3, 4);
+			break;
+		case spv::OpConstant:
+		case spv::OpSpecConstant:
+		case spv::OpVariable:
+			ids(1, 3);
+			if((instr[0] & 0xFFFFu) == spv::OpVariable) {
+				ids(4, count); // initializer
+			}
+			break;
+		case spv::OpFunction:
+			ids(1, 3);
+			ids(4, 5);
+			break;
+		case spv::OpLoad:
+		case spv::OpCompositeExtract:
+		case spv::OpBranchConditional:
+			ids(1, 4);
+			break;
+		case spv::OpVectorShuffle:
+		case spv::OpCompositeInsert:
+			ids(1, 5);
+			break;
+		case spv::OpExtInst:
+			ids(1, 4);
+			ids(5, count);
+			break;
+		case spv::OpSwitch:
+			ids(1, 3);
+			for(auto i = 4u; i < count; i += 2) {
+				f(instr[i]);
+			}
+			break;
+		default: // all operands are ids
+			ids(1, count);
+			break;
+	}
+}
+
+// Static cost estimate for a range of generated code.
+// Weights are rough relative throughput costs, loosely modelled on
+// current desktop GPUs: most ALU ops cost 1, divisions and square
+// roots more, transcendentals (sin, exp, pow, ...) considerably more.
+// Both sides of a selection are counted since divergent invocations
+// have to execute both. Loop bodies are multiplied with their
+// estimated trip count.
+struct CostEstimate {
+	double cost {}; // weighted instruction cost
+	u32 peakLive {}; // max simultaneously live values (register pressure)
+	u32 branches {}; // conditional branches and switches
+	u32 loops {};
+	u32 maxTrips {}; // largest estimated trip count
+};
+
+// Trip count used for loops whose trip count can't be derived.
+constexpr auto defaultTripCount = 16u;
+
+// Estimates the cost of the code in cg.buf[begin, end).
+CostEstimate estimateCost(const Codegen& cg, std::size_t begin, std::size_t end);
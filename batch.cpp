@@ -0,0 +1,109 @@
+#include "batch.hpp"
+#include "lambdav.hpp"
+#include "fwd.hpp"
+#include "pool.hpp"
+#include "cache.hpp"
+#include "module.hpp"
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+std::vector<fs::path> collectSources(const fs::path& input) {
+	std::vector<fs::path> ret;
+	if(fs::is_directory(input)) {
+		for(auto& entry : fs::recursive_directory_iterator(input)) {
+			if(entry.is_regular_file() && entry.path().extension() == ".lv") {
+				ret.push_back(entry.path());
+			}
+		}
+
+		std::sort(ret.begin(), ret.end());
+		return ret;
+	}
+
+	std::ifstream ifs(input);
+	if(!ifs) {
+		throw std::runtime_error("Can't open manifest " + input.string());
+	}
+
+	std::string line;
+	while(std::getline(ifs, line)) {
+		if(line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		ret.push_back(input.parent_path() / line);
+	}
+
+	return ret;
+}
+
+unsigned compileBatch(std::string_view input, unsigned threads,
+		ModuleCache& modules, std::ostream& os, Cache* cache) {
+	auto start = std::chrono::steady_clock::now();
+	threads = std::max(threads, 1u);
+	auto sources = collectSources(fs::path(input));
+
+	std::vector<std::string> messages(sources.size());
+	std::vector<char> failed(sources.size());
+	std::vector<Workspace> workspaces(threads);
+
+	parallelFor(sources.size(), threads, [&](std::size_t i, unsigned worker) {
+		auto& path = sources[i];
+		auto& msg = messages[i];
+
+		Options options;
+		options.workspace = &workspaces[worker];
+		options.path = path.string();
+		options.modules = &modules;
+
+		try {
+			auto source = mapFile(path.string());
+			auto res = cache ?
+				compileCached(*cache, source.data, options) :
+				compile(source.data, options);
+			if(auto diags = std::get_if<std::vector<Diagnostic>>(&res)) {
+				failed[i] = true;
+				for(auto& diag : *diags) {
+					auto file = diag.file.empty() ? path.string() : diag.file;
+					msg += file + ":" + std::to_string(diag.loc.row);
+					msg += ":" + std::to_string(diag.loc.col) + ": ";
+					msg += diag.message + "\n";
+				}
+				return;
+			}
+
+			auto output = path;
+			output.replace_extension(".spv");
+			writeFile(output.string(), std::get<std::vector<u32>>(res));
+		} catch(const std::exception& err) {
+			failed[i] = true;
+			msg = path.string() + ": " + err.what() + "\n";
+		}
+	});
+
+	auto failCount = 0u;
+	for(auto i = 0u; i < sources.size(); ++i) {
+		os << messages[i];
+		failCount += failed[i];
+	}
+
+	using namespace std::chrono;
+	auto ms = duration<double, std::milli>(steady_clock::now() - start).count();
+	os << "compiled " << sources.size() - failCount << "/" << sources.size();
+	os << " sources on " << threads << " threads in " << ms << " ms\n";
+	if(cache) {
+		auto stats = cache->stats();
+		os << "cache: " << stats.hits << " hits, " << stats.misses;
+		os << " misses, " << stats.evictions << " evictions\n";
+	}
+
+	return failCount;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string_view>
+#include <iosfwd>
+
+class Cache;
+class ModuleCache;
+
+// Compiles many sources in one process.
+// Input is either a directory (all .lv files in it are compiled,
+// recursively) or a manifest file listing one source per line,
+// relative to the manifest. The output for 'dir/a.lv' is written to
+// 'dir/a.spv'. Compilation runs on the given number of threads.
+// Diagnostics and a summary are printed to os, in input order.
+// Imported modules are loaded into the given module cache once.
+// If a cache is given, it's used for all compilations.
+// Returns the number of sources that failed to compile.
+unsigned compileBatch(std::string_view input, unsigned threads,
+	ModuleCache& modules, std::ostream& os, Cache* cache = nullptr);
@@ -0,0 +1,30 @@
+// Replaces the global operator new to count heap allocations.
+// In its own translation unit, so the compiler doesn't see the
+// replaced operators paired with new expressions.
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+
+std::atomic<std::size_t> allocations {};
+
+std::size_t allocationCount() {
+	return allocations;
+}
+
+void* operator new(std::size_t size) {
+	++allocations;
+	if(auto ptr = std::malloc(size ? size : 1u)) {
+		return ptr;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
@@ -0,0 +1,132 @@
+// Compile latency benchmark.
+// Compares the request latency of a compile server (lambdav --serve)
+// with starting a fresh compiler process for every compilation.
+// Usage: lambdav-latency <lambdav executable> <source> [runs]
+
+#include "../server.hpp"
+
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+// Runs the given command in dir, with its output discarded.
+pid_t spawn(const fs::path& dir, std::vector<std::string> args) {
+	auto pid = ::fork();
+	if(pid != 0) {
+		return pid;
+	}
+
+	auto null = ::open("/dev/null", O_WRONLY);
+	::dup2(null, STDOUT_FILENO);
+	if(::chdir(dir.c_str())) {
+		::_exit(127);
+	}
+
+	std::vector<char*> argv;
+	for(auto& arg : args) {
+		argv.push_back(arg.data());
+	}
+
+	argv.push_back(nullptr);
+	::execv(argv[0], argv.data());
+	::_exit(127);
+}
+
+void printTimes(const char* name, std::vector<double> times) {
+	std::sort(times.begin(), times.end());
+	auto sum = 0.0;
+	for(auto time : times) {
+		sum += time;
+	}
+
+	std::cout << name << ": min " << times.front() << " ms, median ";
+	std::cout << times[times.size() / 2] << " ms, mean ";
+	std::cout << sum / times.size() << " ms\n";
+}
+
+int main(int argc, const char** argv) {
+	if(argc < 3) {
+		std::cout << "Usage: lambdav-latency <lambdav> <source> [runs]\n";
+		return -1;
+	}
+
+	auto lambdav = fs::absolute(argv[1]).string();
+	auto source = fs::absolute(argv[2]).string();
+	auto runs = argc > 3 ? std::max(std::atoi(argv[3]), 1) : 50;
+
+	// cold processes write their output into the working directory
+	auto dir = fs::temp_directory_path() /
+		("lambdav-latency-" + std::to_string(::getpid()));
+	fs::create_directories(dir);
+	auto socketPath = (dir / "socket").string();
+
+	auto server = spawn(dir, {lambdav, "--serve", socketPath});
+	int fd = -1;
+	for(auto i = 0u; i < 100 && fd < 0; ++i) {
+		try {
+			fd = connectServer(socketPath);
+		} catch(const std::exception&) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	if(fd < 0) {
+		std::cout << "Can't connect to the server\n";
+		::kill(server, SIGTERM);
+		::waitpid(server, nullptr, 0);
+		fs::remove_all(dir);
+		return -2;
+	}
+
+	using Ms = std::chrono::duration<double, std::milli>;
+	std::vector<double> warm;
+	auto failed = false;
+	for(auto i = 0; i < runs; ++i) {
+		auto start = Clock::now();
+		Message msg;
+		msg.kind = "compile";
+		msg.path = source;
+		if(!writeMessage(fd, msg) || !readMessage(fd, msg)) {
+			failed = true;
+			break;
+		}
+
+		warm.push_back(Ms(Clock::now() - start).count());
+		failed |= (msg.kind != "spirv");
+	}
+
+	writeMessage(fd, {"shutdown", "", ""});
+	::close(fd);
+	::waitpid(server, nullptr, 0);
+
+	std::vector<double> cold;
+	for(auto i = 0; i < runs && !failed; ++i) {
+		auto start = Clock::now();
+		int status;
+		::waitpid(spawn(dir, {lambdav, source}), &status, 0);
+		cold.push_back(Ms(Clock::now() - start).count());
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+
+	fs::remove_all(dir);
+	if(failed) {
+		std::cout << "Compiling " << source << " failed\n";
+		return 1;
+	}
+
+	std::cout << source << ", " << runs << " runs\n";
+	printTimes("server", warm);
+	printTimes("cold process", cold);
+	return 0;
+}
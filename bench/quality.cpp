@@ -0,0 +1,158 @@
+// Generated-code quality benchmark.
+// Compiles a corpus of λV sources and compares metrics of the generated
+// spirv against a checked-in baseline. Fails if any metric regresses.
+// Run with --update to rewrite the baseline after intended changes.
+// Also reports the heap allocations of every compilation, they are
+// not part of the baseline.
+
+#include "../lambdav.hpp"
+#include "../fwd.hpp"
+#include "../analysis.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstring>
+
+// Heap allocations of the program so far, see allocations.cpp.
+std::size_t allocationCount();
+
+using Baseline = std::map<std::string, std::map<std::string, u32>>;
+
+// Format: one line per source, "<source> <metric>=<value> ..."
+// Lines starting with '#' are comments.
+Baseline readBaseline(const std::string& path) {
+	Baseline ret;
+	std::ifstream ifs(path);
+	std::string line;
+	while(std::getline(ifs, line)) {
+		if(line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		std::istringstream iss(line);
+		std::string source, metric;
+		iss >> source;
+		auto& entry = ret[source];
+		while(iss >> metric) {
+			auto eq = metric.find('=');
+			if(eq == metric.npos) {
+				std::cerr << "Invalid baseline entry: " << metric << "\n";
+				continue;
+			}
+
+			entry[metric.substr(0, eq)] = std::stoul(metric.substr(eq + 1));
+		}
+	}
+
+	return ret;
+}
+
+void writeBaseline(const std::string& path, const Baseline& baseline) {
+	std::ofstream ofs(path);
+	ofs << "# generated by lambdav-quality --update\n";
+	for(auto& [source, metrics] : baseline) {
+		ofs << source;
+		for(auto& [name, value] : metrics) {
+			ofs << " " << name << "=" << value;
+		}
+		ofs << "\n";
+	}
+}
+
+void printUsage() {
+	std::cout << "Usage: lambdav-quality [--update] <baseline> <sources...>\n";
+}
+
+int main(int argc, const char** argv) {
+	auto update = false;
+	auto argi = 1;
+	if(argi < argc && !std::strcmp(argv[argi], "--update")) {
+		update = true;
+		++argi;
+	}
+
+	if(argc - argi < 2) {
+		printUsage();
+		return -1;
+	}
+
+	std::string baselinePath = argv[argi++];
+	auto baseline = readBaseline(baselinePath);
+	Baseline current;
+
+	auto failed = false;
+	for(; argi < argc; ++argi) {
+		std::string source = argv[argi];
+		ModuleMetrics metrics;
+		std::size_t allocs {};
+		try {
+			Options options;
+			options.path = source;
+			auto text = readFile(source);
+			auto before = allocationCount();
+			auto res = compile(text, options);
+			allocs = allocationCount() - before;
+			if(auto diags = std::get_if<std::vector<Diagnostic>>(&res)) {
+				auto& diag = diags->front();
+				auto file = diag.file.empty() ? source : diag.file;
+				std::cout << file << ":" << diag.loc.row << ":";
+				std::cout << diag.loc.col << ": " << diag.message << "\n";
+				failed = true;
+				continue;
+			}
+
+			metrics = computeMetrics(std::get<std::vector<u32>>(res));
+		} catch(const std::exception& err) {
+			std::cout << source << ": compilation failed: " << err.what() << "\n";
+			failed = true;
+			continue;
+		}
+
+		auto& entry = current[source];
+		auto it = baseline.find(source);
+		std::cout << source << "\n";
+		forEachMetric(metrics, [&](const char* name, u32 value) {
+			entry[name] = value;
+			std::cout << "\t" << name << ": " << value;
+
+			if(it == baseline.end()) {
+				std::cout << " (no baseline)\n";
+				return;
+			}
+
+			auto bit = it->second.find(name);
+			if(bit == it->second.end()) {
+				std::cout << " (no baseline)\n";
+			} else if(value > bit->second) {
+				std::cout << " REGRESSION (baseline " << bit->second << ")\n";
+				failed = true;
+			} else if(value < bit->second) {
+				std::cout << " improved (baseline " << bit->second << ")\n";
+			} else {
+				std::cout << "\n";
+			}
+		});
+
+		std::cout << "\theap allocations: " << allocs << "\n";
+		if(it == baseline.end()) {
+			failed = true;
+		}
+	}
+
+	if(update) {
+		writeBaseline(baselinePath, current);
+		std::cout << "Wrote baseline " << baselinePath << "\n";
+		return 0;
+	}
+
+	if(failed) {
+		std::cout << "Quality regressed (or sources failed to compile)\n";
+		return 1;
+	}
+
+	return 0;
+}
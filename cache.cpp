@@ -0,0 +1,376 @@
+#include "cache.hpp"
+#include "fwd.hpp"
+#include "module.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
+#include <link.h>
+
+namespace fs = std::filesystem;
+
+// sha-256, as specified in FIPS 180-4
+Hash hash(std::string_view data) {
+	static constexpr u32 k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+		0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+		0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+		0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+		0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+		0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+		0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+		0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+		0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+
+	u32 h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	auto rotr = [](u32 x, unsigned n) { return (x >> n) | (x << (32 - n)); };
+	auto block = [&](const std::uint8_t* data) {
+		u32 w[64];
+		for(auto i = 0u; i < 16; ++i) {
+			w[i] = (u32(data[4 * i]) << 24) | (u32(data[4 * i + 1]) << 16) |
+				(u32(data[4 * i + 2]) << 8) | u32(data[4 * i + 3]);
+		}
+
+		for(auto i = 16u; i < 64; ++i) {
+			auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		u32 a = h[0], b = h[1], c = h[2], d = h[3];
+		u32 e = h[4], f = h[5], g = h[6], hh = h[7];
+		for(auto i = 0u; i < 64; ++i) {
+			auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+			auto ch = (e & f) ^ (~e & g);
+			auto t1 = hh + s1 + ch + k[i] + w[i];
+			auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+			auto maj = (a & b) ^ (a & c) ^ (b & c);
+			auto t2 = s0 + maj;
+
+			hh = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+	};
+
+	auto bytes = reinterpret_cast<const std::uint8_t*>(data.data());
+	auto size = data.size();
+	auto full = size / 64;
+	for(auto i = 0u; i < full; ++i) {
+		block(bytes + 64 * i);
+	}
+
+	// padding: 0x80, zeroes, 64-bit big endian bit length
+	std::uint8_t last[128] {};
+	auto rem = size % 64;
+	std::memcpy(last, bytes + 64 * full, rem);
+	last[rem] = 0x80;
+	auto lastSize = rem < 56 ? 64u : 128u;
+	std::uint64_t bits = std::uint64_t(size) * 8;
+	for(auto i = 0u; i < 8; ++i) {
+		last[lastSize - 1 - i] = std::uint8_t(bits >> (8 * i));
+	}
+
+	block(last);
+	if(lastSize == 128) {
+		block(last + 64);
+	}
+
+	Hash ret;
+	for(auto i = 0u; i < 8; ++i) {
+		ret[4 * i + 0] = std::uint8_t(h[i] >> 24);
+		ret[4 * i + 1] = std::uint8_t(h[i] >> 16);
+		ret[4 * i + 2] = std::uint8_t(h[i] >> 8);
+		ret[4 * i + 3] = std::uint8_t(h[i]);
+	}
+
+	return ret;
+}
+
+std::string toHex(const Hash& hash) {
+	constexpr auto digits = "0123456789abcdef";
+	std::string ret;
+	for(auto byte : hash) {
+		ret += digits[byte >> 4];
+		ret += digits[byte & 0xF];
+	}
+
+	return ret;
+}
+
+// Mirrors the tokenization of the parser: comments start with ';'
+// at the beginning of a token and strings are copied verbatim.
+std::string normalize(std::string_view source) {
+	std::string ret;
+	ret.reserve(source.size());
+
+	auto tokenStart = true;
+	auto space = false;
+	for(auto i = 0u; i < source.size(); ++i) {
+		auto c = source[i];
+		if(std::isspace(static_cast<unsigned char>(c))) {
+			space = !ret.empty();
+			tokenStart = true;
+			continue;
+		}
+
+		if(c == ';' && tokenStart) {
+			while(i < source.size() && source[i] != '\n') {
+				++i;
+			}
+
+			space = !ret.empty();
+			continue;
+		}
+
+		if(space) {
+			ret += ' ';
+			space = false;
+		}
+
+		if(c == '"' && tokenStart) {
+			auto end = source.find('"', i + 1);
+			end = (end == source.npos) ? source.size() : end + 1;
+			ret += source.substr(i, end - i);
+			i = end - 1;
+			continue;
+		}
+
+		ret += c;
+		tokenStart = (c == '(' || c == ')');
+	}
+
+	return ret;
+}
+
+const Hash& compilerId() {
+	static const Hash id = [] {
+		struct Search {
+			std::uintptr_t address;
+			std::string data;
+		} search {reinterpret_cast<std::uintptr_t>(&compilerId), lambdavVersion};
+
+		// the object containing this function, its non-writable segments
+		// are mapped from the file unchanged, i.e. don't depend on where
+		// it was loaded
+		dl_iterate_phdr([](dl_phdr_info* info, std::size_t, void* data) {
+			auto& search = *static_cast<Search*>(data);
+			auto segment = [&](const ElfW(Phdr)& phdr) {
+				return info->dlpi_addr + phdr.p_vaddr;
+			};
+
+			auto phdrs = info->dlpi_phdr;
+			auto count = info->dlpi_phnum;
+			auto found = std::any_of(phdrs, phdrs + count, [&](auto& phdr) {
+				return phdr.p_type == PT_LOAD && search.address >= segment(phdr) &&
+					search.address < segment(phdr) + phdr.p_memsz;
+			});
+			if(!found) {
+				return 0;
+			}
+
+			for(auto i = 0u; i < count; ++i) {
+				auto& phdr = phdrs[i];
+				if(phdr.p_type == PT_LOAD && !(phdr.p_flags & PF_W)) {
+					auto begin = reinterpret_cast<const char*>(segment(phdr));
+					search.data.append(begin, phdr.p_filesz);
+				}
+			}
+
+			return 1;
+		}, &search);
+
+		return hash(search.data);
+	}();
+
+	return id;
+}
+
+Hash cacheKey(std::string_view source, const Options& options) {
+	std::string data = "lambdav ";
+	data += toHex(compilerId());
+	data += '\0';
+	data += outputKey(options);
+	data += '\0';
+	data += normalize(source);
+
+	ModuleCache localModules;
+	auto& modules = options.modules ? *options.modules : localModules;
+	for(auto& module : findImports(source, options.path, modules)) {
+		data += '\0';
+		data.append(module->hash.begin(), module->hash.end());
+	}
+
+	return hash(data);
+}
+
+Cache::Cache(fs::path dir, std::uint64_t maxSize) :
+		dir_(std::move(dir)), maxSize_(maxSize) {
+	fs::create_directories(dir_);
+}
+
+fs::path Cache::path(const Hash& key) const {
+	auto hex = toHex(key);
+	return dir_ / hex.substr(0, 2) / (hex.substr(2) + ".spv");
+}
+
+std::optional<std::vector<u32>> Cache::load(const Hash& key) {
+	auto p = path(key);
+	std::ifstream ifs(p, std::ios::binary | std::ios::ate);
+	if(!ifs) {
+		++misses_;
+		return std::nullopt;
+	}
+
+	auto size = std::size_t(ifs.tellg());
+	if(size == 0 || size % 4 != 0) {
+		++misses_;
+		return std::nullopt;
+	}
+
+	std::vector<u32> ret(size / 4);
+	ifs.seekg(0);
+	if(!ifs.read(reinterpret_cast<char*>(ret.data()), size)) {
+		++misses_;
+		return std::nullopt;
+	}
+
+	// mark as recently used
+	std::error_code ec;
+	fs::last_write_time(p, fs::file_time_type::clock::now(), ec);
+
+	++hits_;
+	return ret;
+}
+
+void Cache::store(const Hash& key, const std::vector<u32>& spirv) {
+	auto p = path(key);
+	std::error_code ec;
+	fs::create_directories(p.parent_path(), ec);
+
+	// unique per thread and process, renamed into place when complete
+	std::ostringstream tmpName;
+	tmpName << ".tmp-" << std::this_thread::get_id() << "-";
+	tmpName << std::hash<std::string>()(p.string()) << "-" << ::getpid();
+	auto tmp = p.parent_path() / tmpName.str();
+
+	{
+		std::ofstream ofs(tmp, std::ios::binary);
+		ofs.write(reinterpret_cast<const char*>(spirv.data()), spirv.size() * 4);
+		if(!ofs) {
+			fs::remove(tmp, ec);
+			return;
+		}
+	}
+
+	fs::rename(tmp, p, ec);
+	if(ec) {
+		fs::remove(tmp, ec);
+		return;
+	}
+
+	++stores_;
+
+	std::lock_guard lock(mutex_);
+	if(size_) {
+		*size_ += spirv.size() * 4;
+	}
+
+	if(!size_ || *size_ > maxSize_) {
+		evict();
+	}
+}
+
+// Recomputes the cache size and, when above the maximum size, removes
+// least recently used entries until it's below 3/4 of it.
+void Cache::evict() {
+	struct Entry {
+		fs::path path;
+		fs::file_time_type time;
+		std::uint64_t size;
+	};
+
+	std::vector<Entry> entries;
+	std::uint64_t size = 0u;
+	std::error_code ec;
+	for(auto it = fs::recursive_directory_iterator(dir_, ec);
+			it != fs::recursive_directory_iterator(); it.increment(ec)) {
+		if(ec) {
+			break;
+		}
+
+		if(!it->is_regular_file(ec) || it->path().extension() != ".spv") {
+			continue;
+		}
+
+		auto fsize = it->file_size(ec);
+		auto time = it->last_write_time(ec);
+		entries.push_back({it->path(), time, fsize});
+		size += fsize;
+	}
+
+	if(size > maxSize_) {
+		std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) {
+			return a.time < b.time;
+		});
+
+		auto target = maxSize_ / 4 * 3;
+		for(auto& entry : entries) {
+			if(size <= target) {
+				break;
+			}
+
+			if(fs::remove(entry.path, ec)) {
+				size -= entry.size;
+				++evictions_;
+			}
+		}
+	}
+
+	size_ = size;
+}
+
+CacheStats Cache::stats() const {
+	return {hits_, misses_, stores_, evictions_};
+}
+
+CompileResult compileCached(Cache& cache, std::string_view source,
+		const Options& options) {
+	// don't load imported modules twice
+	ModuleCache localModules;
+	auto moptions = options;
+	if(!moptions.modules) {
+		moptions.modules = &localModules;
+	}
+
+	auto key = cacheKey(source, moptions);
+	if(auto spirv = cache.load(key)) {
+		return std::move(*spirv);
+	}
+
+	auto res = compile(source, moptions);
+	if(auto spirv = std::get_if<std::vector<u32>>(&res)) {
+		cache.store(key, *spirv);
+	}
+
+	return res;
+}
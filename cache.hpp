@@ -0,0 +1,80 @@
+#pragma once
+
+#include "lambdav.hpp"
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <optional>
+#include <filesystem>
+
+// Content-addressed cache of compiled spirv modules on disk.
+// The key is a hash of the normalized source, the compiler build
+// and all options that influence the output. Entries are written
+// atomically (written to a temporary file, then renamed) so the cache
+// can be shared between concurrent compilations and processes.
+// When the cache grows above its maximum size, the least recently
+// used entries (by file modification time, updated on every hit)
+// are removed.
+
+using Hash = std::array<std::uint8_t, 32>;
+
+// sha-256
+Hash hash(std::string_view data);
+std::string toHex(const Hash& hash);
+
+// Returns the source with comments removed and all whitespace sequences
+// collapsed into a single space. Doesn't change its meaning.
+std::string normalize(std::string_view source);
+
+// Hash of the compiler's machine code, identifies its build. Changes
+// whenever the compiler is rebuilt with different code, so nothing
+// written by another build is used, e.g. cache entries and pchs.
+const Hash& compilerId();
+
+// Hash identifying the output of compiling the given source with
+// the given options, including all modules it imports.
+Hash cacheKey(std::string_view source, const Options& options);
+
+struct CacheStats {
+	unsigned hits;
+	unsigned misses;
+	unsigned stores;
+	unsigned evictions;
+};
+
+class Cache {
+public:
+	static constexpr std::uint64_t defaultMaxSize = 256 * 1024 * 1024;
+
+public:
+	Cache(std::filesystem::path dir, std::uint64_t maxSize = defaultMaxSize);
+
+	std::optional<std::vector<std::uint32_t>> load(const Hash& key);
+	void store(const Hash& key, const std::vector<std::uint32_t>& spirv);
+
+	CacheStats stats() const;
+	const std::filesystem::path& dir() const { return dir_; }
+
+protected:
+	std::filesystem::path path(const Hash& key) const;
+	void evict();
+
+protected:
+	std::filesystem::path dir_;
+	std::uint64_t maxSize_;
+
+	std::mutex mutex_; // for size_ and eviction
+	std::optional<std::uint64_t> size_; // known total size
+
+	std::atomic<unsigned> hits_ {};
+	std::atomic<unsigned> misses_ {};
+	std::atomic<unsigned> stores_ {};
+	std::atomic<unsigned> evictions_ {};
+};
+
+// Looks the source up in the cache, compiling it on a miss.
+// Only successful compilations are cached. Cache I/O errors are
+// ignored, i.e. treated like a miss.
+CompileResult compileCached(Cache& cache, std::string_view source,
+	const Options& options = {});
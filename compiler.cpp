@@ -1,5 +1,10 @@
+#include "lambdav.hpp"
 #include "fwd.hpp"
 #include "parser.hpp"
+#include "stats.hpp"
+#include "module.hpp"
+#include "pool.hpp"
+#include "cache.hpp"
 
 #include <vector>
 #include <memory>
@@ -11,6 +16,15 @@
 #include <fstream>
 #include <algorithm>
 #include <deque>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <exception>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 CExpression wrap(const Expression& expr) {
 	return std::visit([&](auto& val) {
@@ -18,30 +32,47 @@ CExpression wrap(const Expression& expr) {
 	}, expr.value);
 }
 
+// Iterative, definitions can be nested arbitrarily deep.
 std::string dump(const Expression& expr) {
-	// oh wow, this almost looks like proper programming
-	// guess C++ has pattern matching after all, eh?
-	return std::visit(Visitor{
-		[](bool val) { return std::to_string(val); },
-		[](double val) { return std::to_string(val); },
-		[](std::string_view val) { return std::string(val); },
-		[](const Identifier& id) { return std::string(id.name); },
-		[](const List& list) {
-			std::string ret = "(";
-			auto first = true;
-			for(auto& arg : list.values) {
-				if(!first) {
-					ret += " ";
-				}
+	struct Open {
+		const List* list;
+		std::size_t next; // index of the next value
+	};
 
-				first = false;
-				ret += dump(arg);
+	std::string ret;
+	std::vector<Open> open;
+	auto next = &expr;
+	while(true) {
+		// oh wow, this almost looks like proper programming
+		// guess C++ has pattern matching after all, eh?
+		std::visit(Visitor{
+			[&](bool val) { ret += std::to_string(val); },
+			[&](double val) { ret += std::to_string(val); },
+			[&](std::string_view val) { ret += val; },
+			[&](const Identifier& id) { ret += id.name; },
+			[&](const List& list) {
+				ret += "(";
+				open.push_back({&list, 0u});
 			}
+		}, next->value);
 
+		while(!open.empty() &&
+				open.back().next == open.back().list->values.size()) {
 			ret += ")";
+			open.pop_back();
+		}
+
+		if(open.empty()) {
 			return ret;
 		}
-	}, expr.value);
+
+		auto& list = open.back();
+		if(list.next > 0) {
+			ret += " ";
+		}
+
+		next = &list.list->values[list.next++];
+	}
 }
 
 void writeFile(std::string_view filename, const std::vector<u32>& buffer) {
@@ -52,11 +83,6 @@ void writeFile(std::string_view filename, const std::vector<u32>& buffer) {
 	ofs.write(data, buffer.size() * 4);
 }
 
-void printHelp() {
-	std::cout << "Usage: lambdav <source>\n";
-	std::cout << "\tWill produce output.spv\n";
-}
-
 std::string readFile(std::string_view filename) {
 	auto openmode = std::ios::ate;
 	std::ifstream ifs(std::string{filename}, openmode);
@@ -71,48 +97,376 @@ std::string readFile(std::string_view filename) {
 	return buffer;
 }
 
-int main(int argc, const char** argv) {
-	if(argc < 2 || !std::strcmp(argv[1], "-h") ||
-			!std::strcmp(argv[1], "--help")) {
-		printHelp();
-		return -1;
+MappedFile mapFile(std::string_view filename) {
+	auto path = std::string(filename);
+	auto fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		throw std::runtime_error("Can't open " + path);
+	}
+
+	struct stat st;
+	if(::fstat(fd, &st)) {
+		::close(fd);
+		throw std::runtime_error("Can't read " + path);
+	}
+
+	if(S_ISREG(st.st_mode) && st.st_size > 0) {
+		std::size_t size = st.st_size;
+		auto data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if(data == MAP_FAILED) {
+			throw std::runtime_error("Can't map " + path);
+		}
+
+		::madvise(data, size, MADV_SEQUENTIAL);
+		auto storage = std::shared_ptr<const void>(data, [size](const void* data) {
+			::munmap(const_cast<void*>(data), size);
+		});
+		return {std::move(storage), {static_cast<const char*>(data), size}};
+	}
+
+	auto buffer = std::make_shared<std::string>();
+	char chunk[64 * 1024];
+	ssize_t count;
+	while((count = ::read(fd, chunk, sizeof(chunk))) > 0) {
+		buffer->append(chunk, count);
+	}
+
+	if(fd != STDIN_FILENO) {
+		::close(fd);
 	}
 
-	auto input = argv[1];
-	std::string source;
+	if(count < 0) {
+		throw std::runtime_error("Can't read " + path);
+	}
+
+	std::string_view data = *buffer;
+	return {std::move(buffer), data};
+}
+
+std::string formName(const Location& loc) {
+	return std::to_string(loc.row) + ":" + std::to_string(loc.col);
+}
+
+struct LazyExpression::State {
+	SourceForm body;
+	SymbolTable* symbols {};
+	std::once_flag parsed;
+	CExpression expr;
+	Arena* arena {}; // of the parsed body
+	Arena ownArena;
+};
+
+LazyExpression::LazyExpression(const Expression& parsed) :
+		state_(std::make_shared<State>()) {
+	std::call_once(state_->parsed, [&]{ state_->expr = wrap(parsed); });
+}
+
+LazyExpression::LazyExpression(const SourceForm& body, SymbolTable& symbols,
+		Arena* arena) : state_(std::make_shared<State>()) {
+	state_->body = body;
+	state_->symbols = &symbols;
+	state_->arena = arena ? arena : &state_->ownArena;
+}
+
+const CExpression& LazyExpression::get() const {
+	auto& state = *state_;
+	std::call_once(state.parsed, [&]{
+		Parser parser {state.body.text, state.body.loc, state.symbols};
+		parser.arena = state.arena;
+		state.expr = wrap(nextExpression(parser));
+	});
+
+	return state.expr;
+}
+
+std::string_view LazyExpression::text() const {
+	return state_->body.text;
+}
+
+// Text of a definition body for Options::defineLog.
+std::string dump(const LazyExpression& value) {
+	if(!value.text().empty()) {
+		return normalize(value.text());
+	}
+
+	return std::visit(Visitor{
+		[](const GenExpr&) { return std::string("<generated>"); },
+		[&](const auto& val) { return dump(Expression{val, {}}); },
+	}, value.get().value);
+}
+
+std::optional<LazyDefine> skipDefine(Parser& parser) {
+	// other forms are parsed completely, reporting all errors
+	auto p = parser;
 	try {
-		source = readFile(input);
-	} catch(const std::exception& err) {
-		std::cout << "Can't read input: " << err.what() << "\n";
-		return -2;
+		auto open = nextToken(p);
+		auto keyword = nextToken(p);
+		auto name = nextToken(p);
+		if(open.kind != TokenKind::eOpen ||
+				keyword.kind != TokenKind::eIdentifier || keyword.text != "define" ||
+				name.kind != TokenKind::eIdentifier ||
+				name.text == "true" || name.text == "false") {
+			return std::nullopt;
+		}
+
+		// other bodies are cheap to parse
+		skipws(p);
+		if(p.source.empty() || p.source[0] != '(') {
+			return std::nullopt;
+		}
+
+		auto body = skipForm(p);
+		if(nextToken(p).kind != TokenKind::eClose) {
+			return std::nullopt;
+		}
+
+		auto symbol = intern(p, name.text);
+		parser = p;
+		return LazyDefine{{name.text, symbol}, body, open.loc};
+	} catch(const CompileError&) {
+		return std::nullopt;
 	}
+}
+
+const List* asForm(const Expression& expr, std::string_view keyword) {
+	auto list = std::get_if<List>(&expr.value);
+	if(!list || list->values.empty() ||
+			!std::holds_alternative<Identifier>(list->values[0].value) ||
+			std::get<Identifier>(list->values[0].value).name != keyword) {
+		return nullptr;
+	}
+
+	return list;
+}
+
+const List* asAggregate(const Expression& expr) {
+	auto list = asForm(expr, "struct");
+	return list ? list : asForm(expr, "variant");
+}
+
+const List* asDefine(const Expression& expr) {
+	auto list = asForm(expr, "define");
+	if(!list) {
+		return nullptr;
+	}
+
+	if(list->values.size() != 3) {
+		throwError("Define needs 2 arguments", expr.loc);
+	}
+
+	if(!std::holds_alternative<Identifier>(list->values[1].value)) {
+		throwError("First argument of define must be a name",
+			list->values[1].loc);
+	}
+
+	return list;
+}
+
+// Sources from this size on are parsed in parallel, if allowed.
+constexpr auto parallelParseSize = 256u * 1024u;
+
+// Forms parsed in one job are at least this big.
+constexpr auto parseJobSize = 16u * 1024u;
+
+struct ParsedForm {
+	Expression expr;
+	std::optional<LazyDefine> define; // instead of expr, see skipDefine
+	std::exception_ptr error; // rethrown when the form is reached
+};
 
-	Parser parser {source};
+// Parses all top-level forms of the source on the given threads.
+// The forms are in source order, errors are kept with their form.
+// The expressions are allocated in one of the arenas, per thread.
+std::vector<ParsedForm> parseForms(std::string_view source,
+		SymbolTable& symbols, unsigned threads, bool lazy,
+		std::deque<Arena>& arenas) {
+	auto forms = scanForms(source);
+	std::vector<ParsedForm> ret(forms.size());
+
+	std::vector<std::size_t> jobs {0u}; // first form of each job
+	auto size = std::size_t(0u);
+	for(auto i = 0u; i < forms.size(); ++i) {
+		size += forms[i].text.size();
+		if(size >= parseJobSize || i + 1 == forms.size()) {
+			jobs.push_back(i + 1);
+			size = 0u;
+		}
+	}
+
+	// per worker, so interning doesn't contend on the table
+	std::vector<std::unordered_map<std::string_view, Symbol>> caches(threads);
+	arenas.resize(threads);
+	parallelFor(jobs.size() - 1, threads, [&](std::size_t job, unsigned worker) {
+		for(auto i = jobs[job]; i < jobs[job + 1]; ++i) {
+			Parser parser {forms[i].text, forms[i].loc, &symbols,
+				&caches[worker], &arenas[worker]};
+			try {
+				if(lazy) {
+					ret[i].define = skipDefine(parser);
+				}
+
+				if(!ret[i].define) {
+					ret[i].expr = nextExpression(parser);
+				}
+			} catch(const CompileError&) {
+				ret[i].error = std::current_exception();
+			}
+		}
+	});
+
+	return ret;
+}
+
+// Like compile but throws CompileError on error.
+std::vector<u32> compileModule(std::string_view source, const Options& options,
+		ModuleCache& modules) {
+	auto stats = options.stats;
+	auto defineLog = options.defineLog;
+	// expressions of the source, released with the compilation
+	Arena localArena;
+	std::deque<Arena> localParseArenas;
+	auto workspace = options.workspace;
+	auto& arena = workspace ? workspace->arena : localArena;
+	auto& parseArenas = workspace ? workspace->parseArenas : localParseArenas;
+	arena.reset();
+	for(auto& parseArena : parseArenas) {
+		parseArena.reset();
+	}
+
+	Parser parser {source, {}, &modules.symbols()};
+	parser.arena = &arena;
 
 	Codegen codegen;
+	codegen.library = options.library;
+	codegen.stats = options.stats;
+	codegen.sizeReport = options.sizeReport;
+	codegen.maxDepth = options.maxDepth;
+	if(workspace) {
+		codegen.buf = std::move(workspace->buf);
+		codegen.buf.clear();
+		if(workspace->codegenArena) {
+			codegen.arena = std::move(workspace->codegenArena);
+			codegen.arena->reset();
+		}
+	}
+
 	Defs defs;
 	Context ctx {codegen, defs};
+
+	// definition bodies, only parsed when used
+	auto lazy = !options.strict;
+	std::deque<LazyExpression> lazyDefines;
+
+	// keeps the imported definitions alive
+	std::vector<std::shared_ptr<const Module>> imports;
+	std::unordered_set<const Module*> imported;
 	init(codegen);
 	skipws(parser);
 
-	while(!parser.source.empty()) {
-		auto expr = nextExpression(parser);
+	// big sources are parsed up front
+	std::vector<ParsedForm> parsed;
+	if(options.threads > 1 && source.size() >= parallelParseSize) {
+		auto start = stats ? Stats::Clock::now() : Stats::Clock::time_point {};
+		parsed = parseForms(source, modules.symbols(), options.threads, lazy,
+			parseArenas);
+		parser.source = {};
+		if(stats) {
+			stats->record("parse", "parse", start);
+		}
+	}
+
+	auto form = 0u;
+	while(form < parsed.size() || !parser.source.empty()) {
+		Expression expr;
+		std::optional<LazyDefine> define;
+		if(form < parsed.size()) {
+			auto& next = parsed[form++];
+			if(next.error) {
+				std::rethrow_exception(next.error);
+			}
+
+			expr = std::move(next.expr);
+			define = std::move(next.define);
+		} else {
+			auto start = stats ? Stats::Clock::now() : Stats::Clock::time_point {};
+			if(lazy) {
+				define = skipDefine(parser);
+			}
+
+			if(!define) {
+				expr = nextExpression(parser);
+			}
 
-		if(auto list = std::get_if<List>(&expr.value);
-				list && !list->values.empty() &&
-				std::holds_alternative<Identifier>(list->values[0].value) &&
-				std::get<Identifier>(list->values[0].value).name == "define") {
+			if(stats) {
+				auto& loc = define ? define->loc : expr.loc;
+				stats->record("parse " + formName(loc), "parse", start);
+			}
+		}
 
-			if(list->values.size() != 3) {
-				throwError("Define needs 2 arguments", expr.loc);
+		if(define) {
+			auto& value = lazyDefines.emplace_back(define->body, modules.symbols(),
+				&arena);
+			if(defineLog) {
+				*defineLog << "define: " << define->name.name << " " << dump(value) << "\n";
 			}
 
+			defs.insert_or_assign(define->name.symbol, DefExpr{{}, &defs, &value});
+		} else if(auto list = asDefine(expr)) {
 			// TODO: check name for keywords/builtins?
-			auto name = std::get<Identifier>(list->values[1].value).name;
-			std::cout << "define: " << name << " " << dump(list->values[2]) << "\n";
-			defs.insert_or_assign(name, DefExpr{wrap(list->values[2]), &defs});
+			auto& name = std::get<Identifier>(list->values[1].value);
+			if(defineLog) {
+				*defineLog << "define: " << name.name << " " << dump(list->values[2]) << "\n";
+			}
+
+			defs.insert_or_assign(name.symbol, DefExpr{wrap(list->values[2]), &defs});
+		} else if(auto path = asImport(expr)) {
+			auto module = modules.get(importPath(options.path, *path), expr.loc);
+			auto declare = [&](const Module& mod, unsigned i) {
+				auto& decl = mod.declarations[i];
+				auto& list = std::get<List>(decl.value);
+				auto declared = declareAggregate(codegen, list, modules.symbols());
+				for(auto& [name, function] : declared) {
+					defs.insert_or_assign(name, DefExpr{{function, decl.loc}, &defs});
+				}
+			};
+
+			forEachDefine(*module, imported, declare, [&](const Module& mod, unsigned i) {
+				auto& [name, value] = mod.defines[i];
+				if(!lazy) {
+					value.get();
+				}
+
+				if(defineLog) {
+					*defineLog << "define: " << name.name << " " << dump(value) << "\n";
+				}
+
+				defs.insert_or_assign(name.symbol, DefExpr{{}, &defs, &value});
+			});
+
+			imports.push_back(std::move(module));
+		} else if(auto list = asForm(expr, "extern")) {
+			auto function = generateExtern(ctx, *list, expr.loc);
+			auto name = std::get<Identifier>(list->values[1].value).symbol;
+			defs.insert_or_assign(name, DefExpr{{function, expr.loc}, &defs});
+		} else if(auto list = asForm(expr, "export")) {
+			auto function = generateExport(ctx, *list, expr.loc);
+			auto name = std::get<Identifier>(list->values[1].value).symbol;
+			defs.insert_or_assign(name, DefExpr{{function, expr.loc}, &defs});
+		} else if(auto list = asAggregate(expr)) {
+			auto declared = declareAggregate(codegen, *list, modules.symbols());
+			for(auto& [name, function] : declared) {
+				defs.insert_or_assign(name, DefExpr{{function, expr.loc}, &defs});
+			}
+		} else if(options.library) {
+			throwError("Libraries can only contain definitions, imports, "
+				"exports, externs, structs and variants", expr.loc);
 		} else {
+			auto start = stats ? Stats::Clock::now() : Stats::Clock::time_point {};
 			auto ret = generateExpr(ctx, expr);
+			if(stats) {
+				stats->record("codegen " + formName(expr.loc), "codegen", start);
+			}
 
 			// make sure it's an instruction, i.e. top-level expression,
 			// i.e. has type void
@@ -125,6 +479,77 @@ int main(int argc, const char** argv) {
 		skipws(parser);
 	}
 
-	auto buf = finish(codegen);
-	writeFile("test.spv", buf);
+	if(stats) {
+		for(auto& output : codegen.outputs) {
+			auto cost = estimateCost(codegen, output.begin, output.end);
+			stats->outputCosts.push_back({output.location, cost});
+		}
+	}
+
+	auto start = stats ? Stats::Clock::now() : Stats::Clock::time_point {};
+	auto ret = finish(codegen);
+	if(stats) {
+		stats->record("finish", "finish", start);
+	}
+
+	if(workspace) {
+		workspace->buf = std::move(codegen.buf);
+		workspace->codegenArena = std::move(codegen.arena);
+	}
+
+	return ret;
+}
+
+std::size_t codegenStackSize(unsigned maxDepth) {
+	// measured with unoptimized builds, optimized ones need a third
+	constexpr auto stackPerDepth = std::size_t(4096u);
+	constexpr auto stackBase = std::size_t(1024u * 1024u);
+	if(maxDepth <= defaultMaxDepth) {
+		return 0u;
+	}
+
+	return stackBase + maxDepth * stackPerDepth;
+}
+
+CompileResult compile(std::string_view source, const Options& options) {
+	ModuleCache localModules;
+	auto& modules = options.modules ? *options.modules : localModules;
+	auto run = [&]() -> CompileResult {
+		try {
+			return compileModule(source, options, modules);
+		} catch(const CompileError& err) {
+			return std::vector<Diagnostic>{diagnostic(err, modules)};
+		} catch(const std::exception& err) {
+			return std::vector<Diagnostic>{diagnostic(err)};
+		}
+	};
+
+	if(auto stackSize = codegenStackSize(options.maxDepth)) {
+		CompileResult ret;
+		try {
+			runWithStack(stackSize, [&]{ ret = run(); });
+		} catch(const std::exception& err) {
+			return std::vector<Diagnostic>{diagnostic(err)};
+		}
+
+		return ret;
+	}
+
+	return run();
+}
+
+std::string outputKey(const Options& options) {
+	// strict compilations fail for more sources
+	std::string ret = options.library ? "library" : "";
+	if(options.strict) {
+		ret += ret.empty() ? "strict" : " strict";
+	}
+
+	// deeper programs fail with a lower limit
+	if(options.maxDepth != defaultMaxDepth) {
+		ret += ret.empty() ? "" : " ";
+		ret += "depth " + std::to_string(options.maxDepth);
+	}
+
+	return ret;
 }
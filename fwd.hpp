@@ -7,14 +7,19 @@
 #include <vector>
 #include <deque>
 #include <unordered_map>
+#include <iosfwd>
+#include <string>
+#include <memory>
+#include <optional>
 
 using u32 = std::uint32_t;
 struct List;
 struct Identifier;
 struct Expression;
 struct DefExpr;
-
-using Defs = std::unordered_map<std::string_view, DefExpr>;
+struct Stats;
+struct SizeReport;
+class Defs;
 
 template<typename ...Ts>
 struct Visitor : Ts...  {
@@ -27,6 +32,11 @@ enum class PrimitiveType {
 	eFloat,
 	eBool,
 	eRecCall,
+	eFunction, // exported or imported function, see generateExtern
+	eTaggedFunction, // function value of a loop parameter, see generateTaggedCall
+	eAggregate, // struct or variant value, see Codegen::aggregates
+	eConstructor, // of a struct or variant alternative, see declareAggregate
+	eAccessor, // of a struct field, see declareAggregate
 };
 
 struct VectorType {
@@ -55,13 +65,99 @@ struct CExpression {
 
 CExpression wrap(const Expression& expr);
 
+// Body of a definition that is only parsed when it's first used, see
+// Options::strict. A handle, copies share the body. Thread-safe, so
+// definitions of cached modules can be used by concurrent compilations.
+class LazyExpression {
+public:
+	LazyExpression() = default;
+	explicit LazyExpression(const Expression& parsed);
+	// The body is parsed into the given arena, by default its own.
+	// Only the thread using the arena may use it then.
+	LazyExpression(const SourceForm& body, SymbolTable& symbols,
+		Arena* arena = nullptr);
+
+	// Parses the body on the first call.
+	// Throws CompileError for syntax errors, on every call.
+	const CExpression& get() const;
+
+	// The unparsed body, empty when it was created parsed.
+	std::string_view text() const;
+
+protected:
+	struct State;
+	std::shared_ptr<State> state_;
+};
+
 struct DefExpr {
 	CExpression expr;
 	const Defs* scope;
+	const LazyExpression* lazy {}; // instead of expr when set
+
+	// For names bound to other names, e.g. parameters passed on to the
+	// next call: the definition the names lead to, so resolving them
+	// doesn't walk the whole chain. See bind in output.cpp.
+	const DefExpr* target {};
+};
+
+// Scope of definitions. Only holds the definitions made in it, e.g. the
+// bindings of a let, the others are looked up in the enclosing scopes.
+// So nested scopes don't copy what's visible in them.
+class Defs {
+public:
+	Defs() = default;
+	explicit Defs(const Defs* parent) : parent_(parent) {}
+	Defs(const Defs&) = delete;
+	Defs& operator=(const Defs&) = delete;
+
+	// Returns the visible definition of the symbol, nullptr if there's none.
+	const DefExpr* find(Symbol symbol) const {
+		for(auto scope = this; scope; scope = scope->parent_) {
+			auto it = scope->defs_.find(symbol);
+			if(it != scope->defs_.end()) {
+				return &it->second;
+			}
+		}
+
+		return nullptr;
+	}
+
+	// Defines the symbol in this scope, shadowing enclosing definitions.
+	void insert_or_assign(Symbol symbol, DefExpr def) {
+		defs_.insert_or_assign(symbol, std::move(def));
+	}
+
+protected:
+	const Defs* parent_ {};
+	std::unordered_map<Symbol, DefExpr> defs_;
 };
 
 [[noreturn]] void throwError(std::string msg, const Location& loc);
 
+// Struct or variant type, see declareAggregate. A struct is a variant
+// with a single alternative and without tag. Values have the tag (an
+// u32, only for variants) and then the fields of all alternatives.
+struct AggregateType {
+	u32 id; // GenExpr::idtype of the values, never declared
+	std::string name;
+	bool variant;
+
+	struct Alternative {
+		std::string name;
+		Symbol symbol;
+		u32 begin; // index of the first field in values
+		u32 fields;
+	};
+
+	std::vector<Alternative> alternatives;
+	u32 size; // fields of a value, including the tag
+};
+
+// Builtins have the symbols 1 to builtinCount, see SymbolTable.
+// Returns the symbol of the builtin with the given name, 0 if there's none.
+Symbol builtinSymbol(std::string_view name);
+extern const Symbol builtinCount;
+
 // Codegen
 struct Codegen {
 	std::vector<u32> buf; // generated spirv body
@@ -83,6 +179,7 @@ struct Codegen {
 		u32 tvec4 {};
 		u32 tvoid {};
 		u32 tbool {};
+		u32 tu32 {}; // for function tags, allocated when used, see tagType
 	} types;
 
 	struct {
@@ -93,16 +190,83 @@ struct Codegen {
 		u32 id;
 		u32 location;
 		u32 idtype;
+		std::size_t begin; // range of the generated code in buf
+		std::size_t end;
 	};
 
 	struct Constant {
 		u32 id;
 		u32 value;
 		u32 type;
+		bool undef {}; // OpUndef, value is unused
+		bool composite {}; // vec4 with the constant of id value in all components
 	};
 
 	std::vector<Output> outputs;
 	std::vector<Constant> constants;
+
+	// spirv structs, only for outputs, see composite in output.cpp
+	struct StructType {
+		u32 id;
+		std::vector<u32> members;
+	};
+
+	std::vector<StructType> structTypes;
+
+	// Linked functions, see Options::library and link.hpp.
+	// Libraries have no entry point, buf only holds exported functions.
+	bool library {};
+
+	struct FunctionType {
+		u32 id;
+		u32 ret;
+		std::vector<u32> params;
+	};
+
+	struct Linkage {
+		u32 function;
+		std::string name;
+		bool exported; // otherwise imported
+	};
+
+	std::vector<FunctionType> functionTypes;
+	std::vector<Linkage> linkage;
+	std::vector<u32> declarations; // imported functions
+
+	// optional instrumentation, see stats.hpp
+	Stats* stats {};
+	SizeReport* sizeReport {};
+
+	// optional, all symbols looked up in definitions are appended.
+	// Used for dependency tracking, see session.hpp
+	std::vector<Symbol>* lookups {};
+
+	// nesting of the generated expressions and inlined definitions,
+	// see Options::maxDepth
+	u32 depth {};
+	u32 maxDepth {};
+
+	// temporaries of the code generation, e.g. deep call stacks
+	std::unique_ptr<Arena> arena {std::make_unique<Arena>()};
+
+	// Range of the last generated loop in buf, the next one may be fused
+	// into it. Code before fusionBarrier isn't moved anymore, e.g.
+	// because its position was recorded. See fuseLoops.
+	std::size_t loopBegin {};
+	std::size_t loopEnd {};
+	std::size_t fusionBarrier {};
+
+	// Functions a tagged function value can be, by the id of the tag.
+	// Only while the loop it's a parameter of is generated.
+	std::unordered_map<u32, Span<const DefExpr>> taggedFunctions;
+
+	// Declared struct and variant types and the fields of their values.
+	// Values are never generated as a whole, every field is a separate
+	// value. GenExpr::id of a value is its index in aggregates plus 1,
+	// fields that were never set (of other variant alternatives) have
+	// id 0.
+	std::vector<AggregateType> aggregateTypes;
+	std::vector<Span<const GenExpr>> aggregates;
 };
 
 struct Context {
@@ -113,3 +277,62 @@ struct Context {
 void init(Codegen& ctx);
 GenExpr generateExpr(const Context& ctx, const Expression& expr);
 std::vector<u32> finish(Codegen& ctx);
+
+// Top-level linkage forms, both return the function.
+// (extern name (param-types...) return-type) declares a function imported
+// from a library. (export name (params...) body) defines a function
+// exported by a library, params are either names (float) or (name type)
+// pairs. Types are float, bool or vec4.
+GenExpr generateExtern(const Context& ctx, const List& list, const Location& loc);
+GenExpr generateExport(const Context& ctx, const List& list, const Location& loc);
+
+// Top-level type forms, return the definitions they add.
+// (struct name fields...) defines the constructor (name fields...) and
+// the accessors (name-field value). (variant name alternatives...)
+// defines a constructor for each alternative, either (alternative) or
+// (alternative fields...), values are taken apart with 'case'.
+std::vector<std::pair<Symbol, GenExpr>> declareAggregate(Codegen& cg,
+	const List& list, SymbolTable& symbols);
+
+// Returns the list of the given top-level expression if it's a struct
+// or variant form, otherwise nullptr.
+const List* asAggregate(const Expression& expr);
+
+// Returns the list of the given top-level expression if it's a
+// definition, i.e. (define name value). Otherwise returns nullptr.
+const List* asDefine(const Expression& expr);
+
+// Definition whose body wasn't parsed yet.
+struct LazyDefine {
+	Identifier name;
+	SourceForm body;
+	Location loc; // of the define
+};
+
+// Skips the next form if it's a definition with a list as body, only
+// finding the end of the body like skipForm. Otherwise returns nothing
+// and leaves the parser as is, parsing the form reports its errors.
+std::optional<LazyDefine> skipDefine(Parser& p);
+
+// Returns the list of the given top-level expression if it's a
+// (keyword ...) form, otherwise nullptr.
+const List* asForm(const Expression& expr, std::string_view keyword);
+
+// Stack needed for code generation up to the given depth, see
+// Options::maxDepth. 0 when any thread has enough.
+std::size_t codegenStackSize(unsigned maxDepth);
+
+// Utility
+std::string readFile(std::string_view filename);
+
+// Read-only contents of a file, valid as long as storage is alive.
+// Regular files are mapped instead of copied, everything else (pipes,
+// "-" for stdin) is read into memory. Mapped files must not be
+// modified in place while mapped. Throws std::runtime_error.
+struct MappedFile {
+	std::shared_ptr<const void> storage;
+	std::string_view data;
+};
+
+MappedFile mapFile(std::string_view filename);
+void writeFile(std::string_view filename, const std::vector<u32>& buffer);
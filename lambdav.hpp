@@ -0,0 +1,101 @@
+#pragma once
+
+// Public compiler interface.
+// Compilation doesn't use any mutable global state and does no file
+// or console I/O apart from reading imported modules, so any number
+// of threads may compile concurrently.
+
+#include "parser.hpp"
+#include <memory>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include <iosfwd>
+
+struct Stats;
+struct SizeReport;
+class ModuleCache;
+
+// Version of the release. Caches and pchs are keyed on the build
+// instead, see compilerId in cache.hpp.
+constexpr const char* lambdavVersion = "0.1.0";
+
+// See Options::maxDepth. Compiling up to it needs about 4.5 MiB of
+// stack in unoptimized builds and 1.6 MiB in optimized ones, within the
+// default 8 MiB stacks of threads on Linux. Threads with smaller stacks
+// have to compile with a lower maximum depth.
+constexpr unsigned defaultMaxDepth = 2000u;
+
+// Memory reused between compilations, e.g. one per thread when
+// compiling many files. Must not be used by concurrent compilations.
+struct Workspace {
+	std::vector<std::uint32_t> buf;
+
+	// Arenas of the parsed expressions, one per parsing thread and of
+	// the code generation temporaries. Reset by every compilation.
+	Arena arena;
+	std::deque<Arena> parseArenas;
+	std::unique_ptr<Arena> codegenArena;
+};
+
+struct Options {
+	// When given, all top-level definitions are dumped into it.
+	std::ostream* defineLog {};
+
+	// Optional instrumentation, see stats.hpp.
+	// Must not be shared between concurrent compilations.
+	Stats* stats {};
+	SizeReport* sizeReport {};
+
+	// Optional scratch memory to reuse.
+	Workspace* workspace {};
+
+	// Path of the source. Imports are resolved relative to it,
+	// or to the working directory when it's empty.
+	std::string path {};
+
+	// Cache of imported modules, may be shared between concurrent
+	// compilations. When not given, every compilation uses its own.
+	ModuleCache* modules {};
+
+	// Compiles a library instead of a shader: a module without entry
+	// point that only holds the functions defined with (export ...),
+	// to be linked with shaders declaring them with (extern ...).
+	// See link.hpp.
+	bool library {};
+
+	// Parses all definitions up front. By default the bodies of
+	// definitions are only parsed when they are used, so syntax
+	// errors in unused definitions aren't reported.
+	bool strict {};
+
+	// Threads used to parse big sources: their top-level forms are
+	// split up front and parsed in parallel, then processed in source
+	// order as usual. The output and diagnostics don't depend on it.
+	unsigned threads {1};
+
+	// Maximum nesting of generated expressions and inlined definitions,
+	// deeper programs fail with a diagnostic. Parsing isn't limited.
+	// Above the default, compilations run on their own thread with a
+	// stack big enough for the depth.
+	unsigned maxDepth {defaultMaxDepth};
+};
+
+struct Diagnostic {
+	Location loc;
+	std::string message;
+	std::string file {}; // imported module it's in, empty for the source
+};
+
+// Either the generated spirv module or the errors that occurred.
+using CompileResult = std::variant<std::vector<std::uint32_t>,
+	std::vector<Diagnostic>>;
+
+// Compiles the given λV source into a spirv module.
+CompileResult compile(std::string_view source, const Options& options = {});
+
+// Returns a string identifying all options that influence the
+// generated code, e.g. for caching.
+std::string outputKey(const Options& options);
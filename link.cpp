@@ -0,0 +1,403 @@
+#include "link.hpp"
+#include "analysis.hpp"
+#include "spirv.hpp"
+
+#include <map>
+#include <set>
+#include <string>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+struct LinkInput {
+	u32 version;
+	u32 bound;
+	std::vector<const u32*> instrs;
+};
+
+struct LinkFunction {
+	u32 id;
+	u32 type;
+	bool declaration {true};
+	std::vector<u32> calls;
+	std::vector<u32> words;
+};
+
+struct LinkDecoration {
+	u32 function;
+	std::string name;
+	bool exported;
+	std::vector<u32> words;
+};
+
+[[noreturn]] void linkError(const std::string& msg) {
+	throw std::runtime_error("link: " + msg);
+}
+
+LinkInput parseModule(const std::vector<u32>& spirv) {
+	if(spirv.size() < 5 || spirv[0] != spv::MagicNumber) {
+		linkError("invalid spirv module");
+	}
+
+	LinkInput ret {spirv[1], spirv[3], {}};
+	for(auto pos = 5u; pos < spirv.size();) {
+		auto count = spirv[pos] >> 16;
+		if(count == 0 || pos + count > spirv.size()) {
+			linkError("truncated instruction");
+		}
+
+		ret.instrs.push_back(&spirv[pos]);
+		pos += count;
+	}
+
+	return ret;
+}
+
+// Whether it's a LinkageAttributes decoration.
+bool isLinkage(const u32* instr) {
+	return (instr[0] & 0xFFFFu) == spv::OpDecorate && (instr[0] >> 16) > 4 &&
+		instr[2] == spv::DecorationLinkageAttributes;
+}
+
+std::string linkageName(const u32* instr) {
+	std::string ret;
+	auto count = instr[0] >> 16;
+	for(auto i = 3u; i + 1 < count; ++i) {
+		for(auto b = 0u; b < 4; ++b) {
+			auto c = char((instr[i] >> (8 * b)) & 0xFFu);
+			if(c == '\0') {
+				return ret;
+			}
+
+			ret += c;
+		}
+	}
+
+	return ret;
+}
+
+bool isExport(const u32* instr) {
+	return instr[(instr[0] >> 16) - 1] == spv::LinkageTypeExport;
+}
+
+// Types, constants and extended instruction sets that are merged with
+// equal ones. Structs are distinct even when their members are equal.
+bool mergeable(u32 opcode) {
+	if(opcode >= spv::OpTypeVoid && opcode < spv::OpTypeForwardPointer) {
+		return opcode != spv::OpTypeStruct && opcode != spv::OpTypeOpaque;
+	}
+
+	switch(opcode) {
+		case spv::OpExtInstImport:
+		case spv::OpConstantTrue:
+		case spv::OpConstantFalse:
+		case spv::OpConstant:
+		case spv::OpConstantComposite:
+		case spv::OpConstantNull:
+			return true;
+		default:
+			return false;
+	}
+}
+
+std::vector<u32> link(const std::vector<std::vector<u32>>& spirvs) {
+	std::vector<LinkInput> inputs;
+	for(auto& spirv : spirvs) {
+		inputs.push_back(parseModule(spirv));
+	}
+
+	// exported functions get their ids upfront, so that imports can be
+	// resolved before the exporting module is processed
+	u32 bound = 1u;
+	u32 version = 0u;
+	auto executable = false;
+	std::unordered_map<std::string, u32> exports;
+	for(auto& input : inputs) {
+		version = std::max(version, input.version);
+		for(auto instr : input.instrs) {
+			executable |= (instr[0] & 0xFFFFu) == spv::OpEntryPoint;
+			if(isLinkage(instr) && isExport(instr)) {
+				auto name = linkageName(instr);
+				if(!exports.emplace(name, bound++).second) {
+					linkError("function '" + name + "' exported multiple times");
+				}
+			}
+		}
+	}
+
+	std::set<u32> capabilities;
+	std::vector<u32> extensions, extInstImports, memoryModel, entryPoints,
+		executionModes, debug, annotations, globals;
+	std::vector<LinkFunction> functions;
+	std::vector<LinkDecoration> linkage;
+	std::map<std::vector<u32>, u32> merged;
+
+	auto append = [](std::vector<u32>& dst, const std::vector<u32>& words) {
+		dst.insert(dst.end(), words.begin(), words.end());
+	};
+
+	for(auto& input : inputs) {
+		std::vector<u32> map(input.bound);
+		auto remap = [&](u32& id) {
+			if(id >= map.size()) {
+				linkError("id out of bounds");
+			}
+
+			if(!map[id]) {
+				map[id] = bound++;
+			}
+
+			id = map[id];
+		};
+
+		for(auto instr : input.instrs) {
+			if(!isLinkage(instr) || instr[1] >= map.size()) {
+				continue;
+			}
+
+			auto it = exports.find(linkageName(instr));
+			if(it != exports.end()) {
+				map[instr[1]] = it->second;
+			}
+		}
+
+		// merge types and constants. Their operands are always declared
+		// before them, so are already mapped
+		std::vector<bool> dropped(input.instrs.size());
+		for(auto i = 0u; i < input.instrs.size(); ++i) {
+			auto instr = input.instrs[i];
+			auto opcode = instr[0] & 0xFFFFu;
+			if(opcode == spv::OpFunction) {
+				break;
+			}
+
+			if(!mergeable(opcode)) {
+				continue;
+			}
+
+			auto r = resultIndex(opcode);
+			std::vector<u32> key(instr, instr + (instr[0] >> 16));
+			if(r >= key.size() || key[r] >= map.size()) {
+				linkError("invalid instruction");
+			}
+
+			auto old = key[r];
+			key[r] = 0u;
+			forEachId(key.data(), [&](u32& id) {
+				if(id) {
+					remap(id);
+				}
+			});
+
+			auto [it, inserted] = merged.emplace(key, map[old]);
+			if(inserted) {
+				it->second = map[old] ? map[old] : (map[old] = bound++);
+			} else if(!map[old] || map[old] == it->second) {
+				map[old] = it->second;
+				dropped[i] = true;
+			}
+		}
+
+		auto function = functions.size();
+		auto inFunction = false;
+		for(auto i = 0u; i < input.instrs.size(); ++i) {
+			if(dropped[i]) {
+				continue;
+			}
+
+			auto instr = input.instrs[i];
+			auto opcode = instr[0] & 0xFFFFu;
+			std::vector<u32> words(instr, instr + (instr[0] >> 16));
+			forEachId(words.data(), remap);
+
+			if(opcode == spv::OpFunction) {
+				if(words.size() != 5) {
+					linkError("invalid function");
+				}
+
+				inFunction = true;
+				function = functions.size();
+				functions.push_back({words[2], words[4], true, {}, {}});
+			}
+
+			if(inFunction) {
+				auto& func = functions[function];
+				if(opcode == spv::OpLabel) {
+					func.declaration = false;
+				} else if(opcode == spv::OpFunctionCall && words.size() > 3) {
+					func.calls.push_back(words[3]);
+				} else if(opcode == spv::OpFunctionEnd) {
+					inFunction = false;
+				}
+
+				append(func.words, words);
+				continue;
+			}
+
+			switch(opcode) {
+				case spv::OpCapability:
+					capabilities.insert(words[1]);
+					break;
+				case spv::OpExtension:
+					append(extensions, words);
+					break;
+				case spv::OpExtInstImport:
+					append(extInstImports, words);
+					break;
+				case spv::OpMemoryModel:
+					if(memoryModel.empty()) {
+						memoryModel = words;
+					}
+					break;
+				case spv::OpEntryPoint:
+					append(entryPoints, words);
+					break;
+				case spv::OpExecutionMode:
+					append(executionModes, words);
+					break;
+				case spv::OpString:
+				case spv::OpSourceExtension:
+				case spv::OpSource:
+				case spv::OpSourceContinued:
+				case spv::OpName:
+				case spv::OpMemberName:
+					append(debug, words);
+					break;
+				case spv::OpDecorate:
+					if(isLinkage(instr)) {
+						linkage.push_back({words[1], linkageName(instr),
+							isExport(instr), words});
+						break;
+					}
+					[[fallthrough]];
+				case spv::OpMemberDecorate:
+				case spv::OpDecorationGroup:
+				case spv::OpGroupDecorate:
+				case spv::OpGroupMemberDecorate:
+				case spv::OpDecorateId:
+					append(annotations, words);
+					break;
+				default:
+					append(globals, words);
+					break;
+			}
+		}
+	}
+
+	// resolve imports
+	std::unordered_map<u32, const LinkFunction*> definitions;
+	for(auto& func : functions) {
+		if(!func.declaration) {
+			definitions[func.id] = &func;
+		}
+	}
+
+	std::unordered_set<u32> resolved;
+	for(auto& link : linkage) {
+		auto def = definitions.find(link.function);
+		if(link.exported) {
+			if(def == definitions.end()) {
+				linkError("exported function '" + link.name + "' isn't defined");
+			}
+
+			continue;
+		}
+
+		if(def == definitions.end()) {
+			if(executable) {
+				linkError("unresolved function '" + link.name + "'");
+			}
+
+			continue;
+		}
+
+		for(auto& func : functions) {
+			if(func.declaration && func.id == link.function &&
+					func.type != def->second->type) {
+				linkError("function '" + link.name + "' imported with another type");
+			}
+		}
+
+		resolved.insert(link.function);
+	}
+
+	// functions callable from the entry points
+	std::unordered_set<u32> used;
+	if(executable) {
+		std::vector<u32> todo;
+		for(auto pos = 0u; pos < entryPoints.size(); pos += entryPoints[pos] >> 16) {
+			todo.push_back(entryPoints[pos + 2]);
+		}
+
+		while(!todo.empty()) {
+			auto id = todo.back();
+			todo.pop_back();
+			auto def = definitions.find(id);
+			if(def != definitions.end() && used.insert(id).second) {
+				todo.insert(todo.end(), def->second->calls.begin(),
+					def->second->calls.end());
+			}
+		}
+	}
+
+	std::unordered_set<u32> removed;
+	std::vector<u32> declarations, bodies;
+	for(auto& func : functions) {
+		if(func.declaration && resolved.count(func.id)) {
+			continue;
+		}
+
+		if(executable && !func.declaration && !used.count(func.id)) {
+			for(auto pos = 0u; pos < func.words.size(); pos += func.words[pos] >> 16) {
+				if(auto r = resultIndex(func.words[pos] & 0xFFFFu); r) {
+					removed.insert(func.words[pos + r]);
+				}
+			}
+
+			continue;
+		}
+
+		append(func.declaration ? declarations : bodies, func.words);
+	}
+
+	if(executable) {
+		capabilities.erase(spv::CapabilityLinkage);
+	} else {
+		for(auto& link : linkage) {
+			if(link.exported || !resolved.count(link.function)) {
+				append(annotations, link.words);
+			}
+		}
+	}
+
+	// names and decorations of removed functions and their values
+	auto filter = [&](std::vector<u32>& section) {
+		std::vector<u32> ret;
+		for(auto pos = 0u; pos < section.size(); pos += section[pos] >> 16) {
+			auto count = section[pos] >> 16;
+			if(count < 2 || !removed.count(section[pos + 1])) {
+				ret.insert(ret.end(), section.begin() + pos,
+					section.begin() + pos + count);
+			}
+		}
+
+		section = std::move(ret);
+	};
+
+	filter(debug);
+	filter(annotations);
+
+	std::vector<u32> ret {spv::MagicNumber, version, 0u, bound, 0u};
+	for(auto capability : capabilities) {
+		ret.push_back((2u << 16) | spv::OpCapability);
+		ret.push_back(capability);
+	}
+
+	for(auto section : {&extensions, &extInstImports, &memoryModel,
+			&entryPoints, &executionModes, &debug, &annotations, &globals,
+			&declarations, &bodies}) {
+		append(ret, *section);
+	}
+
+	return ret;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Linker for spirv modules with linkage, e.g. libraries compiled with
+// Options::library and shaders using their functions via (extern ...).
+// Ids of all modules are remapped into one id space, equal types,
+// constants and extended instruction set imports are merged and
+// imported functions are resolved to the exported definitions.
+// When one of the modules has an entry point, the result is a complete
+// shader: all imports must be resolved, linkage information is removed
+// and functions that can't be called from an entry point are dropped.
+// Otherwise the result is a library again, keeping exports and the
+// unresolved imports.
+// Throws std::runtime_error on invalid modules, unresolved imports,
+// functions exported multiple times or type mismatches.
+std::vector<std::uint32_t> link(const std::vector<std::vector<std::uint32_t>>& modules);
@@ -0,0 +1,267 @@
+#include "lambdav.hpp"
+#include "fwd.hpp"
+#include "stats.hpp"
+#include "batch.hpp"
+#include "pool.hpp"
+#include "cache.hpp"
+#include "server.hpp"
+#include "pch.hpp"
+#include "link.hpp"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <optional>
+#include <cstdlib>
+
+void printHelp() {
+	std::cout << "Usage: lambdav [options] <source> [-o <spv>]\n";
+	std::cout << "\tWill produce test.spv or the given output, - reads stdin\n";
+	std::cout << "       lambdav --batch <dir|manifest> [-j <threads>]\n";
+	std::cout << "\tCompiles all sources, writing .spv files next to them\n";
+	std::cout << "       lambdav --serve <socket>\n";
+	std::cout << "\tRuns a compile server, keeping compiler state between requests\n";
+	std::cout << "       lambdav --client <socket> [--watch] <source>\n";
+	std::cout << "\tCompiles on a server, with --watch again on every change\n";
+	std::cout << "       lambdav --emit-pch <source> -o <pch>\n";
+	std::cout << "\tWrites a precompiled image of a module and its imports\n";
+	std::cout << "Options:\n";
+	std::cout << "\t--stats: print compile time statistics\n";
+	std::cout << "\t--trace <file>: write a chrome trace of the compilation\n";
+	std::cout << "\t--size-report: attribute generated code to definitions\n";
+	std::cout << "\t--cache <dir>: cache compiled modules in dir\n";
+	std::cout << "\t\t(defaults to $LAMBDAV_CACHE_DIR if set)\n";
+	std::cout << "\t--cache-size <MiB>: maximum size of the cache\n";
+	std::cout << "\t--pch <pch>: use a precompiled module for its imports\n";
+	std::cout << "\t--library: compile a library of exported functions\n";
+	std::cout << "\t--strict: report syntax errors in unused definitions\n";
+	std::cout << "\t--max-depth <n>: maximum nesting of generated expressions\n";
+	std::cout << "\t--link <spv>: link the output with a compiled library\n";
+	std::cout << "\t-j <threads>: threads for batches and parsing big sources\n";
+}
+
+int main(int argc, const char** argv) {
+	const char* input {};
+	const char* tracePath {};
+	const char* batch {};
+	const char* serveSocket {};
+	const char* clientSocket {};
+	auto watch = false;
+	const char* emitPch {};
+	const char* output {};
+	std::vector<const char*> pchs;
+	std::vector<const char*> links;
+	auto library = false;
+	auto strict = false;
+	auto maxDepth = defaultMaxDepth;
+	const char* cacheDir = std::getenv("LAMBDAV_CACHE_DIR");
+	auto cacheSize = Cache::defaultMaxSize;
+	auto threads = defaultThreadCount();
+	auto printStats = false;
+	auto printSizes = false;
+	for(auto i = 1; i < argc; ++i) {
+		if(!std::strcmp(argv[i], "-h") || !std::strcmp(argv[i], "--help")) {
+			printHelp();
+			return -1;
+		} else if(!std::strcmp(argv[i], "--stats")) {
+			printStats = true;
+		} else if(!std::strcmp(argv[i], "--size-report")) {
+			printSizes = true;
+		} else if(!std::strcmp(argv[i], "--trace") && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if(!std::strcmp(argv[i], "--batch") && i + 1 < argc) {
+			batch = argv[++i];
+		} else if(!std::strcmp(argv[i], "--serve") && i + 1 < argc) {
+			serveSocket = argv[++i];
+		} else if(!std::strcmp(argv[i], "--client") && i + 1 < argc) {
+			clientSocket = argv[++i];
+		} else if(!std::strcmp(argv[i], "--watch")) {
+			watch = true;
+		} else if(!std::strcmp(argv[i], "--emit-pch") && i + 1 < argc) {
+			emitPch = argv[++i];
+		} else if(!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+			output = argv[++i];
+		} else if(!std::strcmp(argv[i], "--pch") && i + 1 < argc) {
+			pchs.push_back(argv[++i]);
+		} else if(!std::strcmp(argv[i], "--library")) {
+			library = true;
+		} else if(!std::strcmp(argv[i], "--strict")) {
+			strict = true;
+		} else if(!std::strcmp(argv[i], "--max-depth") && i + 1 < argc) {
+			maxDepth = std::max(std::atoi(argv[++i]), 1);
+		} else if(!std::strcmp(argv[i], "--link") && i + 1 < argc) {
+			links.push_back(argv[++i]);
+		} else if(!std::strcmp(argv[i], "--cache") && i + 1 < argc) {
+			cacheDir = argv[++i];
+		} else if(!std::strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+			cacheSize = std::strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+		} else if(!std::strcmp(argv[i], "-j") && i + 1 < argc) {
+			threads = std::max(std::atoi(argv[++i]), 1);
+		} else if(!input) {
+			input = argv[i];
+		} else {
+			printHelp();
+			return -1;
+		}
+	}
+
+	// files aren't expected to change during a single compilation
+	ModuleCache modules(!serveSocket);
+	if(emitPch) {
+		if(!output) {
+			printHelp();
+			return -1;
+		}
+
+		try {
+			writePch(*modules.get(emitPch, {}), output);
+			return 0;
+		} catch(const CompileError& err) {
+			auto diag = diagnostic(err, modules);
+			auto file = diag.file.empty() ? emitPch : diag.file.c_str();
+			std::cout << file << ":" << diag.loc.row << ":" << diag.loc.col;
+			std::cout << ": " << diag.message << "\n";
+			return -3;
+		} catch(const std::exception& err) {
+			std::cout << err.what() << "\n";
+			return -2;
+		}
+	}
+
+	for(auto pch : pchs) {
+		try {
+			modules.loadPrecompiled(pch);
+		} catch(const std::exception& err) {
+			std::cout << err.what() << "\n";
+			return -2;
+		}
+	}
+
+	if(serveSocket) {
+		try {
+			return serve(serveSocket, modules, std::cout);
+		} catch(const std::exception& err) {
+			std::cout << "Server failed: " << err.what() << "\n";
+			return -2;
+		}
+	}
+
+	if(clientSocket) {
+		if(!input) {
+			printHelp();
+			return -1;
+		}
+
+		try {
+			return runClient(clientSocket, input, watch, std::cout);
+		} catch(const std::exception& err) {
+			std::cout << err.what() << "\n";
+			return -2;
+		}
+	}
+
+	std::optional<Cache> cache;
+	if(cacheDir && *cacheDir) {
+		try {
+			cache.emplace(cacheDir, cacheSize);
+		} catch(const std::exception& err) {
+			std::cout << "Can't use cache: " << err.what() << "\n";
+		}
+	}
+
+	if(batch) {
+		try {
+			auto pcache = cache ? &*cache : nullptr;
+			auto failed = compileBatch(batch, threads, modules, std::cout, pcache);
+			return failed ? -3 : 0;
+		} catch(const std::exception& err) {
+			std::cout << "Batch compilation failed: " << err.what() << "\n";
+			return -2;
+		}
+	}
+
+	if(!input) {
+		printHelp();
+		return -1;
+	}
+
+	MappedFile source;
+	try {
+		source = mapFile(input);
+	} catch(const std::exception& err) {
+		std::cout << "Can't read input: " << err.what() << "\n";
+		return -2;
+	}
+
+	std::optional<Stats> stats;
+	if(printStats || tracePath) {
+		stats.emplace();
+	}
+
+	std::optional<SizeReport> sizeReport;
+	if(printSizes) {
+		sizeReport.emplace();
+	}
+
+	Options options;
+	options.path = std::strcmp(input, "-") ? input : "";
+	options.modules = &modules;
+	options.defineLog = &std::cout;
+	options.stats = stats ? &*stats : nullptr;
+	options.sizeReport = sizeReport ? &*sizeReport : nullptr;
+	options.library = library;
+	options.strict = strict;
+	options.maxDepth = maxDepth;
+	options.threads = threads;
+
+	auto res = cache ?
+		compileCached(*cache, source.data, options) :
+		compile(source.data, options);
+	if(auto diags = std::get_if<std::vector<Diagnostic>>(&res)) {
+		for(auto& diag : *diags) {
+			auto file = diag.file.empty() ? input : diag.file.c_str();
+			std::cout << file << ":" << diag.loc.row << ":" << diag.loc.col;
+			std::cout << ": " << diag.message << "\n";
+		}
+
+		return -3;
+	}
+
+	auto& spirv = std::get<std::vector<u32>>(res);
+	if(!links.empty()) {
+		try {
+			std::vector<std::vector<u32>> linked {std::move(spirv)};
+			for(auto path : links) {
+				auto data = readFile(path);
+				auto& lib = linked.emplace_back(data.size() / 4);
+				std::memcpy(lib.data(), data.data(), lib.size() * 4);
+			}
+
+			spirv = link(linked);
+		} catch(const std::exception& err) {
+			std::cout << err.what() << "\n";
+			return -3;
+		}
+	}
+
+	writeFile(output ? output : "test.spv", spirv);
+
+	if(printSizes) {
+		printSizeReport(*sizeReport, std::cout);
+	}
+
+	if(printStats) {
+		printSummary(*stats, std::cout);
+		if(cache) {
+			auto cstats = cache->stats();
+			std::cout << "cache: " << (cstats.hits ? "hit" : "miss") << "\n";
+		}
+	}
+
+	if(tracePath) {
+		std::ofstream ofs(tracePath);
+		writeTrace(*stats, ofs);
+	}
+}
@@ -0,0 +1,187 @@
+#include "module.hpp"
+#include "fwd.hpp"
+#include "cache.hpp"
+#include <algorithm>
+
+namespace fs = std::filesystem;
+
+const std::string_view* asImport(const Expression& expr) {
+	auto list = std::get_if<List>(&expr.value);
+	if(!list || list->values.empty() ||
+			!std::holds_alternative<Identifier>(list->values[0].value) ||
+			std::get<Identifier>(list->values[0].value).name != "import") {
+		return nullptr;
+	}
+
+	auto path = list->values.size() == 2 ?
+		std::get_if<std::string_view>(&list->values[1].value) : nullptr;
+	if(!path) {
+		throwError("import expects a path string", expr.loc);
+	}
+
+	return path;
+}
+
+fs::path importPath(std::string_view from, std::string_view path) {
+	auto ret = fs::path(path);
+	if(ret.is_relative() && !from.empty()) {
+		ret = fs::path(from).parent_path() / ret;
+	}
+
+	return ret;
+}
+
+Diagnostic diagnostic(const CompileError& err, const ModuleCache& modules) {
+	Diagnostic ret {err.loc, err.message};
+	if(err.loc.file) {
+		ret.file = modules.path(err.loc.file);
+	}
+
+	return ret;
+}
+
+Diagnostic diagnostic(const std::exception& err) {
+	return {{}, std::string("Internal error: ") + err.what()};
+}
+
+std::shared_ptr<const Module> ModuleCache::get(const fs::path& path,
+		const Location& loc) {
+	std::lock_guard lock(mutex_);
+	std::vector<std::string> stack;
+	return load(path, loc, stack);
+}
+
+bool ModuleCache::current(const Module& module) const {
+	// precompiled modules can be used without their source
+	std::error_code ec;
+	auto mtime = fs::last_write_time(module.path, ec);
+	if(ec ? !module.precompiled : mtime != module.mtime) {
+		return false;
+	}
+
+	for(auto& import : module.imports) {
+		if(!current(*import)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+std::string ModuleCache::path(unsigned id) const {
+	std::lock_guard lock(mutex_);
+	return paths_.at(id - 1);
+}
+
+std::shared_ptr<const Module> ModuleCache::load(const fs::path& path,
+		const Location& loc, std::vector<std::string>& stack) {
+	std::error_code ec;
+	auto canonical = fs::weakly_canonical(fs::absolute(path), ec).string();
+	if(ec) {
+		canonical = path.string();
+	}
+
+	if(auto it = std::find(stack.begin(), stack.end(), canonical);
+			it != stack.end()) {
+		std::string msg = "Import cycle: ";
+		for(; it != stack.end(); ++it) {
+			msg += *it + " -> ";
+		}
+
+		throwError(msg + canonical, loc);
+	}
+
+	if(auto it = modules_.find(canonical);
+			it != modules_.end() && current(*it->second)) {
+		return it->second;
+	}
+
+	auto module = std::make_shared<Module>();
+	module->path = canonical;
+	try {
+		module->mtime = fs::last_write_time(canonical);
+		auto file = mapFile(canonical);
+		if(!mapSources_) {
+			auto copy = std::make_shared<std::string>(file.data);
+			file = {copy, *copy};
+		}
+
+		module->storage = std::move(file.storage);
+		module->source = file.data;
+	} catch(const std::exception&) {
+		throwError("Can't read module '" + canonical + "'", loc);
+	}
+
+	paths_.push_back(canonical);
+	module->id = paths_.size();
+
+	stack.push_back(canonical);
+	Parser parser {module->source, {}, &symbols_};
+	parser.arena = &module->arena;
+	parser.loc.file = module->id;
+	skipws(parser);
+
+	std::string hashed = normalize(module->source);
+	while(!parser.source.empty()) {
+		if(auto define = skipDefine(parser)) {
+			module->defines.emplace_back(define->name,
+				LazyExpression(define->body, symbols_));
+			skipws(parser);
+			continue;
+		}
+
+		auto expr = nextExpression(parser);
+		if(auto list = asDefine(expr)) {
+			auto& name = std::get<Identifier>(list->values[1].value);
+			module->defines.emplace_back(name, LazyExpression(list->values[2]));
+		} else if(auto ipath = asImport(expr)) {
+			auto import = load(importPath(canonical, *ipath), expr.loc, stack);
+			hashed += '\0';
+			hashed.append(import->hash.begin(), import->hash.end());
+			module->imports.push_back(std::move(import));
+		} else if(asAggregate(expr)) {
+			module->declarations.push_back(std::move(expr));
+		} else {
+			throwError("Modules can only contain definitions, imports, "
+				"structs and variants", expr.loc);
+		}
+
+		skipws(parser);
+	}
+
+	stack.pop_back();
+	module->hash = hash(hashed);
+	modules_[canonical] = module;
+	return module;
+}
+
+std::vector<std::shared_ptr<const Module>> findImports(std::string_view source,
+		std::string_view path, ModuleCache& modules) {
+	std::vector<std::shared_ptr<const Module>> ret;
+	Arena arena;
+	Parser parser {source};
+	parser.arena = &arena;
+	try {
+		skipws(parser);
+		while(!parser.source.empty()) {
+			auto form = parser;
+			skipExpression(parser);
+
+			// only parse what could be an import
+			auto text = form.source.substr(0, parser.source.data() -
+				form.source.data());
+			if(text.substr(0, 16).find("import") != text.npos) {
+				auto expr = nextExpression(form);
+				if(auto ipath = asImport(expr)) {
+					ret.push_back(modules.get(importPath(path, *ipath), expr.loc));
+				}
+			}
+
+			skipws(parser);
+		}
+	} catch(const CompileError&) {
+		// reported when compiling
+	}
+
+	return ret;
+}
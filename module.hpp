@@ -0,0 +1,127 @@
+#pragma once
+
+#include "lambdav.hpp"
+#include "fwd.hpp"
+#include <array>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+
+// A source imported with (import "path"), parsed once.
+// Immutable after loading, shared by all compilations importing it.
+// Modules may only contain definitions, imports, structs and variants.
+struct Module {
+	unsigned id; // unique in its cache, used as Location::file
+	std::string path; // canonical
+	std::string_view source; // the expressions reference it, in storage
+	std::filesystem::file_time_type mtime;
+
+	// Hash of the normalized source and all imported modules,
+	// i.e. identifies all definitions it brings in.
+	std::array<std::uint8_t, 32> hash;
+
+	std::vector<std::shared_ptr<const Module>> imports;
+	std::vector<std::pair<Identifier, LazyExpression>> defines;
+	std::vector<Expression> declarations; // struct and variant forms
+
+	// memory the source and expressions reference, e.g. the mapped
+	// source file or pch
+	std::shared_ptr<const void> storage;
+	Arena arena; // of the expressions
+	bool precompiled {}; // loaded from a pch, without source
+};
+
+// Thread-safe cache of imported modules, e.g. for the lifetime of a
+// process, batch compilation or compile server.
+// Modules are reloaded when they (or modules they import) were
+// modified on disk.
+class ModuleCache {
+public:
+	// With mapSources, module sources are mapped instead of copied,
+	// see mapFile. Only safe when the files aren't modified in place
+	// while the cache is alive, i.e. not for a long-running process.
+	explicit ModuleCache(bool mapSources = false) : mapSources_(mapSources) {}
+
+	// Returns the module at the given path, loading it if needed.
+	// Throws CompileError on errors, e.g. import cycles. Errors are
+	// located at loc (the import) when they aren't inside a module.
+	std::shared_ptr<const Module> get(const std::filesystem::path& path,
+		const Location& loc);
+
+	// Returns whether the module and all its imports are unchanged on disk.
+	bool current(const Module& module) const;
+
+	// Returns the path of the module with the given id.
+	std::string path(unsigned id) const;
+
+	// Symbols of the identifiers in all modules. Everything compiled
+	// with this cache must be parsed with them.
+	SymbolTable& symbols() { return symbols_; }
+
+	// Loads the modules of a precompiled image (see pch.hpp). They
+	// are used for all imports of their paths, unless the files
+	// there changed. Throws std::runtime_error for invalid images.
+	std::shared_ptr<const Module> loadPrecompiled(std::string_view path);
+
+protected:
+	std::shared_ptr<const Module> load(const std::filesystem::path& path,
+		const Location& loc, std::vector<std::string>& stack);
+
+protected:
+	// Held for the whole time a module is loaded. Loading modules
+	// happens rarely, this keeps cycle detection simple.
+	mutable std::mutex mutex_;
+	std::unordered_map<std::string, std::shared_ptr<const Module>> modules_;
+	std::vector<std::string> paths_; // by id - 1
+	bool mapSources_;
+	SymbolTable symbols_;
+};
+
+// Returns the path of an import expression, i.e. (import "path").
+// Returns nullptr if the given top-level expression isn't an import.
+const std::string_view* asImport(const Expression& expr);
+
+// Converts the error into a diagnostic, with the path of the module
+// it occurred in.
+Diagnostic diagnostic(const CompileError& err, const ModuleCache& modules);
+
+// Converts other errors, e.g. failed allocations, into a diagnostic
+// without location. compile and Session::update never throw.
+Diagnostic diagnostic(const std::exception& err);
+
+// Resolves the path of an import in the file at the given path.
+std::filesystem::path importPath(std::string_view from, std::string_view path);
+
+// Loads the modules imported by the top-level forms of the given source.
+// Errors are ignored, they are reported when the source is compiled.
+std::vector<std::shared_ptr<const Module>> findImports(std::string_view source,
+	std::string_view path, ModuleCache& modules);
+
+// Calls declare(module, index) for all declarations and then f(module, index)
+// for all definitions brought in by the module, the ones of its imports
+// first. Modules in seen are skipped, i.e. every module is only imported once.
+template<typename D, typename F>
+void forEachDefine(const Module& module,
+		std::unordered_set<const Module*>& seen, D&& declare, F&& f) {
+	if(!seen.insert(&module).second) {
+		return;
+	}
+
+	for(auto& import : module.imports) {
+		forEachDefine(*import, seen, declare, f);
+	}
+
+	for(auto i = 0u; i < module.declarations.size(); ++i) {
+		declare(module, i);
+	}
+
+	for(auto i = 0u; i < module.defines.size(); ++i) {
+		f(module, i);
+	}
+}
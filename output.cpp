@@ -1,8 +1,11 @@
 #include "spirv.hpp"
 #include "fwd.hpp"
 #include "GLSL.std.450.h"
+#include "stats.hpp"
+#include "analysis.hpp"
 #include <dlg/dlg.hpp>
 
+#include <array>
 #include <vector>
 #include <memory>
 #include <string>
@@ -12,6 +15,9 @@
 #include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <iterator>
+#include <cmath>
+#include <unordered_set>
 
 const static Defs emptyDefs = {};
 
@@ -48,7 +54,8 @@ u32 write(std::vector<u32>& buf, u32 val) {
 	return 1;
 }
 
-u32 write(std::vector<u32>& buf, const std::vector<u32>& vals) {
+template<typename A>
+u32 write(std::vector<u32>& buf, const std::vector<u32, A>& vals) {
 	buf.insert(buf.end(), vals.begin(), vals.end());
 	return vals.size();
 }
@@ -75,15 +82,32 @@ u32 write(std::vector<u32>& buf, spv::Op opcode, Args&&... args) {
 
 struct BackEdge {
 	u32 block;
-	std::vector<u32> params;
+	Span<u32> params; // in Codegen::arena
 };
 
 struct RecData {
 	// u32 header;
 	u32 cont;
 
-	std::vector<u32> paramTypes;
-	std::vector<BackEdge> loops;
+	// per phi, 0 for functions that are always the same. Parameters
+	// have a phi per field, see flatten.
+	std::pmr::vector<u32> paramIDs;
+	std::pmr::vector<u32> paramTypes;
+	std::pmr::vector<BackEdge> loops; // params are per phi as well
+
+	// per parameter
+	std::pmr::vector<Span<const DefExpr>> functions; // see LoopParam
+	std::pmr::vector<GenExpr> shapes; // initial value, for flatten
+	std::pmr::vector<u32> firstPhis; // index of the first phi
+
+	// Index of the accumulator of a recursion, -1 if there's none. Its
+	// type is only known once it is combined with a value, see
+	// typeAccumulator.
+	int accum {-1};
+	Type accumType {PrimitiveType::eFloat};
+
+	explicit RecData(Arena& arena) : paramIDs(&arena), paramTypes(&arena),
+		loops(&arena), functions(&arena), shapes(&arena), firstPhis(&arena) {}
 };
 
 struct RecContext : public Context {
@@ -91,29 +115,146 @@ struct RecContext : public Context {
 };
 
 struct CallArgs {
-	const std::vector<CExpression>* values;
+	Span<Expression> values;
 	const Defs* defs;
 };
 
+// Arguments of the pending applications, innermost last.
+using CallStack = Span<const CallArgs>;
+
+// Call stacks up to this depth are kept on the stack, deeper ones
+// are allocated in Codegen::arena.
+constexpr auto inlineCallDepth = 8u;
+
+// Number of words generated so far, including declared constants.
+u32 wordCount(const Codegen& cg) {
+	constexpr auto constantWords = 4u;
+	return cg.buf.size() + constantWords * cg.constants.size();
+}
+
+// Returns the value of the definition, parsing lazy ones.
+const CExpression& expression(const DefExpr& def) {
+	return def.lazy ? def.lazy->get() : def.expr;
+}
+
+// Returns the definition of a name bound to expr in the given scope,
+// e.g. a let binding or parameter. When expr is a name, its target is
+// set to where resolve would end up following it.
+DefExpr bind(const Codegen& cg, const Expression& expr, const Defs* defs) {
+	auto ret = DefExpr{wrap(expr), defs};
+	auto id = std::get_if<Identifier>(&expr.value);
+	if(!id || (id->symbol != 0u && id->symbol <= builtinCount)) {
+		return ret;
+	}
+
+	if(cg.lookups) {
+		cg.lookups->push_back(id->symbol);
+	}
+
+	if(auto def = defs->find(id->symbol)) {
+		ret.target = def->target ? def->target : def;
+	}
+
+	return ret;
+}
+
+// Counts a level of nesting, i.e. a generated list or an inlined
+// definition, while it's alive. Throws when there are too many.
+struct DepthGuard {
+	Codegen& cg;
+
+	DepthGuard(Codegen& cg, const Location& loc) : cg(cg) {
+		if(cg.depth >= cg.maxDepth) {
+			auto msg = dlg::format("Expression nested too deeply, "
+				"the maximum depth is {}", cg.maxDepth);
+			throwError(msg, loc);
+		}
+
+		++cg.depth;
+	}
+
+	~DepthGuard() {
+		--cg.depth;
+	}
+};
+
+// Inlines the given definition, i.e. calls gen with a context
+// for the definition's scope.
+template<typename F>
+GenExpr expand(const RecContext& ctx, std::string_view name,
+		const DefExpr& def, F&& gen) {
+	auto& cg = ctx.codegen;
+	DepthGuard depth(cg, expression(def).loc);
+	if(cg.stats) {
+		++cg.stats->definitionsInlined;
+	}
+
+	auto nctx = RecContext{cg, *def.scope, ctx.rec};
+	if(!cg.sizeReport) {
+		return gen(nctx);
+	}
+
+	cg.sizeReport->push(name, expression(def).loc, wordCount(cg));
+	auto ret = gen(nctx);
+	cg.sizeReport->pop(wordCount(cg));
+	return ret;
+}
+
 // Recursive generation
 GenExpr generateCall(const RecContext& ctx, const CExpression& expr,
-		const std::vector<CallArgs>& args);
+		CallStack args);
 GenExpr generate(const RecContext& ctx, const CExpression& expr);
 
+// For the arguments of calls
+GenExpr generateCall(const RecContext& ctx, const Expression& expr,
+		CallStack args) {
+	return generateCall(ctx, wrap(expr), args);
+}
+
+GenExpr generate(const RecContext& ctx, const Expression& expr) {
+	return generate(ctx, wrap(expr));
+}
+
+// Combines the values the predecessors of the current block end with,
+// blocks, with phis. Struct and variant values get a phi per field,
+// fields only some of the values have are undefined in the others.
+GenExpr mergeValues(Codegen& cg, Span<GenExpr> values,
+	Span<const u32> blocks, const Location& loc);
+
+// Returns the type of a struct or variant value, nullptr for others.
+const AggregateType* aggregateType(const Codegen& cg, const GenExpr& value);
+
+// Appends the fields of value to out, laid out like the ones of shape:
+// nested values are flattened, fields shape has that value doesn't set
+// are GenExpr{}. Throws if their types differ. For other values, just
+// appends value.
+void flatten(Codegen& cg, const GenExpr& shape, const GenExpr& value,
+	std::pmr::vector<GenExpr>& out, const Location& loc);
+
+// Returns a value like shape with the given flattened fields.
+GenExpr unflatten(Codegen& cg, const GenExpr& shape, const GenExpr*& fields);
+
+// Returns an undefined value of the type of the given one.
+GenExpr undefined(Codegen& cg, const GenExpr& like);
+
+// Builds struct and variant values as spirv struct, for outputs.
+// Returns other values as they are.
+GenExpr composite(Codegen& cg, const GenExpr& value);
+
 using BuiltinGen = GenExpr(*)(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args);
+		CallStack args);
 
 GenExpr generateIf(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.empty()) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args.back().values->size() != 4) {
+	if(args.back().values.size() != 4) {
 		throwError("'if' needs 3 arguments", loc);
 	}
 
-	auto cond = generate(ctx, (*args.back().values)[1]);
+	auto cond = generate(ctx, args.back().values[1]);
 	if(cond.idtype != ctx.codegen.types.tbool) {
 		throwError("'if' condition (first arg) must be bool", loc);
 	}
@@ -134,7 +275,7 @@ GenExpr generateIf(const RecContext& ctx, const Location& loc,
 	// true label
 	write(buf, spv::OpLabel, tlabel);
 	ctx.codegen.block = tlabel;
-	auto et = generateCall(nctx, (*args.back().values)[2], nargs);
+	auto et = generateCall(nctx, args.back().values[2], nargs);
 
 	auto ptt = std::get_if<PrimitiveType>(&et.type);
 	auto rt = ptt && *ptt == PrimitiveType::eRecCall;
@@ -146,7 +287,7 @@ GenExpr generateIf(const RecContext& ctx, const Location& loc,
 	// false label
 	write(buf, spv::OpLabel, flabel);
 	ctx.codegen.block = flabel;
-	auto ef = generateCall(nctx, (*args.back().values)[3], nargs);
+	auto ef = generateCall(nctx, args.back().values[3], nargs);
 
 	auto ptf = std::get_if<PrimitiveType>(&ef.type);
 	auto rf = ptf && *ptf == PrimitiveType::eRecCall;
@@ -167,11 +308,9 @@ GenExpr generateIf(const RecContext& ctx, const Location& loc,
 		}
 
 		// otherwise we need phi instruction
-		auto phi = ++ctx.codegen.id;
-		write(buf, spv::OpPhi, et.idtype, phi,
-			et.id, tsrc, ef.id, fsrc);
-
-		return {phi, et.idtype, et.type};
+		GenExpr values[] = {et, ef};
+		u32 blocks[] = {tsrc, fsrc};
+		return mergeValues(ctx.codegen, {values, 2u}, {blocks, 2u}, loc);
 
 	// if either type is RecCall, we can make it work
 	// TODO: we should propagate it if only one of the types
@@ -187,40 +326,70 @@ GenExpr generateIf(const RecContext& ctx, const Location& loc,
 	return {0, 0, PrimitiveType::eRecCall};
 }
 
+// The accumulator of a recursion (see generateRecursion) takes the type
+// of the first value it is combined with in the body.
+void typeAccumulator(const RecContext& ctx, GenExpr& accum, GenExpr& other) {
+	auto rec = ctx.rec;
+	if(!rec || rec->accum < 0) {
+		return;
+	}
+
+	auto id = rec->paramIDs[rec->accum];
+	auto& type = rec->paramTypes[rec->accum];
+	auto value = accum.id == id ? &accum : other.id == id ? &other : nullptr;
+	if(!value || value->idtype) {
+		return;
+	}
+
+	auto& with = value == &accum ? other : accum;
+	if(!type) {
+		type = with.idtype;
+		rec->accumType = with.type;
+	}
+
+	value->idtype = type;
+	value->type = rec->accumType;
+}
+
 template<spv::Op Op>
 GenExpr generateBinop(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.size() != 1) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args[0].values->size() != 3) {
+	if(args[0].values.size() != 3) {
 		std::string msg = "binop";
 		msg += " expects 2 arguments";
 		throwError(msg, loc);
 	}
 
 	auto nctx = RecContext {ctx.codegen, *args.back().defs, ctx.rec};
-	auto e1 = generate(nctx, (*args[0].values)[1]);
-	auto e2 = generate(nctx, (*args[0].values)[2]);
+	auto e1 = generate(nctx, args[0].values[1]);
+	auto e2 = generate(nctx, args[0].values[2]);
+	typeAccumulator(ctx, e1, e2);
 	if(e1.idtype != e2.idtype) {
 		std::string msg = "binop";
 		msg += " arguments must have same type";
 		throwError(msg, loc);
 	}
 
+	if(aggregateType(ctx.codegen, e1)) {
+		throwError("binop arguments can't be structs or variants", loc);
+	}
+
 	auto oid = ++ctx.codegen.id;
 	write(ctx.codegen.buf, Op, e1.idtype, oid, e1.id, e2.id);
 	return {oid, e1.idtype, e1.type};
 }
 
 GenExpr generateVec4(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.size() != 1) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args[0].values->size() != 5) {
+	if(args[0].values.size() != 5) {
 		throwError("vec4 expects 4 arguments", loc);
 	}
 
@@ -228,8 +397,8 @@ GenExpr generateVec4(const RecContext& ctx, const Location& loc,
 
 	std::vector<u32> ids;
 	unsigned comps = 0u;
-	for(auto i = 1u; i < args[0].values->size(); ++i) {
-		auto e1 = generate(nctx, (*args[0].values)[i]);
+	for(auto i = 1u; i < args[0].values.size(); ++i) {
+		auto e1 = generate(nctx, args[0].values[i]);
 		ids.push_back(e1.id);
 
 		if(auto pt = std::get_if<PrimitiveType>(&e1.type);
@@ -239,7 +408,7 @@ GenExpr generateVec4(const RecContext& ctx, const Location& loc,
 				vt && vt->primitive == PrimitiveType::eFloat) {
 			comps += vt->count;
 		} else {
-			throwError("Unexpected type", (*args[0].values)[i].loc);
+			throwError("Unexpected type", args[0].values[i].loc);
 		}
 	}
 
@@ -259,48 +428,91 @@ GenExpr generateVec4(const RecContext& ctx, const Location& loc,
 }
 
 GenExpr generateOutput(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.size() != 1) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args[0].values->size() != 3) {
+	if(args[0].values.size() != 3) {
 		throwError("output expects 2 arguments", loc);
 	}
 
-	auto& a1 = (*args[0].values)[1];
+	if(ctx.codegen.library) {
+		throwError("Libraries can't have outputs", loc);
+	}
+
+	auto& a1 = args[0].values[1];
 	auto oloc = std::get_if<double>(&a1.value);
 	if(!oloc) {
 		throwError("First argument of output must be int", a1.loc);
 	}
 
 	auto nctx = RecContext {ctx.codegen, *args.back().defs, ctx.rec};
-	auto e1 = generate(nctx, (*args[0].values)[2]);
+	auto begin = ctx.codegen.buf.size();
+	ctx.codegen.fusionBarrier = begin;
+	auto e1 = composite(ctx.codegen, generate(nctx, args[0].values[2]));
 
 	auto oid = ++ctx.codegen.id;
-	ctx.codegen.outputs.push_back({oid, u32(*oloc), e1.idtype});
-
 	write(ctx.codegen.buf, spv::OpStore, oid, e1.id);
+
+	auto end = ctx.codegen.buf.size();
+	ctx.codegen.outputs.push_back({oid, u32(*oloc), e1.idtype, begin, end});
 	return {0, 0, PrimitiveType::eVoid};
 }
 
+GenExpr generateBudget(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	if(args.size() != 1) {
+		throwError("Invalid call nesting", loc);
+	}
+
+	if(args[0].values.size() != 3) {
+		throwError("budget expects 2 arguments", loc);
+	}
+
+	auto& a1 = args[0].values[1];
+	auto budget = std::get_if<double>(&a1.value);
+	if(!budget) {
+		throwError("First argument of budget must be a number", a1.loc);
+	}
+
+	auto nctx = RecContext {ctx.codegen, *args.back().defs, ctx.rec};
+	auto begin = ctx.codegen.buf.size();
+	ctx.codegen.fusionBarrier = begin;
+	auto ret = generate(nctx, args[0].values[2]);
+
+	auto cost = estimateCost(ctx.codegen, begin, ctx.codegen.buf.size());
+	if(cost.cost > *budget) {
+		auto msg = dlg::format("Estimated cost {} exceeds budget {} "
+			"({} loops, {} branches, {} peak live values)", cost.cost,
+			*budget, cost.loops, cost.branches, cost.peakLive);
+		throwError(msg, loc);
+	}
+
+	return ret;
+}
+
 GenExpr generateLet(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.empty()) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args.back().values->size() != 3) {
+	if(args.back().values.size() != 3) {
 		throwError("let expects two arguments", loc);
 	}
 
-	auto lets = std::get_if<List>(&(*args.back().values)[1].value);
+	auto lets = std::get_if<List>(&args.back().values[1].value);
 	if(!lets) {
 		throwError("first parameter of let must be list",
-			(*args.back().values)[1].loc);
+			args.back().values[1].loc);
+	}
+
+	Defs ndefs(&ctx.defs);
+	if(ctx.codegen.stats) {
+		++ctx.codegen.stats->scopes;
 	}
 
-	auto ndefs = ctx.defs;
 	for(auto& def : lets->values) {
 		auto list = std::get_if<List>(&def.value);
 		if(!list || list->values.size() != 2) {
@@ -314,8 +526,8 @@ GenExpr generateLet(const RecContext& ctx, const Location& loc,
 				list->values[0].loc);
 		}
 
-		auto de = DefExpr{wrap(list->values[1]), &ctx.defs};
-		ndefs.insert_or_assign(identifier->name, de);
+		auto de = bind(ctx.codegen, list->values[1], &ctx.defs);
+		ndefs.insert_or_assign(identifier->symbol, de);
 	}
 
 	auto nctx = RecContext{ctx.codegen, ndefs, ctx.rec};
@@ -323,24 +535,24 @@ GenExpr generateLet(const RecContext& ctx, const Location& loc,
 	auto nargs = args;
 	nargs.pop_back();
 
-	auto& body = (*args.back().values)[2];
+	auto& body = args.back().values[2];
 	return generateCall(nctx, body, nargs);
 }
 
 GenExpr generateEq(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.size() != 1) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args[0].values->size() != 3) {
+	if(args[0].values.size() != 3) {
 		std::string msg = "eq expects 2 arguments";
 		throwError(msg, loc);
 	}
 
 	auto nctx = RecContext {ctx.codegen, *args.back().defs, ctx.rec};
-	auto e1 = generate(nctx, (*args[0].values)[1]);
-	auto e2 = generate(nctx, (*args[0].values)[2]);
+	auto e1 = generate(nctx, args[0].values[1]);
+	auto e2 = generate(nctx, args[0].values[2]);
 	if(e1.idtype != e2.idtype || e1.idtype != ctx.codegen.types.tf32) {
 		std::string msg = "eq arguments must have same type";
 		throwError(msg, loc);
@@ -352,95 +564,333 @@ GenExpr generateEq(const RecContext& ctx, const Location& loc,
 	return {oid, ctx.codegen.types.tbool, PrimitiveType::eBool};
 }
 
-GenExpr generateFunc(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
-	if(args.size() < 2) {
-		throwError("Invalid call nesting", loc);
+// Loop fusion
+// Sibling loops like the ones of (vec4 (sum n) (max n) ...) are merged
+// into one when they run the same number of iterations and the second
+// one doesn't use anything the first computes. Only loops with the
+// shape generated for (if (eq n end) result (rec (- n step) ...)) and
+// straight-line code otherwise are fused.
+
+// Parts of a loop with that shape, as positions in Codegen::buf.
+struct LoopShape {
+	std::size_t begin; // OpBranch to the header
+	std::size_t phis; // header phis
+	std::size_t loopMerge; // OpLoopMerge, ends the phis
+	std::size_t pre; // code before the exit condition
+	std::size_t selectionMerge; // OpSelectionMerge, ends pre
+	std::size_t exit, exitEnd; // code of the exit branch
+	std::size_t next, nextEnd; // code of the branch with 'rec'
+	std::size_t contPhis, contEnd; // phis of the continue block
+	std::size_t end;
+
+	u32 preheader;
+	u32 merge; // merge block of the loop
+	u32 cond; // exit condition
+	u32 nextBlock; // label of the branch with 'rec'
+	float trips;
+};
+
+bool constantValue(const Codegen& cg, u32 id, float& value) {
+	for(auto it = cg.constants.rbegin(); it != cg.constants.rend(); ++it) {
+		if(it->id == id) {
+			std::memcpy(&value, &it->value, 4);
+			return it->type == cg.types.tf32 && !it->undef;
+		}
 	}
 
-	auto nargs = args;
-	auto& fargs = *args.back().values;
-	if(fargs.size() != 3) {
-		throwError("Invalid function definition (value count)", loc);
+	return false;
+}
+
+// Whether the constant is an integer float arithmetic is exact for.
+bool exactConstant(const Codegen& cg, u32 id, float& value) {
+	return constantValue(cg, id, value) && std::floor(value) == value &&
+		std::abs(value) < 16777216.f;
+}
+
+// Parses the loop in buf[begin, end), returns false if it doesn't have
+// the required shape.
+bool parseLoop(const Codegen& cg, std::size_t begin, std::size_t end,
+		LoopShape& loop) {
+	auto& buf = cg.buf;
+	auto pos = begin;
+	auto next = [&](spv::Op op) -> const u32* {
+		if(pos >= end || (buf[pos] & 0xFFFFu) != op) {
+			return nullptr;
+		}
+
+		auto instr = &buf[pos];
+		pos += instr[0] >> 16;
+		return instr;
+	};
+
+	// skips straight-line code
+	auto skip = [&]{
+		while(pos < end) {
+			auto type = classify(buf[pos] & 0xFFFFu);
+			if(type == OpClass::eControl || type == OpClass::eLabel ||
+					type == OpClass::ePhi) {
+				break;
+			}
+
+			pos += buf[pos] >> 16;
+		}
+	};
+
+	loop.begin = begin;
+	auto branch = next(spv::OpBranch);
+	if(!branch || !next(spv::OpLabel)) {
+		return false;
 	}
 
-	nargs.pop_back(); // pop (func) arguments
+	loop.phis = pos;
+	while(auto phi = next(spv::OpPhi)) {
+		if((phi[0] >> 16) != 7u) {
+			return false;
+		}
 
-	// function arguments
-	auto pparams = std::get_if<List>(&fargs[1].value);
-	if(!pparams) {
-		throwError("Invalid function definition (param)", loc);
+		loop.preheader = phi[4];
 	}
 
-	auto& params = pparams->values;
-	if(args.empty()) {
-		throwError("Function without parameters not allowed", loc);
+	loop.loopMerge = pos;
+	auto loopMerge = next(spv::OpLoopMerge);
+	if(!loopMerge || loop.loopMerge == loop.phis || !next(spv::OpBranch) ||
+			!next(spv::OpLabel)) {
+		return false;
 	}
 
-	// call arguments
-	auto& cargs = *nargs.back().values;
-	if(params.size() + 1 != cargs.size()) {
-		auto msg = dlg::format("Function call with invalid number "
-			"of params: Expected {}, got {}", params.size(),
-			cargs.size() - 1);
-		throwError(msg, loc);
+	loop.merge = loopMerge[1];
+	loop.pre = pos;
+	skip();
+
+	loop.selectionMerge = pos;
+	auto selectionMerge = next(spv::OpSelectionMerge);
+	auto cond = next(spv::OpBranchConditional);
+	if(!selectionMerge || !cond) {
+		return false;
 	}
 
-	auto& body = fargs[2];
-	auto ndefs = ctx.defs;
-	for(auto i = 0u; i < params.size(); ++i) {
-		auto name = std::get_if<Identifier>(&params[i].value);
-		if(!name) {
-			throwError("Invalid function definition (param identifier)",
-				loc);
+	// exit branch first, ending at the selection merge
+	loop.cond = cond[1];
+	loop.nextBlock = cond[3];
+	auto exitLabel = next(spv::OpLabel);
+	loop.exit = pos;
+	skip();
+	loop.exitEnd = pos;
+	auto exitBranch = next(spv::OpBranch);
+	if(!exitLabel || exitLabel[1] != cond[2] || !exitBranch ||
+			exitBranch[1] != selectionMerge[1]) {
+		return false;
+	}
+
+	auto nextLabel = next(spv::OpLabel);
+	loop.next = pos;
+	skip();
+	loop.nextEnd = pos;
+	auto nextBranch = next(spv::OpBranch);
+	if(!nextLabel || nextLabel[1] != cond[3] || !nextBranch ||
+			nextBranch[1] != loopMerge[2]) {
+		return false;
+	}
+
+	auto condMerge = next(spv::OpLabel);
+	auto mergeBranch = next(spv::OpBranch);
+	auto contLabel = next(spv::OpLabel);
+	if(!condMerge || condMerge[1] != selectionMerge[1] || !mergeBranch ||
+			mergeBranch[1] != loop.merge || !contLabel ||
+			contLabel[1] != loopMerge[2]) {
+		return false;
+	}
+
+	loop.contPhis = pos;
+	while(auto phi = next(spv::OpPhi)) {
+		if((phi[0] >> 16) != 5u) {
+			return false;
 		}
+	}
 
-		ndefs.insert_or_assign(name->name,
-			DefExpr{cargs[i + 1], nargs.back().defs});
+	loop.contEnd = pos;
+	auto backBranch = next(spv::OpBranch);
+	auto mergeLabel = next(spv::OpLabel);
+	if(!backBranch || backBranch[1] != branch[1] || !mergeLabel ||
+			mergeLabel[1] != loop.merge || pos != end ||
+			loop.contEnd - loop.contPhis != (loop.loopMerge - loop.phis) * 5 / 7) {
+		return false;
 	}
 
-	nargs.pop_back(); // pop args for application (call args)
-	auto nctx = RecContext {ctx.codegen, ndefs, ctx.rec};
-	return generateCall(nctx, body, nargs);
+	loop.end = end;
+
+	// exit condition: counter compared with a constant
+	auto def = [&](u32 id, std::size_t from, std::size_t to) -> const u32* {
+		for(auto p = from; p < to; p += buf[p] >> 16) {
+			if(auto r = resultIndex(buf[p] & 0xFFFFu); r && buf[p + r] == id) {
+				return &buf[p];
+			}
+		}
+
+		return nullptr;
+	};
+
+	auto cmp = def(loop.cond, loop.pre, loop.selectionMerge);
+	if(!cmp || (cmp[0] & 0xFFFFu) != spv::OpFOrdEqual) {
+		return false;
+	}
+
+	for(auto i = 0u; i < 2u; ++i) {
+		float target, start, step;
+		auto counter = def(cmp[3 + i], loop.phis, loop.loopMerge);
+		if(!counter || !exactConstant(cg, cmp[4 - i], target) ||
+				!exactConstant(cg, counter[3], start)) {
+			continue;
+		}
+
+		// counter +/- step in the branch with 'rec'
+		auto cont = def(counter[5], loop.contPhis, loop.contEnd);
+		auto inc = cont ? def(cont[3], loop.next, loop.nextEnd) : nullptr;
+		if(!inc) {
+			continue;
+		}
+
+		auto op = inc[0] & 0xFFFFu;
+		auto stepID = inc[3] == counter[2] ? inc[4] :
+			op == spv::OpFAdd && inc[4] == counter[2] ? inc[3] : 0u;
+		if((op != spv::OpFAdd && op != spv::OpFSub) || !stepID ||
+				!exactConstant(cg, stepID, step) || step == 0.f) {
+			continue;
+		}
+
+		loop.trips = (target - start) / (op == spv::OpFSub ? -step : step);
+		if(loop.trips >= 0.f && std::floor(loop.trips) == loop.trips) {
+			return true;
+		}
+	}
+
+	return false;
 }
 
-GenExpr generateRecFunc(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
-	if(args.size() != 2) {
-		throwError("Invalid call nesting", loc);
+// Fuses the loop just generated at buf[begin, end) into the previous one
+// if possible, see above. Records it as previous loop for the next one.
+void fuseLoops(Codegen& cg, std::size_t begin) {
+	auto& buf = cg.buf;
+	auto prevBegin = cg.loopBegin;
+	auto prevEnd = cg.loopEnd;
+	cg.loopBegin = begin;
+	cg.loopEnd = buf.size();
+
+	LoopShape a, b;
+	if(prevBegin < cg.fusionBarrier || prevEnd > begin || prevEnd <= prevBegin ||
+			!parseLoop(cg, prevBegin, prevEnd, a) ||
+			!parseLoop(cg, begin, buf.size(), b) ||
+			a.trips != b.trips || b.preheader != a.merge) {
+		return;
 	}
 
-	auto nargs = args;
-	auto& fargs = *args.back().values;
-	if(fargs.size() != 3) {
-		throwError("Invalid function definition (value count)", loc);
+	// the code between the loops moves in front of the first one,
+	// neither it nor the second loop may use anything the first defines
+	std::unordered_set<u32> defined;
+	for(auto pos = a.begin; pos < a.end; pos += buf[pos] >> 16) {
+		if(auto r = resultIndex(buf[pos] & 0xFFFFu)) {
+			defined.insert(buf[pos + r]);
+		}
 	}
 
-	nargs.pop_back(); // pop (func) arguments
+	// the exit condition of the second loop isn't needed anymore
+	auto condUses = 0u;
+	auto independent = true;
+	for(auto pos = a.end; pos < b.end; pos += buf[pos] >> 16) {
+		auto type = classify(buf[pos] & 0xFFFFu);
+		if(pos < b.begin && (type == OpClass::eControl ||
+				type == OpClass::eLabel || type == OpClass::ePhi)) {
+			return;
+		}
 
-	// function arguments
-	auto pparams = std::get_if<List>(&fargs[1].value);
-	if(!pparams) {
-		throwError("Invalid function definition (param)", loc);
+		auto phi = pos >= b.phis && pos < b.loopMerge;
+		forEachId(&buf[pos], [&](const u32& id) {
+			// the preheader of the second loop is the first one's merge block
+			auto preheader = phi && &id == &buf[pos + 4];
+			independent &= preheader || !defined.count(id);
+			condUses += id == b.cond;
+		});
 	}
 
-	auto& params = pparams->values;
-	if(args.empty()) {
-		throwError("Function call without params", loc);
+	if(!independent) {
+		return;
 	}
 
-	// call arguments
-	auto& cargs = *nargs.back().values;
-	if(params.size() + 1 != cargs.size()) {
-		auto msg = dlg::format("Function call with invalid number "
-			"of params: Expected {}, got {}", params.size(),
-			cargs.size() - 1);
-		throwError(msg, loc);
+	if(cg.stats) {
+		++cg.stats->loopsFused;
+		cg.stats->rewritten(buf, a.begin);
 	}
 
-	auto& body = fargs[2];
+	auto range = [&](std::vector<u32>& dst, std::size_t from, std::size_t to) {
+		dst.insert(dst.end(), buf.begin() + from, buf.begin() + to);
+	};
+
+	std::vector<u32> fused;
+	range(fused, a.end, b.begin);
+	auto fusedBegin = a.begin + fused.size();
+
+	range(fused, a.begin, a.loopMerge);
+	for(auto pos = b.phis; pos < b.loopMerge; pos += 7) {
+		auto phi = fused.size();
+		range(fused, pos, pos + 7);
+		fused[phi + 4] = a.preheader;
+		fused[phi + 6] = buf[a.loopMerge + 2];
+	}
+
+	range(fused, a.loopMerge, a.selectionMerge);
+	for(auto pos = b.pre; pos < b.selectionMerge; pos += buf[pos] >> 16) {
+		auto r = resultIndex(buf[pos] & 0xFFFFu);
+		if(condUses > 2u || !r || buf[pos + r] != b.cond) {
+			range(fused, pos, pos + (buf[pos] >> 16));
+		}
+	}
+
+	range(fused, a.selectionMerge, a.exitEnd);
+	range(fused, b.exit, b.exitEnd);
+	range(fused, a.exitEnd, a.nextEnd);
+	range(fused, b.next, b.nextEnd);
+	range(fused, a.nextEnd, a.contEnd);
+	for(auto pos = b.contPhis; pos < b.contEnd; pos += 5) {
+		auto phi = fused.size();
+		range(fused, pos, pos + 5);
+		fused[phi + 4] = a.nextBlock;
+	}
+
+	range(fused, a.contEnd, a.end);
+
+	buf.resize(a.begin);
+	buf.insert(buf.end(), fused.begin(), fused.end());
+	cg.loopBegin = fusedBegin;
+	cg.loopEnd = buf.size();
+	cg.block = a.merge;
+}
+
+// Parameter of a loop, see generateLoop.
+struct LoopParam {
+	Symbol symbol;
+	GenExpr init; // value in the first iteration
+	Location loc;
+
+	// For function values, the functions it can be (see loopFunctions),
+	// init is the tag of the first one. Parameters that can only be
+	// one function are bound to it directly and have no init.
+	Span<const DefExpr> functions {};
+
+	// For the accumulator of a recursion, init is unset: the loop starts
+	// it with this value once its type is known, see typeAccumulator.
+	float identity {};
+};
+
+// Generates body as structured loop with the given parameters bound
+// in defs. 'rec' in the body branches to the next iteration, all other
+// results leave the loop. See rec-func.
+GenExpr generateLoop(const RecContext& ctx, Defs& defs,
+		Span<const LoopParam> params, const Expression& body,
+		CallStack args) {
 	auto& cg = ctx.codegen;
 
+	auto begin = cg.buf.size();
+
 	// generate blocks
 	auto hb = ++cg.id; // header block
 	auto lb = ++cg.id; // first loop block
@@ -448,55 +898,70 @@ GenExpr generateRecFunc(const RecContext& ctx, const Location& loc,
 	auto mb = ++cg.id; // merge block
 
 	// generate parameters
-	auto ndefs = ctx.defs;
-	RecData rec;
-
-	std::vector<u32> paramIDs;
-	std::vector<u32> initIDs;
-	for(auto i = 0u; i < params.size(); ++i) {
-		// NOTE: this is where it becomes apparent that
-		// we can't pass functions (as first-class
-		// parameters) to a recursive function.
-		// Trying to generate instructions for a function
-		// will fail.
-		auto& param = cargs[i + 1];
+	RecData rec(*cg.arena);
+	std::pmr::vector<u32> inits(cg.arena.get()); // per phi
+	std::pmr::vector<GenExpr> fields(cg.arena.get());
+	const LoopParam* accum {};
+	for(auto& param : params) {
+		rec.functions.push_back(param.functions);
+		rec.shapes.push_back(param.init);
+		rec.firstPhis.push_back(rec.paramIDs.size());
+		if(param.functions.size() == 1u) {
+			rec.paramIDs.push_back(0u);
+			rec.paramTypes.push_back(0u);
+			inits.push_back(0u);
+			defs.insert_or_assign(param.symbol, param.functions[0]);
+			continue;
+		}
 
-		auto nctx = RecContext{ctx.codegen, *args[1].defs, ctx.rec};
-		auto e = generate(nctx, param);
-		if(e.id == 0) {
-			throwError("Invalid parameter expr", param.loc);
+		// the accumulator is the only parameter without initial value
+		if(!param.init.id) {
+			accum = &param;
+			rec.accum = rec.paramIDs.size();
 		}
-		initIDs.push_back(e.id);
 
-		auto paramID = ++cg.id;
-		rec.paramTypes.push_back(e.idtype);
-		paramIDs.push_back(paramID);
+		// fields the initial value doesn't set start undefined,
+		// as floats since their type isn't known
+		fields.clear();
+		flatten(cg, param.init, param.init, fields, param.loc);
+		for(auto& field : fields) {
+			if(!field.id && &param != accum) {
+				field = undefined(cg, {0u, cg.types.tf32, PrimitiveType::eFloat});
+			}
 
-		auto name = std::get_if<Identifier>(&params[i].value);
-		if(!name) {
-			throwError("Invalid function definition (param identifier)",
-				loc);
+			inits.push_back(field.id);
+			rec.paramTypes.push_back(field.idtype);
+			rec.paramIDs.push_back(field.id = ++cg.id);
 		}
 
-		auto paramExpr = e;
-		paramExpr.id = paramID;
-		ndefs.insert_or_assign(name->name,
+		auto phis = static_cast<const GenExpr*>(fields.data());
+		auto paramExpr = unflatten(cg, param.init, phis);
+		defs.insert_or_assign(param.symbol,
 			DefExpr{{{paramExpr}, param.loc}, &emptyDefs});
+		if(!param.functions.empty()) {
+			cg.taggedFunctions.emplace(paramExpr.id, param.functions);
+		}
 	}
 
 	// [header block]
 	write(cg.buf, spv::OpBranch, hb);
 	write(cg.buf, spv::OpLabel, hb);
 
-	std::vector<u32> contPhis; // output ids of phis in cont block
-	for(auto i = 0u; i < params.size(); ++i) {
-		auto contID = ++cg.id;
+	std::pmr::vector<u32> contPhis(cg.arena.get()); // output ids of phis in cont block
+	auto accumPhi = std::size_t(0u); // patched once its type is known
+	for(auto i = 0u; i < rec.paramIDs.size(); ++i) {
+		auto contID = rec.paramIDs[i] ? ++cg.id : 0u;
 		contPhis.push_back(contID);
-		write(cg.buf, spv::OpPhi, rec.paramTypes[i], paramIDs[i],
-			initIDs[i], cg.block, contID, cb);
+		if(int(i) == rec.accum) {
+			accumPhi = cg.buf.size();
+		}
+
+		if(contID) {
+			write(cg.buf, spv::OpPhi, rec.paramTypes[i], rec.paramIDs[i],
+				inits[i], cg.block, contID, cb);
+		}
 	}
 
-	nargs.pop_back(); // pop call arguments
 	write(cg.buf, spv::OpLoopMerge, mb, cb, spv::LoopControlMaskNone);
 	write(cg.buf, spv::OpBranch, lb);
 
@@ -504,18 +969,38 @@ GenExpr generateRecFunc(const RecContext& ctx, const Location& loc,
 	write(cg.buf, spv::OpLabel, lb);
 
 	// insert function body
-	// rec.header = hb;
 	rec.cont = cb;
-	auto nctx = RecContext {cg, ndefs, &rec};
-	cg.block = cb;
+	auto nctx = RecContext {cg, defs, &rec};
+	cg.block = lb;
 
-	auto ret = generateCall(nctx, body, nargs);
+	auto ret = generateCall(nctx, body, args);
 	write(cg.buf, spv::OpBranch, mb);
 
+	if(accum) {
+		auto& param = *accum;
+		auto& type = rec.paramTypes[rec.accum];
+		auto init = generate(nctx, CExpression{double(param.identity), param.loc});
+		if(type == cg.types.tvec4) {
+			auto oid = ++cg.id;
+			cg.constants.push_back({oid, init.id, type, false, true});
+			init.id = oid;
+		} else if(type && type != cg.types.tf32) {
+			throwError("Accumulated values must be floats or vec4s", param.loc);
+		}
+
+		type = type ? type : cg.types.tf32;
+		cg.buf[accumPhi + 1] = type;
+		cg.buf[accumPhi + 3] = init.id;
+	}
+
 	// [continue block]
 	write(cg.buf, spv::OpLabel, cb);
-	for(auto i = 0u; i < params.size(); ++i) {
-		std::vector<u32> phiParams;
+	for(auto i = 0u; i < rec.paramIDs.size(); ++i) {
+		if(!contPhis[i]) {
+			continue;
+		}
+
+		std::pmr::vector<u32> phiParams(cg.arena.get());
 		for(auto& back : rec.loops) {
 			phiParams.push_back(back.params[i]);
 			phiParams.push_back(back.block);
@@ -530,85 +1015,1671 @@ GenExpr generateRecFunc(const RecContext& ctx, const Location& loc,
 	// [merge block]
 	write(cg.buf, spv::OpLabel, mb);
 	cg.block = mb;
+
+	for(auto id : rec.paramIDs) {
+		cg.taggedFunctions.erase(id);
+	}
+
+	fuseLoops(cg, begin);
 	return ret;
 }
 
-GenExpr generateRec(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
-	if(!ctx.rec) {
-		throwError("rec can only appear in rec-func", loc);
-	}
+// Recursion
+// Recursive functions can't just be inlined: both branches of an 'if'
+// are generated, so inlining the recursive call again never ends.
+// Functions whose recursive calls are all tail calls or accumulations
+// like (+ n (f (- n 1))) are generated as rec-func loops instead.
+// A call is recursive when its head names the (func ...) list itself,
+// via a definition or via a parameter the function was passed as,
+// i.e. self-application like (self self (- n 1)).
+
+// Symbol of the accumulator, never interned, see SymbolTable.
+constexpr Symbol accumSymbol = ~Symbol(0);
+
+// Symbols of the builtins the analysis looks at. Initialized on first
+// use, the builtin table isn't available during static initialization.
+struct RecursionSymbols {
+	Symbol if_ {builtinSymbol("if")};
+	Symbol let {builtinSymbol("let")};
+	Symbol func {builtinSymbol("func")};
+	Symbol recFunc {builtinSymbol("rec-func")};
+	Symbol rec {builtinSymbol("rec")};
+	Symbol add {builtinSymbol("+")};
+	Symbol mul {builtinSymbol("*")};
+};
 
-	// NOTE: this is where it becomes apparent that we can't return
-	// first-class function values from a recursive function:
-	// inlining simply fails
-	if(args.size() != 1) {
-		std::string msg = "Invalid call nesting";
-		msg += " (recursive functions can't return function objects)";
-		throwError(msg, loc);
-	}
+const RecursionSymbols& recursionSymbols() {
+	static const RecursionSymbols symbols;
+	return symbols;
+}
 
-	auto& cargs = *args[0].values;
-	if(cargs.size() != ctx.rec->paramTypes.size() + 1) {
-		throwError("rec: invalid number of parameters", loc);
+struct Recursion {
+	Span<const Expression> func; // (func (params...) body)
+	Span<const Expression> params;
+	const Defs* defs {}; // scope of the function
+	std::uint64_t self {}; // params the function was passed as
+	std::uint64_t variant {}; // params the recursive calls change
+	Symbol op {}; // builtin of the accumulation, 0 if there's none
+	unsigned bases {}; // non-recursive results
+	bool valid {true};
+	std::pmr::vector<Symbol> shadowed; // names bound in the body
+
+	explicit Recursion(Arena& arena) : shadowed(&arena) {}
+};
+
+// What an identifier names after following definitions that are just
+// other identifiers, e.g. (define func-alias func).
+struct Resolved {
+	Symbol builtin {};
+	const CExpression* expr {}; // what it's defined as otherwise
+	const Defs* scope {}; // of expr
+
+	const List* list() const {
+		return expr ? std::get_if<List>(&expr->value) : nullptr;
 	}
+};
 
-	auto& cg = ctx.codegen;
-	BackEdge edge;
-	edge.block = cg.block;
+Resolved resolve(const Codegen& cg, Identifier id, const Defs* defs) {
+	for(auto i = 0u; i < cg.maxDepth; ++i) {
+		if(id.symbol != 0u && id.symbol <= builtinCount) {
+			return {id.symbol};
+		}
 
-	auto nctx = RecContext {ctx.codegen, *args[0].defs, ctx.rec};
-	for(auto i = 0u; i < cargs.size() - 1; ++i) {
-		// NOTE: this is where it becomes apparent that
-		// we can't pass functions (as first-class
-		// parameters) to a recursive function.
-		// Trying to generate instructions for a function
-		// will fail.
-		auto& param = cargs[i + 1];
-		auto e = generate(nctx, param);
-		if(e.id == 0) {
-			throwError("Invalid parameter expr", param.loc);
+		// the result depends on the definition, see Session
+		if(cg.lookups) {
+			cg.lookups->push_back(id.symbol);
 		}
 
-		if(e.idtype != ctx.rec->paramTypes[i]) {
-			throwError("Type of argument must match initial type",
-				param.loc);
+		auto def = defs->find(id.symbol);
+		if(!def) {
+			return {};
 		}
 
-		dlg_assert(e.id != 0);
-		edge.params.push_back(e.id);
-	}
+		def = def->target ? def->target : def;
 
-	ctx.rec->loops.push_back(edge);
-	write(cg.buf, spv::OpBranch, ctx.rec->cont);
-	return {0, 0, PrimitiveType::eRecCall};
-}
+		// syntax errors are reported when the definition is generated
+		const CExpression* expr;
+		try {
+			expr = &expression(*def);
+		} catch(const CompileError&) {
+			return {};
+		}
 
-template<spv::Op Op>
-GenExpr generateLogicalBin(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
-	if(args.size() != 1) {
-		throwError("Invalid call nesting", loc);
-	}
+		auto next = std::get_if<Identifier>(&expr->value);
+		if(!next) {
+			return {0u, expr, def->scope};
+		}
 
-	if(args[0].values->size() < 3) {
-		std::string msg = "Function expects at least 2 argument";
-		throwError(msg, loc);
+		id = *next;
+		defs = def->scope;
 	}
 
-	// TODO: also allow boolean vectors
+	return {};
+}
+
+bool isShadowed(const Recursion& rec, Symbol symbol) {
+	auto& shadowed = rec.shadowed;
+	return std::find(shadowed.begin(), shadowed.end(), symbol) != shadowed.end();
+}
+
+// Adds the names of let bindings to the shadowed ones.
+void shadow(Recursion& rec, const Expression& bindings) {
+	if(auto list = std::get_if<List>(&bindings.value)) {
+		for(auto& binding : list->values) {
+			auto pair = std::get_if<List>(&binding.value);
+			if(pair && !pair->values.empty()) {
+				if(auto name = std::get_if<Identifier>(&pair->values[0].value)) {
+					rec.shadowed.push_back(name->symbol);
+				}
+			}
+		}
+	}
+}
+
+// Call head (or argument) as seen by the recursion analysis.
+struct Head {
+	bool self {}; // the function itself
+	Symbol builtin {};
+};
+
+Head classify(const Codegen& cg, const Recursion& rec, const Expression& expr) {
+	auto id = std::get_if<Identifier>(&expr.value);
+	if(!id) {
+		return {};
+	}
+
+	if(id->symbol != 0u && id->symbol <= builtinCount) {
+		return {false, id->symbol};
+	}
+
+	if(isShadowed(rec, id->symbol)) {
+		return {};
+	}
+
+	for(auto i = 0u; i < rec.params.size(); ++i) {
+		if(std::get<Identifier>(rec.params[i].value).symbol == id->symbol) {
+			return {bool((rec.self >> i) & 1u)};
+		}
+	}
+
+	auto res = resolve(cg, *id, rec.defs);
+	auto list = res.list();
+	auto self = list && list->values.data() == rec.func.data();
+	return {self, res.builtin};
+}
+
+bool isCall(const Codegen& cg, const Recursion& rec, const Expression& expr) {
+	auto list = std::get_if<List>(&expr.value);
+	return list && !list->values.empty() &&
+		classify(cg, rec, list->values[0]).self;
+}
+
+// Index of the operand of (op a b) that is a recursive call, 0 if none.
+unsigned accumulated(const Codegen& cg, const Recursion& rec, const List& list) {
+	if(list.values.size() != 3) {
+		return 0u;
+	}
+
+	return isCall(cg, rec, list.values[1]) ? 1u :
+		isCall(cg, rec, list.values[2]) ? 2u : 0u;
+}
+
+// Whether the expression contains a recursive call, quick check
+// before the analysis. Nested functions are skipped: recursive
+// calls in them are inlined like all other calls.
+bool callsSelf(const Codegen& cg, const Recursion& rec, const Expression& expr) {
+	auto& sym = recursionSymbols();
+	auto list = std::get_if<List>(&expr.value);
+	if(!list || list->values.empty()) {
+		return false;
+	}
+
+	auto head = classify(cg, rec, list->values[0]);
+	if(head.self) {
+		return true;
+	} else if(head.builtin == sym.func || head.builtin == sym.recFunc) {
+		return false;
+	}
+
+	for(auto& value : list->values) {
+		if(callsSelf(cg, rec, value)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void findCalls(const Codegen& cg, Recursion& rec, const Expression& expr,
+	bool tail);
+
+// Checks the arguments of a recursive call.
+void findArgs(const Codegen& cg, Recursion& rec, const List& call) {
+	if(call.values.size() != rec.params.size() + 1) {
+		rec.valid = false;
+		return;
+	}
+
+	for(auto i = 0u; i < rec.params.size(); ++i) {
+		auto& arg = call.values[i + 1];
+		if((rec.self >> i) & 1u) {
+			// has to be passed on
+			rec.valid &= classify(cg, rec, arg).self;
+			continue;
+		}
+
+		auto param = std::get<Identifier>(rec.params[i].value).symbol;
+		auto id = std::get_if<Identifier>(&arg.value);
+		if(!id || id->symbol != param || isShadowed(rec, param)) {
+			rec.variant |= std::uint64_t(1u) << i;
+		}
+
+		findCalls(cg, rec, arg, false);
+	}
+}
+
+// Checks the recursive calls in expr, fills rec.
+void findCalls(const Codegen& cg, Recursion& rec, const Expression& expr,
+		bool tail) {
+	auto& sym = recursionSymbols();
+	auto list = std::get_if<List>(&expr.value);
+	if(!list || list->values.empty() || !rec.valid) {
+		rec.bases += tail;
+		return;
+	}
+
+	auto& values = list->values;
+	auto head = classify(cg, rec, values[0]);
+	if(head.self) {
+		rec.valid &= tail;
+		findArgs(cg, rec, *list);
+		return;
+	}
+
+	if(head.builtin == sym.rec) {
+		// would branch to our loop instead of the enclosing one
+		rec.valid = false;
+		return;
+	}
+
+	if(head.builtin == sym.func || head.builtin == sym.recFunc) {
+		rec.bases += tail;
+		return;
+	}
+
+	if(tail && head.builtin == sym.if_ && values.size() == 4) {
+		findCalls(cg, rec, values[1], false);
+		findCalls(cg, rec, values[2], true);
+		findCalls(cg, rec, values[3], true);
+		return;
+	}
+
+	if(head.builtin == sym.let && values.size() == 3) {
+		auto count = rec.shadowed.size();
+		findCalls(cg, rec, values[1], false);
+		shadow(rec, values[1]);
+		findCalls(cg, rec, values[2], tail);
+		rec.shadowed.resize(count);
+		return;
+	}
+
+	if(tail && (head.builtin == sym.add || head.builtin == sym.mul)) {
+		if(auto i = accumulated(cg, rec, *list)) {
+			rec.valid &= !rec.op || rec.op == head.builtin;
+			rec.op = head.builtin;
+			findArgs(cg, rec, std::get<List>(values[i].value));
+			findCalls(cg, rec, values[3 - i], false);
+			return;
+		}
+	}
+
+	rec.bases += tail;
+	for(auto& value : values) {
+		findCalls(cg, rec, value, false);
+	}
+}
+
+// Returns whether the application of func, the list of a (func ...),
+// to the given call is recursive and can be generated as loop.
+bool findRecursion(const RecContext& ctx, Recursion& rec,
+		Span<const Expression> func, const CallArgs& call) {
+	auto& cg = ctx.codegen;
+	auto& params = std::get<List>(func[1].value).values;
+	if(params.size() > 64u) {
+		return false;
+	}
+
+	rec.func = func;
+	rec.params = params;
+	rec.defs = &ctx.defs;
+	for(auto i = 0u; i < params.size(); ++i) {
+		if(!std::holds_alternative<Identifier>(params[i].value)) {
+			return false;
+		}
+
+		auto arg = std::get_if<Identifier>(&call.values[i + 1].value);
+		if(!arg) {
+			continue;
+		}
+
+		auto res = resolve(cg, *arg, call.defs);
+		if(auto list = res.list(); list && list->values.data() == func.data()) {
+			rec.self |= std::uint64_t(1u) << i;
+		}
+	}
+
+	if(!callsSelf(cg, rec, func[2])) {
+		return false;
+	}
+
+	// without a result that isn't a recursive call, it never ends
+	findCalls(cg, rec, func[2], true);
+	return rec.valid && rec.bases > 0u;
+}
+
+// Returns (rec args...) for the given recursive call, with the
+// arguments of the changing parameters and the new accumulator.
+Expression lowerCall(Codegen& cg, const Recursion& rec, const List& call,
+		const Expression& accum, const Location& loc) {
+	auto& sym = recursionSymbols();
+	auto count = 1u + (rec.op != 0u);
+	for(auto i = 0u; i < rec.params.size(); ++i) {
+		count += (rec.variant >> i) & 1u;
+	}
+
+	auto values = cg.arena->alloc<Expression>(count);
+	auto out = values.begin();
+	new(out++) Expression{Identifier{"rec", sym.rec}, loc};
+	for(auto i = 0u; i < rec.params.size(); ++i) {
+		if((rec.variant >> i) & 1u) {
+			new(out++) Expression(call.values[i + 1]);
+		}
+	}
+
+	if(rec.op) {
+		new(out) Expression(accum);
+	}
+
+	return {List{values}, loc};
+}
+
+// Returns (op accum a), the given expression combined with the accumulator.
+Expression accumulate(Codegen& cg, const Expression& op,
+		const Expression& a, const Location& loc) {
+	auto values = cg.arena->alloc<Expression>(3u);
+	new(&values[0]) Expression(op);
+	new(&values[1]) Expression{Identifier{"accum", accumSymbol}, loc};
+	new(&values[2]) Expression(a);
+	return {List{values}, loc};
+}
+
+// Returns the expression in tail position with the recursive calls
+// replaced by 'rec' and, for accumulations, the other results combined
+// with the accumulator. Mirrors findCalls.
+Expression lowerTail(Codegen& cg, Recursion& rec, const Expression& expr) {
+	auto& sym = recursionSymbols();
+	auto list = std::get_if<List>(&expr.value);
+	auto head = Head {};
+	if(list && !list->values.empty()) {
+		head = classify(cg, rec, list->values[0]);
+	}
+
+	auto accum = Expression{Identifier{"accum", accumSymbol}, expr.loc};
+	if(head.self) {
+		return lowerCall(cg, rec, *list, accum, expr.loc);
+	}
+
+	auto values = list ? list->values : Span<Expression>{};
+	auto copy = [&]{
+		auto ret = cg.arena->alloc<Expression>(values.size());
+		std::uninitialized_copy(values.begin(), values.end(), ret.begin());
+		return ret;
+	};
+
+	if(head.builtin == sym.if_ && values.size() == 4) {
+		auto ret = copy();
+		ret[2] = lowerTail(cg, rec, values[2]);
+		ret[3] = lowerTail(cg, rec, values[3]);
+		return {List{ret}, expr.loc};
+	}
+
+	if(head.builtin == sym.let && values.size() == 3) {
+		auto count = rec.shadowed.size();
+		shadow(rec, values[1]);
+		auto ret = copy();
+		ret[2] = lowerTail(cg, rec, values[2]);
+		rec.shadowed.resize(count);
+		return {List{ret}, expr.loc};
+	}
+
+	if(head.builtin == sym.add || head.builtin == sym.mul) {
+		if(auto i = accumulated(cg, rec, *list)) {
+			auto& call = std::get<List>(values[i].value);
+			auto acc = accumulate(cg, values[0], values[3 - i], expr.loc);
+			return lowerCall(cg, rec, call, acc, values[i].loc);
+		}
+	}
+
+	if(!rec.op) {
+		return expr;
+	}
+
+	auto name = rec.op == sym.add ? "+" : "*";
+	auto op = Expression{Identifier{name, rec.op}, expr.loc};
+	return accumulate(cg, op, expr, expr.loc);
+}
+
+// Function values
+// Loop parameters can't hold functions, there are no function pointers
+// in shaders. When all functions a parameter can be are known, i.e. the
+// initial value and the arguments the 'rec' calls pass, the parameter
+// holds the index (tag) of the function instead. Applications switch
+// over the tag, with the function inlined in each case.
+
+// Returns the type of tags, its id is allocated on first use.
+u32 tagType(Codegen& cg) {
+	if(!cg.types.tu32) {
+		cg.types.tu32 = ++cg.id;
+	}
+
+	return cg.types.tu32;
+}
+
+// Returns the tag with the given index.
+GenExpr tagConstant(Codegen& cg, u32 tag) {
+	auto type = tagType(cg);
+	auto oid = ++cg.id;
+	cg.constants.push_back({oid, tag, type});
+	if(cg.stats) {
+		++cg.stats->constants;
+	}
+
+	return {oid, type, PrimitiveType::eTaggedFunction};
+}
+
+// Whether the list is a (func ...).
+bool isFunc(const Codegen& cg, const List& list, const Defs& defs) {
+	auto head = list.values.size() == 3 ?
+		std::get_if<Identifier>(&list.values[0].value) : nullptr;
+	return head && resolve(cg, *head, &defs).builtin == recursionSymbols().func;
+}
+
+// Whether the list is a (func ...) or an application that returns one,
+// e.g. (twice f) when the body of twice is a (func ...).
+bool isFunctionList(const Codegen& cg, const List& list, const Defs& defs) {
+	if(isFunc(cg, list, defs)) {
+		return true;
+	}
+
+	auto head = list.values.empty() ? nullptr :
+		std::get_if<Identifier>(&list.values[0].value);
+	if(!head) {
+		return false;
+	}
+
+	auto res = resolve(cg, *head, &defs);
+	auto func = res.list();
+	if(!func || !isFunc(cg, *func, *res.scope)) {
+		return false;
+	}
+
+	auto body = std::get_if<List>(&func->values[2].value);
+	return body && isFunc(cg, *body, *res.scope);
+}
+
+// Returns the function the expression is statically known to be, if
+// any: builtins, linked functions, tagged function values and function
+// lists as defined above. Names are resolved, see sameFunction.
+std::optional<DefExpr> functionValue(const Codegen& cg, const Expression& expr,
+		const Defs& defs) {
+	auto ret = DefExpr{wrap(expr), &defs};
+	if(auto id = std::get_if<Identifier>(&expr.value)) {
+		auto res = resolve(cg, *id, &defs);
+		if(res.builtin) {
+			auto name = Identifier{id->name, res.builtin};
+			return DefExpr{{name, expr.loc}, &emptyDefs};
+		} else if(!res.expr) {
+			return std::nullopt;
+		}
+
+		ret = DefExpr{*res.expr, res.scope};
+	}
+
+	auto function = std::visit(Visitor{
+		[&](const List& list) { return isFunctionList(cg, list, *ret.scope); },
+		[&](const GenExpr& ge) {
+			auto pt = std::get_if<PrimitiveType>(&ge.type);
+			return pt && (*pt == PrimitiveType::eFunction ||
+				*pt == PrimitiveType::eTaggedFunction);
+		},
+		[&](const auto&) { return false; },
+	}, ret.expr.value);
+
+	return function ? std::optional(ret) : std::nullopt;
+}
+
+// Whether the function values returned by functionValue are the same.
+bool sameFunction(const DefExpr& a, const DefExpr& b) {
+	return std::visit(Visitor{
+		[&](const List& list) {
+			auto other = std::get_if<List>(&b.expr.value);
+			return other && other->values.data() == list.values.data() &&
+				a.scope == b.scope;
+		},
+		[&](const Identifier& id) {
+			auto other = std::get_if<Identifier>(&b.expr.value);
+			return other && other->symbol == id.symbol;
+		},
+		[&](const GenExpr& ge) {
+			auto other = std::get_if<GenExpr>(&b.expr.value);
+			return other && other->id == ge.id;
+		},
+		[&](const auto&) { return false; },
+	}, a.expr.value);
+}
+
+// Returns the list of an (if cond a b) expression, nullptr for others.
+const List* asIf(const Codegen& cg, const Expression& expr, const Defs& defs) {
+	auto list = std::get_if<List>(&expr.value);
+	auto head = list && list->values.size() == 4 ?
+		std::get_if<Identifier>(&list->values[0].value) : nullptr;
+	auto isIf = head && resolve(cg, *head, &defs).builtin == recursionSymbols().if_;
+	return isIf ? list : nullptr;
+}
+
+struct LoopFunctions {
+	const Defs* defs {}; // scope of the loop
+	Span<const Expression> names; // bound by the loop
+	std::pmr::vector<unsigned> params; // indices of the function parameters
+	std::pmr::vector<Symbol> symbols; // of the function parameters
+	std::pmr::vector<u32> inits; // indices of their initial values
+	std::pmr::vector<DefExpr> functions;
+	std::pmr::vector<Symbol> shadowed; // names bound in the body
+	bool valid {true};
+
+	explicit LoopFunctions(Arena& arena) : params(&arena), symbols(&arena),
+		inits(&arena), functions(&arena), shadowed(&arena) {}
+};
+
+// Adds the names in the given list, or in the first values of the lists
+// in it, i.e. parameters or let bindings, to the shadowed ones.
+void shadow(LoopFunctions& lf, const Expression& names) {
+	auto list = std::get_if<List>(&names.value);
+	for(auto& value : list ? list->values : Span<Expression>{}) {
+		auto pair = std::get_if<List>(&value.value);
+		auto& name = pair && !pair->values.empty() ? pair->values[0] : value;
+		if(auto id = std::get_if<Identifier>(&name.value)) {
+			lf.shadowed.push_back(id->symbol);
+		}
+	}
+}
+
+// Returns the index of the function in lf.functions, adding it if needed.
+u32 addFunction(LoopFunctions& lf, const DefExpr& function) {
+	for(auto i = 0u; i < lf.functions.size(); ++i) {
+		if(sameFunction(lf.functions[i], function)) {
+			return i;
+		}
+	}
+
+	lf.functions.push_back(function);
+	return lf.functions.size() - 1;
+}
+
+void findFunctions(const Codegen& cg, LoopFunctions& lf, const Expression& expr);
+
+// Checks an argument 'rec' passes to a function parameter.
+void findFunction(const Codegen& cg, LoopFunctions& lf, const Expression& arg) {
+	if(auto cond = asIf(cg, arg, *lf.defs)) {
+		findFunctions(cg, lf, cond->values[1]);
+		findFunction(cg, lf, cond->values[2]);
+		findFunction(cg, lf, cond->values[3]);
+		return;
+	}
+
+	auto id = std::get_if<Identifier>(&arg.value);
+	if(!id) {
+		// only names, a (func ...) in the body could use values
+		// of the current iteration
+		lf.valid = false;
+		return;
+	}
+
+	auto& shadowed = lf.shadowed;
+	if(std::find(shadowed.begin(), shadowed.end(), id->symbol) != shadowed.end()) {
+		lf.valid = false;
+		return;
+	}
+
+	for(auto& name : lf.names) {
+		if(std::get<Identifier>(name.value).symbol == id->symbol) {
+			// passed on, fine if it's a function parameter as well
+			auto& symbols = lf.symbols;
+			lf.valid &= std::find(symbols.begin(), symbols.end(),
+				id->symbol) != symbols.end();
+			return;
+		}
+	}
+
+	auto function = functionValue(cg, arg, *lf.defs);
+	if(!function) {
+		lf.valid = false;
+		return;
+	}
+
+	addFunction(lf, *function);
+}
+
+// Collects the function arguments of the 'rec' calls of the loop in expr.
+void findFunctions(const Codegen& cg, LoopFunctions& lf, const Expression& expr) {
+	auto& sym = recursionSymbols();
+	auto list = std::get_if<List>(&expr.value);
+	if(!list || list->values.empty() || !lf.valid) {
+		return;
+	}
+
+	auto& values = list->values;
+	auto head = Symbol {};
+	if(auto id = std::get_if<Identifier>(&values[0].value)) {
+		head = resolve(cg, *id, lf.defs).builtin;
+	}
+
+	if(head == sym.recFunc) {
+		// its 'rec' calls belong to the nested loop
+		return;
+	}
+
+	if(head == sym.rec) {
+		for(auto param : lf.params) {
+			if(param + 1 >= values.size()) {
+				lf.valid = false;
+				return;
+			}
+
+			findFunction(cg, lf, values[param + 1]);
+		}
+	}
+
+	auto count = lf.shadowed.size();
+	if((head == sym.let || head == sym.func) && values.size() == 3) {
+		findFunctions(cg, lf, values[1]);
+		shadow(lf, values[1]);
+		findFunctions(cg, lf, values[2]);
+		lf.shadowed.resize(count);
+		return;
+	}
+
+	for(auto& value : values) {
+		findFunctions(cg, lf, value);
+	}
+}
+
+// Sets the functions of the loop parameters whose initial values (args,
+// in the scope argDefs) are functions, when all functions they can be
+// are known. They share the tags, so 'rec' can pass one parameter to
+// another. names are all names bound by the loop, defs is its scope.
+void loopFunctions(Codegen& cg, Span<LoopParam> params,
+		Span<const Expression* const> args, const Defs& argDefs,
+		const Expression& body, const Defs& defs, Span<const Expression> names) {
+	LoopFunctions lf(*cg.arena);
+	lf.defs = &defs;
+	lf.names = names;
+	for(auto i = 0u; i < params.size(); ++i) {
+		if(auto value = functionValue(cg, *args[i], argDefs)) {
+			lf.params.push_back(i);
+			lf.symbols.push_back(params[i].symbol);
+			lf.inits.push_back(addFunction(lf, *value));
+		}
+	}
+
+	if(lf.params.empty()) {
+		return;
+	}
+
+	findFunctions(cg, lf, body);
+	if(!lf.valid) {
+		return;
+	}
+
+	auto functions = cg.arena->alloc<DefExpr>(lf.functions.size());
+	std::uninitialized_copy(lf.functions.begin(), lf.functions.end(),
+		functions.begin());
+	if(functions.size() > 1u && cg.stats) {
+		cg.stats->functionsTagged += lf.params.size();
+	}
+
+	for(auto i = 0u; i < lf.params.size(); ++i) {
+		auto& param = params[lf.params[i]];
+		param.functions = functions;
+		if(functions.size() > 1u) {
+			param.init = tagConstant(cg, lf.inits[i]);
+		}
+	}
+}
+
+// Returns the tag of the function 'rec' passes to a function parameter,
+// 0 when all of them can only be one function.
+u32 functionTag(const RecContext& ctx, Span<const DefExpr> functions,
+		const Expression& arg) {
+	auto& cg = ctx.codegen;
+	auto tagged = functions.size() > 1u;
+	if(auto list = asIf(cg, arg, ctx.defs)) {
+		if(!tagged) {
+			functionTag(ctx, functions, list->values[2]);
+			functionTag(ctx, functions, list->values[3]);
+			return 0u;
+		}
+
+		// tags are constants or parameters, no need to branch
+		auto cond = generate(ctx, list->values[1]);
+		if(cond.idtype != cg.types.tbool) {
+			throwError("'if' condition (first arg) must be bool", arg.loc);
+		}
+
+		auto a = functionTag(ctx, functions, list->values[2]);
+		auto b = functionTag(ctx, functions, list->values[3]);
+		auto oid = ++cg.id;
+		write(cg.buf, spv::OpSelect, tagType(cg), oid, cond.id, a, b);
+		return oid;
+	}
+
+	if(auto value = functionValue(cg, arg, ctx.defs)) {
+		// parameters of the same loop
+		auto ge = std::get_if<GenExpr>(&value->expr.value);
+		if(auto it = ge ? cg.taggedFunctions.find(ge->id) : cg.taggedFunctions.end();
+				it != cg.taggedFunctions.end() && it->second.data() == functions.data()) {
+			return ge->id;
+		}
+
+		for(auto i = 0u; i < functions.size(); ++i) {
+			if(sameFunction(*value, functions[i])) {
+				return tagged ? tagConstant(cg, i).id : 0u;
+			}
+		}
+	}
+
+	throwError("rec: function arguments must be function parameters, "
+		"functions named directly or an 'if' between those", arg.loc);
+}
+
+// Applies a tagged function value: switches over the tag and inlines
+// the function in each case.
+GenExpr generateTaggedCall(const RecContext& ctx, const GenExpr& tag,
+		const Location& loc, CallStack args) {
+	auto& cg = ctx.codegen;
+	auto it = cg.taggedFunctions.find(tag.id);
+	if(it == cg.taggedFunctions.end()) {
+		throwError("Function values of loop parameters can't leave the loop", loc);
+	}
+
+	auto functions = it->second;
+	auto mb = ++cg.id; // merge block
+	std::pmr::vector<u32> labels(cg.arena.get());
+	std::pmr::vector<u32> targets(cg.arena.get());
+	for(auto i = 0u; i < functions.size(); ++i) {
+		labels.push_back(++cg.id);
+		if(i > 0u) {
+			targets.push_back(i);
+			targets.push_back(labels.back());
+		}
+	}
+
+	// the first function is the default, tags are never out of range
+	write(cg.buf, spv::OpSelectionMerge, mb, spv::SelectionControlMaskNone);
+	write(cg.buf, spv::OpSwitch, tag.id, labels[0], targets);
+
+	std::pmr::vector<GenExpr> results(cg.arena.get());
+	std::pmr::vector<u32> blocks(cg.arena.get());
+	for(auto i = 0u; i < functions.size(); ++i) {
+		write(cg.buf, spv::OpLabel, labels[i]);
+		cg.block = labels[i];
+
+		auto& function = functions[i];
+		auto nctx = RecContext{cg, *function.scope, ctx.rec};
+		auto e = generateCall(nctx, function.expr, args);
+		if(auto pt = std::get_if<PrimitiveType>(&e.type);
+				e.id == 0 || (pt && *pt == PrimitiveType::eRecCall)) {
+			throwError("Function values of loop parameters must return a value", loc);
+		} else if(i > 0u && e.idtype != results[0].idtype) {
+			throwError("Function values of loop parameters return different types", loc);
+		}
+
+		results.push_back(e);
+		blocks.push_back(cg.block);
+		write(cg.buf, spv::OpBranch, mb);
+	}
+
+	write(cg.buf, spv::OpLabel, mb);
+	cg.block = mb;
+	return mergeValues(cg, {results.data(), results.size()},
+		{blocks.data(), blocks.size()}, loc);
+}
+
+// Generates the application of a recursive function as loop, the
+// parameters the recursive calls don't change are inlined as usual.
+// Accumulations start with the identity of their operation, as float
+// or vec4 depending on what is accumulated.
+GenExpr generateRecursion(const RecContext& ctx, Recursion& rec,
+		const CallArgs& call, const Location& loc) {
+	auto& sym = recursionSymbols();
+	auto& cg = ctx.codegen;
+	Defs ndefs(&ctx.defs);
+	if(cg.stats) {
+		++cg.stats->scopes;
+		++cg.stats->recursionsLowered;
+	}
+
+	auto body = lowerTail(cg, rec, rec.func[2]);
+	std::pmr::vector<LoopParam> params(cg.arena.get());
+	std::pmr::vector<const Expression*> inits(cg.arena.get());
+	for(auto i = 0u; i < rec.params.size(); ++i) {
+		auto& arg = call.values[i + 1];
+		auto symbol = std::get<Identifier>(rec.params[i].value).symbol;
+		if(!((rec.variant >> i) & 1u)) {
+			ndefs.insert_or_assign(symbol, bind(cg, arg, call.defs));
+			continue;
+		}
+
+		params.push_back({symbol, {}, arg.loc});
+		inits.push_back(&arg);
+	}
+
+	loopFunctions(cg, {params.data(), params.size()}, {inits.data(), inits.size()},
+		*call.defs, body, *rec.defs, rec.params);
+
+	auto nctx = RecContext{cg, *call.defs, ctx.rec};
+	for(auto i = 0u; i < inits.size(); ++i) {
+		if(!params[i].functions.empty()) {
+			continue;
+		}
+
+		params[i].init = generate(nctx, *inits[i]);
+		if(params[i].init.id == 0) {
+			throwError("Invalid parameter expr", inits[i]->loc);
+		}
+	}
+
+	if(rec.op) {
+		auto& accum = params.emplace_back();
+		accum.symbol = accumSymbol;
+		accum.init = {0u, 0u, PrimitiveType::eFloat};
+		accum.loc = loc;
+		accum.identity = rec.op == sym.mul ? 1.f : 0.f;
+	}
+
+	return generateLoop(ctx, ndefs, {params.data(), params.size()}, body, {});
+}
+
+GenExpr generateFunc(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	if(args.size() < 2) {
+		throwError("Invalid call nesting", loc);
+	}
+
+	auto nargs = args;
+	auto& fargs = args.back().values;
+	if(fargs.size() != 3) {
+		throwError("Invalid function definition (value count)", loc);
+	}
+
+	nargs.pop_back(); // pop (func) arguments
+
+	// function arguments
+	auto pparams = std::get_if<List>(&fargs[1].value);
+	if(!pparams) {
+		throwError("Invalid function definition (param)", loc);
+	}
+
+	auto& params = pparams->values;
+	if(args.empty()) {
+		throwError("Function without parameters not allowed", loc);
+	}
+
+	// call arguments
+	auto& cargs = nargs.back().values;
+	if(params.size() + 1 != cargs.size()) {
+		auto msg = dlg::format("Function call with invalid number "
+			"of params: Expected {}, got {}", params.size(),
+			cargs.size() - 1);
+		throwError(msg, loc);
+	}
+
+	// recursive functions are generated as loops, if possible.
+	// Only for applications whose result isn't applied further:
+	// loops can't return functions.
+	if(nargs.size() == 1u) {
+		Recursion rec(*ctx.codegen.arena);
+		if(findRecursion(ctx, rec, fargs, nargs.back())) {
+			return generateRecursion(ctx, rec, nargs.back(), loc);
+		}
+	}
+
+	auto& body = fargs[2];
+	Defs ndefs(&ctx.defs);
+	if(ctx.codegen.stats) {
+		++ctx.codegen.stats->scopes;
+	}
+
+	for(auto i = 0u; i < params.size(); ++i) {
+		auto name = std::get_if<Identifier>(&params[i].value);
+		if(!name) {
+			throwError("Invalid function definition (param identifier)",
+				loc);
+		}
+
+		ndefs.insert_or_assign(name->symbol,
+			bind(ctx.codegen, cargs[i + 1], nargs.back().defs));
+	}
+
+	nargs.pop_back(); // pop args for application (call args)
+	auto nctx = RecContext {ctx.codegen, ndefs, ctx.rec};
+	return generateCall(nctx, body, nargs);
+}
+
+GenExpr generateRecFunc(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	if(args.size() != 2) {
+		throwError("Invalid call nesting", loc);
+	}
+
+	auto nargs = args;
+	auto& fargs = args.back().values;
+	if(fargs.size() != 3) {
+		throwError("Invalid function definition (value count)", loc);
+	}
+
+	nargs.pop_back(); // pop (func) arguments
+
+	// function arguments
+	auto pparams = std::get_if<List>(&fargs[1].value);
+	if(!pparams) {
+		throwError("Invalid function definition (param)", loc);
+	}
+
+	auto& params = pparams->values;
+	if(args.empty()) {
+		throwError("Function call without params", loc);
+	}
+
+	// call arguments
+	auto& cargs = nargs.back().values;
+	if(params.size() + 1 != cargs.size()) {
+		auto msg = dlg::format("Function call with invalid number "
+			"of params: Expected {}, got {}", params.size(),
+			cargs.size() - 1);
+		throwError(msg, loc);
+	}
+
+	auto& body = fargs[2];
+	auto& cg = ctx.codegen;
+
+	// generate parameters
+	std::pmr::vector<LoopParam> loopParams(cg.arena.get());
+	std::pmr::vector<const Expression*> inits(cg.arena.get());
+	for(auto i = 0u; i < params.size(); ++i) {
+		auto name = std::get_if<Identifier>(&params[i].value);
+		if(!name) {
+			throwError("Invalid function definition (param identifier)",
+				loc);
+		}
+
+		loopParams.push_back({name->symbol, {}, cargs[i + 1].loc});
+		inits.push_back(&cargs[i + 1]);
+	}
+
+	// functions are passed as tags, see loopFunctions.
+	// Generating instructions for any other function fails.
+	loopFunctions(cg, {loopParams.data(), loopParams.size()},
+		{inits.data(), inits.size()}, *args[1].defs, body, ctx.defs, params);
+
+	auto nctx = RecContext{cg, *args[1].defs, ctx.rec};
+	for(auto i = 0u; i < params.size(); ++i) {
+		if(!loopParams[i].functions.empty()) {
+			continue;
+		}
+
+		auto& param = cargs[i + 1];
+		loopParams[i].init = generate(nctx, param);
+		if(loopParams[i].init.id == 0) {
+			throwError("Invalid parameter expr", param.loc);
+		}
+	}
+
+	Defs ndefs(&ctx.defs);
+	if(cg.stats) {
+		++cg.stats->scopes;
+	}
+
+	nargs.pop_back(); // pop call arguments
+	return generateLoop(ctx, ndefs, {loopParams.data(), loopParams.size()},
+		body, nargs);
+}
+
+GenExpr generateRec(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	if(!ctx.rec) {
+		throwError("rec can only appear in rec-func", loc);
+	}
+
+	// NOTE: this is where it becomes apparent that we can't return
+	// first-class function values from a recursive function:
+	// inlining simply fails
+	if(args.size() != 1) {
+		std::string msg = "Invalid call nesting";
+		msg += " (recursive functions can't return function objects)";
+		throwError(msg, loc);
+	}
+
+	auto& rec = *ctx.rec;
+	auto& cargs = args[0].values;
+	if(cargs.size() != rec.functions.size() + 1) {
+		throwError("rec: invalid number of parameters", loc);
+	}
+
+	auto& cg = ctx.codegen;
+	BackEdge edge;
+	edge.params = cg.arena->alloc<u32>(rec.paramIDs.size());
+
+	auto nctx = RecContext {ctx.codegen, *args[0].defs, ctx.rec};
+	std::pmr::vector<GenExpr> fields(cg.arena.get());
+	for(auto i = 0u; i < cargs.size() - 1; ++i) {
+		// functions are passed as tags, see loopFunctions.
+		// Generating instructions for any other function fails.
+		auto& param = cargs[i + 1];
+		auto first = rec.firstPhis[i];
+		if(auto& functions = rec.functions[i]; !functions.empty()) {
+			edge.params[first] = functionTag(nctx, functions, param);
+			continue;
+		}
+
+		auto e = generate(nctx, param);
+		if(e.id == 0) {
+			throwError("Invalid parameter expr", param.loc);
+		}
+
+		// fields of other variant alternatives are undefined
+		fields.clear();
+		flatten(cg, rec.shapes[i], e, fields, param.loc);
+		for(auto f = 0u; f < fields.size(); ++f) {
+			auto type = rec.paramTypes[first + f];
+			auto field = fields[f];
+			if(!field.id) {
+				field = undefined(cg, {0u, type, PrimitiveType::eFloat});
+			}
+
+			if(field.idtype != type) {
+				throwError("Type of argument must match initial type",
+					param.loc);
+			}
+
+			edge.params[first + f] = field.id;
+		}
+	}
+
+	// the arguments may have started new blocks
+	edge.block = cg.block;
+	ctx.rec->loops.push_back(edge);
+	write(cg.buf, spv::OpBranch, ctx.rec->cont);
+	return {0, 0, PrimitiveType::eRecCall};
+}
+
+// Structs and variants
+// Scalar replacement: struct and variant values only exist during code
+// generation, as a value per field (see Codegen::aggregates). Selecting
+// a field is free and merging values after a branch or passing them to
+// the next loop iteration needs a phi per field. Only outputs build
+// them as spirv structs (see composite), they still can't be passed to
+// linked functions.
+
+const AggregateType* aggregateType(const Codegen& cg, const GenExpr& value) {
+	auto pt = std::get_if<PrimitiveType>(&value.type);
+	if(!pt || *pt != PrimitiveType::eAggregate) {
+		return nullptr;
+	}
+
+	for(auto& type : cg.aggregateTypes) {
+		if(type.id == value.idtype) {
+			return &type;
+		}
+	}
+
+	return nullptr;
+}
+
+GenExpr aggregateValue(Codegen& cg, const AggregateType& type,
+		Span<const GenExpr> fields) {
+	cg.aggregates.push_back(fields);
+	return {u32(cg.aggregates.size()), type.id, PrimitiveType::eAggregate};
+}
+
+GenExpr undefined(Codegen& cg, const GenExpr& like) {
+	if(auto type = aggregateType(cg, like)) {
+		auto fields = cg.arena->alloc<GenExpr>(type->size);
+		std::uninitialized_fill(fields.begin(), fields.end(), GenExpr {});
+		return aggregateValue(cg, *type, fields);
+	}
+
+	auto oid = ++cg.id;
+	cg.constants.push_back({oid, 0u, like.idtype, true});
+	return {oid, like.idtype, like.type};
+}
+
+GenExpr mergeValues(Codegen& cg, Span<GenExpr> values,
+		Span<const u32> blocks, const Location& loc) {
+	auto it = std::find_if(values.begin(), values.end(),
+		[](auto& value) { return value.id != 0u; });
+	if(it == values.end()) {
+		return {};
+	}
+
+	auto like = *it;
+	for(auto& value : values) {
+		if(value.id == 0u) {
+			value = undefined(cg, like);
+		} else if(value.idtype != like.idtype) {
+			throwError("Variant alternatives have fields of different types", loc);
+		}
+	}
+
+	// e.g. a field that is the same in all branches
+	if(std::all_of(values.begin(), values.end(),
+			[&](auto& value) { return value.id == values[0].id; })) {
+		return values[0];
+	}
+
+	auto type = aggregateType(cg, like);
+	if(!type) {
+		std::pmr::vector<u32> phiParams(cg.arena.get());
+		for(auto i = 0u; i < values.size(); ++i) {
+			phiParams.push_back(values[i].id);
+			phiParams.push_back(blocks[i]);
+		}
+
+		auto oid = ++cg.id;
+		write(cg.buf, spv::OpPhi, like.idtype, oid, phiParams);
+		return {oid, like.idtype, like.type};
+	}
+
+	auto fields = cg.arena->alloc<GenExpr>(type->size);
+	auto column = cg.arena->alloc<GenExpr>(values.size());
+	for(auto f = 0u; f < type->size; ++f) {
+		for(auto i = 0u; i < values.size(); ++i) {
+			new(&column[i]) GenExpr(cg.aggregates[values[i].id - 1][f]);
+		}
+
+		new(&fields[f]) GenExpr(mergeValues(cg, column, blocks, loc));
+	}
+
+	return aggregateValue(cg, *type, fields);
+}
+
+void flatten(Codegen& cg, const GenExpr& shape, const GenExpr& value,
+		std::pmr::vector<GenExpr>& out, const Location& loc) {
+	auto type = aggregateType(cg, shape);
+	if(value.id != 0u && aggregateType(cg, value) != type) {
+		throwError("Type of argument must match initial type", loc);
+	}
+
+	if(!type) {
+		out.push_back(value);
+		return;
+	}
+
+	auto& shapeFields = cg.aggregates[shape.id - 1];
+	for(auto f = 0u; f < type->size; ++f) {
+		auto field = value.id ? cg.aggregates[value.id - 1][f] : GenExpr {};
+		flatten(cg, shapeFields[f], field, out, loc);
+	}
+}
+
+GenExpr unflatten(Codegen& cg, const GenExpr& shape, const GenExpr*& fields) {
+	auto type = aggregateType(cg, shape);
+	if(!type) {
+		return *fields++;
+	}
+
+	auto values = cg.arena->alloc<GenExpr>(type->size);
+	for(auto f = 0u; f < type->size; ++f) {
+		new(&values[f]) GenExpr(unflatten(cg, cg.aggregates[shape.id - 1][f], fields));
+	}
+
+	return aggregateValue(cg, *type, values);
+}
+
+// Returns the id of the spirv struct type with the given members,
+// types are declared in finish.
+u32 structType(Codegen& cg, const std::vector<u32>& members) {
+	for(auto& type : cg.structTypes) {
+		if(type.members == members) {
+			return type.id;
+		}
+	}
+
+	auto id = ++cg.id;
+	cg.structTypes.push_back({id, members});
+	return id;
+}
+
+// A struct member per field, fields that were never set are undefined
+// floats.
+GenExpr composite(Codegen& cg, const GenExpr& value) {
+	auto type = aggregateType(cg, value);
+	if(!type) {
+		return value;
+	}
+
+	std::vector<u32> ids;
+	std::vector<u32> members;
+	for(auto& field : cg.aggregates[value.id - 1]) {
+		auto member = field.id ? composite(cg, field) :
+			undefined(cg, {0u, cg.types.tf32, PrimitiveType::eFloat});
+		ids.push_back(member.id);
+		members.push_back(member.idtype);
+	}
+
+	auto tid = structType(cg, members);
+	auto oid = ++cg.id;
+	write(cg.buf, spv::OpCompositeConstruct, tid, oid, ids);
+	return {oid, tid, PrimitiveType::eAggregate};
+}
+
+std::vector<std::pair<Symbol, GenExpr>> declareAggregate(Codegen& cg,
+		const List& list, SymbolTable& symbols) {
+	auto& form = std::get<Identifier>(list.values[0].value).name;
+	auto name = list.values.size() < 3 ? nullptr :
+		std::get_if<Identifier>(&list.values[1].value);
+	if(!name) {
+		auto msg = dlg::format("{} expects a name and at least one {}", form,
+			form == "struct" ? "field" : "alternative");
+		throwError(msg, list.values[0].loc);
+	}
+
+	auto index = u32(cg.aggregateTypes.size());
+	auto& type = cg.aggregateTypes.emplace_back();
+	type.id = ++cg.id;
+	type.name = name->name;
+	type.variant = (form == "variant");
+	type.size = type.variant ? 1u : 0u;
+
+	std::vector<std::pair<Symbol, GenExpr>> ret;
+	auto define = [&](Symbol symbol, u32 member, PrimitiveType kind) {
+		for(auto& def : ret) {
+			if(def.first == symbol) {
+				throwError("Name declared twice", list.values[1].loc);
+			}
+		}
+
+		ret.push_back({symbol, GenExpr{index, member, kind}});
+	};
+
+	if(!type.variant) {
+		for(auto& field : Span(list.values.data() + 2, list.values.size() - 2)) {
+			auto fname = std::get_if<Identifier>(&field.value);
+			if(!fname) {
+				throwError("Struct fields must be names", field.loc);
+			}
+
+			auto accessor = std::string(name->name) + "-" + std::string(fname->name);
+			define(symbols.intern(accessor), type.size++, PrimitiveType::eAccessor);
+		}
+
+		type.alternatives.push_back({type.name, name->symbol, 0u, type.size});
+		define(name->symbol, 0u, PrimitiveType::eConstructor);
+		return ret;
+	}
+
+	for(auto& alt : Span(list.values.data() + 2, list.values.size() - 2)) {
+		auto alist = std::get_if<List>(&alt.value);
+		auto aname = std::get_if<Identifier>(&alt.value);
+		if(alist && !alist->values.empty()) {
+			aname = std::get_if<Identifier>(&alist->values[0].value);
+		}
+
+		auto fields = alist ? u32(alist->values.size()) - 1u : 0u;
+		for(auto i = 1u; aname && i <= fields; ++i) {
+			if(!std::holds_alternative<Identifier>(alist->values[i].value)) {
+				aname = nullptr;
+			}
+		}
+
+		if(!aname) {
+			throwError("Alternatives must be names or (name fields...) lists",
+				alt.loc);
+		}
+
+		auto member = u32(type.alternatives.size());
+		type.alternatives.push_back({std::string(aname->name), aname->symbol,
+			type.size, fields});
+		type.size += fields;
+		define(aname->symbol, member, PrimitiveType::eConstructor);
+	}
+
+	return ret;
+}
+
+// Generates an expression that must have a value.
+GenExpr generateValue(const RecContext& ctx, const Expression& expr) {
+	auto e = generate(ctx, expr);
+	auto pt = std::get_if<PrimitiveType>(&e.type);
+	if(e.id == 0u || (pt && *pt == PrimitiveType::eRecCall)) {
+		throwError("Expected a value", expr.loc);
+	}
+
+	return e;
+}
+
+// Constructs a value of the alternative given by constructor, its
+// fields are generated from values.
+GenExpr construct(const RecContext& ctx, const GenExpr& constructor,
+		Span<const Expression> values, const Location& loc) {
+	auto& cg = ctx.codegen;
+	auto& type = cg.aggregateTypes[constructor.id];
+	auto& alt = type.alternatives[constructor.idtype];
+	if(values.size() != alt.fields) {
+		auto msg = dlg::format("{} expects {} arguments", alt.name, alt.fields);
+		throwError(msg, loc);
+	}
+
+	auto fields = cg.arena->alloc<GenExpr>(type.size);
+	std::uninitialized_fill(fields.begin(), fields.end(), GenExpr {});
+	if(type.variant) {
+		// reuses the tags of function values
+		fields[0] = tagConstant(cg, constructor.idtype);
+	}
+
+	for(auto i = 0u; i < alt.fields; ++i) {
+		fields[alt.begin + i] = generateValue(ctx, values[i]);
+	}
+
+	if(cg.stats) {
+		++cg.stats->aggregatesBuilt;
+	}
+
+	return aggregateValue(cg, type, fields);
+}
+
+GenExpr generateAggregateCall(const RecContext& ctx, const GenExpr& function,
+		const Location& loc, CallStack args) {
+	if(args.size() != 1) {
+		throwError("Invalid call nesting", loc);
+	}
+
+	// loc is the one of the declaration
+	auto& cg = ctx.codegen;
+	auto& values = args[0].values;
+	auto& callLoc = values[0].loc;
+	auto nctx = RecContext {cg, *args[0].defs, ctx.rec};
+	auto pt = std::get<PrimitiveType>(function.type);
+	if(pt == PrimitiveType::eConstructor) {
+		return construct(nctx, function,
+			{values.data() + 1, values.size() - 1}, callLoc);
+	}
+
+	auto& type = cg.aggregateTypes[function.id];
+	if(values.size() != 2) {
+		throwError("Field accessors expect 1 argument", callLoc);
+	}
+
+	auto value = generateValue(nctx, values[1]);
+	if(aggregateType(cg, value) != &type) {
+		auto msg = dlg::format("Expected a {} value", type.name);
+		throwError(msg, values[1].loc);
+	}
+
+	return cg.aggregates[value.id - 1][function.idtype];
+}
+
+// Returns the index of the constant tag, -1 if it isn't constant.
+int constantTag(const Codegen& cg, const GenExpr& tag) {
+	for(auto it = cg.constants.rbegin(); it != cg.constants.rend(); ++it) {
+		if(it->id == tag.id) {
+			return it->undef ? -1 : int(it->value);
+		}
+	}
+
+	return -1;
+}
+
+// (case value (pattern expr)...) takes a struct or variant value apart.
+// Patterns are (alternative names...), binding the names to the fields,
+// the last one may be 'else'. Variants switch over the tag, the clauses
+// of alternatives the value can't have aren't generated. When the
+// alternative is known, e.g. for structs, only its clause is.
+GenExpr generateCase(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	if(args.empty()) {
+		throwError("Invalid call nesting", loc);
+	}
+
+	auto& cg = ctx.codegen;
+	auto& values = args.back().values;
+	if(values.size() < 3) {
+		throwError("case expects a value and at least one clause", loc);
+	}
+
+	auto& defs = *args.back().defs;
+	auto value = generateValue({cg, defs, ctx.rec}, values[1]);
+	auto type = aggregateType(cg, value);
+	if(!type) {
+		throwError("case expects a struct or variant value", values[1].loc);
+	}
+
+	// clause for each alternative
+	auto& alts = type->alternatives;
+	std::pmr::vector<const List*> clauses(alts.size(), nullptr, cg.arena.get());
+	const Expression* otherwise {};
+	for(auto i = 2u; i < values.size(); ++i) {
+		auto clause = std::get_if<List>(&values[i].value);
+		if(!clause || clause->values.size() != 2u) {
+			throwError("case clauses must be (pattern expr) pairs", values[i].loc);
+		}
+
+		auto& pattern = clause->values[0];
+		auto id = std::get_if<Identifier>(&pattern.value);
+		if(id && id->name == "else" && i + 1 == values.size()) {
+			otherwise = &clause->values[1];
+			continue;
+		}
+
+		auto plist = std::get_if<List>(&pattern.value);
+		auto head = plist && !plist->values.empty() ?
+			std::get_if<Identifier>(&plist->values[0].value) : nullptr;
+		auto alt = !head ? alts.end() : std::find_if(alts.begin(), alts.end(),
+			[&](auto& alt) { return alt.symbol == head->symbol; });
+		if(alt == alts.end()) {
+			auto msg = dlg::format("Patterns must be ({} names...) lists",
+				type->variant ? "alternative" : type->name.c_str());
+			throwError(msg, pattern.loc);
+		}
+
+		if(plist->values.size() != alt->fields + 1u) {
+			auto msg = dlg::format("{} has {} fields", alt->name, alt->fields);
+			throwError(msg, pattern.loc);
+		}
+
+		auto& slot = clauses[alt - alts.begin()];
+		if(slot) {
+			throwError("Duplicate clause", pattern.loc);
+		}
+
+		slot = clause;
+	}
+
+	// alternatives with fields that were never set aren't possible
+	auto fields = cg.aggregates[value.id - 1];
+	auto possible = [&](const AggregateType::Alternative& alt) {
+		return alt.fields == 0u || fields[alt.begin].id != 0u;
+	};
+
+	std::pmr::vector<u32> cases(cg.arena.get());
+	auto tag = type->variant ? constantTag(cg, fields[0]) : 0;
+	for(auto a = 0u; a < alts.size(); ++a) {
+		if((tag >= 0 && a != u32(tag)) || !possible(alts[a])) {
+			continue;
+		}
+
+		if(!clauses[a] && !otherwise) {
+			auto msg = dlg::format("case has no clause for {}", alts[a].name);
+			throwError(msg, loc);
+		}
+
+		cases.push_back(a);
+	}
+
+	auto nargs = args;
+	nargs.pop_back();
+
+	// generates the clause of the given alternative, otherwise with a = -1
+	auto generateClause = [&](int a) {
+		auto clause = a >= 0 ? clauses[a] : nullptr;
+		if(!clause) {
+			return generateCall({cg, defs, ctx.rec}, *otherwise, nargs);
+		}
+
+		Defs ndefs(&defs);
+		if(cg.stats) {
+			++cg.stats->scopes;
+		}
+
+		auto& names = std::get<List>(clause->values[0].value).values;
+		for(auto i = 1u; i < names.size(); ++i) {
+			auto name = std::get_if<Identifier>(&names[i].value);
+			if(!name) {
+				throwError("Patterns must bind names", names[i].loc);
+			}
+
+			auto field = fields[alts[a].begin + i - 1];
+			ndefs.insert_or_assign(name->symbol,
+				DefExpr{{field, names[i].loc}, &emptyDefs});
+		}
+
+		return generateCall({cg, ndefs, ctx.rec}, clause->values[1], nargs);
+	};
+
+	// only one clause can match
+	auto caseClause = [&](u32 a) { return clauses[a] ? int(a) : -1; };
+	if(cases.size() == 1u) {
+		if(cg.stats) {
+			++cg.stats->casesFolded;
+		}
+
+		return generateClause(caseClause(cases[0]));
+	}
+
+	// a block per generated clause. The else clause, if needed, is the
+	// default, otherwise the first one: tags are never out of range
+	std::pmr::vector<int> arms(cg.arena.get());
+	std::pmr::vector<u32> labels(cg.arena.get());
+	for(auto a : cases) {
+		if(std::find(arms.begin(), arms.end(), caseClause(a)) == arms.end()) {
+			arms.push_back(caseClause(a));
+			labels.push_back(++cg.id);
+		}
+	}
+
+	auto other = std::find(arms.begin(), arms.end(), -1);
+	auto defaultLabel = labels[other == arms.end() ? 0u : other - arms.begin()];
+	std::pmr::vector<u32> targets(cg.arena.get());
+	for(auto a : cases) {
+		auto arm = std::find(arms.begin(), arms.end(), caseClause(a));
+		if(auto label = labels[arm - arms.begin()]; label != defaultLabel) {
+			targets.push_back(a);
+			targets.push_back(label);
+		}
+	}
+
+	auto mb = ++cg.id; // merge block
+	write(cg.buf, spv::OpSelectionMerge, mb, spv::SelectionControlMaskNone);
+	write(cg.buf, spv::OpSwitch, fields[0].id, defaultLabel, targets);
+
+	std::pmr::vector<GenExpr> results(cg.arena.get());
+	std::pmr::vector<u32> blocks(cg.arena.get());
+	for(auto i = 0u; i < arms.size(); ++i) {
+		write(cg.buf, spv::OpLabel, labels[i]);
+		cg.block = labels[i];
+
+		auto e = generateClause(arms[i]);
+		auto pt = std::get_if<PrimitiveType>(&e.type);
+		if(pt && *pt == PrimitiveType::eRecCall) {
+			continue;
+		}
+
+		if(!results.empty() && e.idtype != results[0].idtype) {
+			throwError("case clauses have different types", loc);
+		}
+
+		results.push_back(e);
+		blocks.push_back(cg.block);
+		write(cg.buf, spv::OpBranch, mb);
+	}
+
+	if(results.empty()) {
+		return {0, 0, PrimitiveType::eRecCall};
+	}
+
+	write(cg.buf, spv::OpLabel, mb);
+	cg.block = mb;
+	return mergeValues(cg, {results.data(), results.size()},
+		{blocks.data(), blocks.size()}, loc);
+}
+
+// Operands of and/or with an estimated cost above this are only
+// evaluated when the previous operands don't already decide the result.
+// Below it, the selection (conditional branch, branch, phi) and the
+// potential divergence cost more than just evaluating the operand.
+constexpr auto shortCircuitCost = 12.0;
+
+// Moves the code generated for a logical operand, buf[begin, end), into
+// its own block that is only executed if cond has the given value.
+// Returns the phi combining cond and the operand.
+u32 shortCircuit(Codegen& cg, std::size_t begin, u32 prevBlock,
+		u32 cond, bool evalIf, u32 operand) {
+	auto lb = ++cg.id; // operand block
+	auto mb = ++cg.id; // merge block
+
+	// code in the operand that referenced the block it started in
+	// (e.g. the pre-header in rec-func phis) now has to reference lb
+	for(auto pos = begin; pos < cg.buf.size(); pos += cg.buf[pos] >> 16) {
+		auto& instr = cg.buf[pos];
+		if((instr & 0xFFFFu) != spv::OpPhi) {
+			continue;
+		}
+
+		for(auto i = 4u; i < (instr >> 16); i += 2) {
+			if((&instr)[i] == prevBlock) {
+				(&instr)[i] = lb;
+			}
+		}
+	}
+
+	std::vector<u32> head;
+	write(head, spv::OpSelectionMerge, mb, spv::SelectionControlMaskNone);
+	if(evalIf) {
+		write(head, spv::OpBranchConditional, cond, lb, mb);
+	} else {
+		write(head, spv::OpBranchConditional, cond, mb, lb);
+	}
+	write(head, spv::OpLabel, lb);
+	cg.buf.insert(cg.buf.begin() + begin, head.begin(), head.end());
+	cg.fusionBarrier = cg.buf.size();
+	if(cg.stats) {
+		cg.stats->inserted(begin, head.size(), 3u);
+	}
+
+	auto endBlock = cg.block == prevBlock ? lb : cg.block;
+	write(cg.buf, spv::OpBranch, mb);
+	write(cg.buf, spv::OpLabel, mb);
+	cg.block = mb;
+
+	auto phi = ++cg.id;
+	write(cg.buf, spv::OpPhi, cg.types.tbool, phi,
+		cond, prevBlock, operand, endBlock);
+	return phi;
+}
+
+template<spv::Op Op>
+GenExpr generateLogicalBin(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	if(args.size() != 1) {
+		throwError("Invalid call nesting", loc);
+	}
+
+	if(args[0].values.size() < 3) {
+		std::string msg = "Function expects at least 2 argument";
+		throwError(msg, loc);
+	}
+
+	// TODO: also allow boolean vectors
+	auto& cg = ctx.codegen;
 	auto nctx = RecContext {ctx.codegen, *args[0].defs, ctx.rec};
-	auto e1 = generate(nctx, (*args[0].values)[1]);
+	auto e1 = generate(nctx, args[0].values[1]);
 	if(e1.idtype != ctx.codegen.types.tbool) {
 		throwError("Argument must be of type bool", loc);
 	}
 
-	for(auto i = 2u; i < args[0].values->size(); ++i) {
-		auto e2 = generate(nctx, (*args[0].values)[i]);
+	for(auto i = 2u; i < args[0].values.size(); ++i) {
+		auto prevBlock = cg.block;
+		auto begin = cg.buf.size();
+		cg.fusionBarrier = begin;
+		auto e2 = generate(nctx, args[0].values[i]);
 		if(e2.idtype != ctx.codegen.types.tbool) {
 			throwError("Argument must be of type bool", loc);
 		}
 
+		// Decide whether to short-circuit the operand we just generated.
+		// Only done for pure operands, i.e. those without stores.
+		auto cost = estimateCost(cg, begin, cg.buf.size());
+		auto pure = true;
+		for(auto pos = begin; pos < cg.buf.size(); pos += cg.buf[pos] >> 16) {
+			pure &= (cg.buf[pos] & 0xFFFFu) != spv::OpStore;
+		}
+
+		if(pure && cost.cost > shortCircuitCost) {
+			auto evalIf = (Op == spv::OpLogicalAnd);
+			e1.id = shortCircuit(cg, begin, prevBlock, e1.id, evalIf, e2.id);
+			continue;
+		}
+
 		auto oid = ++ctx.codegen.id;
 		write(ctx.codegen.buf, Op, ctx.codegen.types.tbool,
 			oid, e1.id, e2.id);
@@ -618,57 +2689,352 @@ GenExpr generateLogicalBin(const RecContext& ctx, const Location& loc,
 	return e1;
 }
 
-template<unsigned Instr>
-GenExpr generateGlslUnary(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+// GLSL.std.450
+// The builtins work on genTypes, i.e. float or vec4 (the only vector
+// type). How the types of the arguments relate:
+enum class GlslArgs {
+	eSame, // all the same type, also the result
+	eReduce, // all the same type, float result, e.g. length
+	eLastFloat, // as eSame, but the last one is always a float, e.g. refract
+};
+
+// Arguments (bit i for argument i) that may be floats when the others
+// are vec4s, like the float overloads of GLSL, e.g. (clamp v 0 1).
+// Their value is used for all components.
+constexpr unsigned broadcastNone = 0u;
+constexpr unsigned broadcastFirst = 0b001u; // step edge
+constexpr unsigned broadcastSecond = 0b010u; // min, max, mod
+constexpr unsigned broadcastThird = 0b100u; // mix t
+constexpr unsigned broadcastFirstTwo = 0b011u; // smoothstep edges
+constexpr unsigned broadcastLastTwo = 0b110u; // clamp min and max
+
+Type typeOf(const Codegen& cg, u32 idtype);
+
+// Generates and checks the count arguments of a GLSL builtin, returns
+// their type (genType), the ids are appended to ids. See broadcastNone
+// for broadcast.
+u32 glslArguments(const RecContext& ctx, const Location& loc,
+		CallStack args, unsigned count, GlslArgs kind,
+		std::pmr::vector<u32>& ids, unsigned broadcast = broadcastNone) {
 	if(args.size() != 1) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args[0].values->size() != 2) {
-		std::string msg = "Function expects 1 argument";
+	auto& values = args[0].values;
+	if(values.size() != count + 1) {
+		auto msg = dlg::format("Function expects {} argument{}", count,
+			count == 1u ? "" : "s");
 		throwError(msg, loc);
 	}
 
-	auto nctx = RecContext {ctx.codegen, *args.back().defs, ctx.rec};
-	auto e1 = generate(nctx, (*args[0].values)[1]);
-	// TODO: check for type
+	auto& cg = ctx.codegen;
+	auto nctx = RecContext {cg, *args[0].defs, ctx.rec};
+	std::pmr::vector<GenExpr> es(cg.arena.get());
+	auto type = 0u;
+	for(auto i = 1u; i <= count; ++i) {
+		auto& e = es.emplace_back(generate(nctx, values[i]));
+		if(e.idtype != cg.types.tf32 && e.idtype != cg.types.tvec4) {
+			throwError("Arguments must be float or vec4", values[i].loc);
+		}
 
-	auto oid = ++ctx.codegen.id;
-	write(ctx.codegen.buf, spv::OpExtInst, e1.idtype, oid,
-		ctx.codegen.idglsl, Instr, e1.id);
-	return {oid, ctx.codegen.types.tbool, PrimitiveType::eBool};
+		auto scalar = kind == GlslArgs::eLastFloat && i == count;
+		if(scalar && e.idtype != cg.types.tf32) {
+			throwError("Argument must be float", values[i].loc);
+		} else if(!scalar && (!type || e.idtype == cg.types.tvec4)) {
+			type = e.idtype;
+		}
+	}
+
+	for(auto i = 0u; i < count; ++i) {
+		auto id = es[i].id;
+		auto scalar = kind == GlslArgs::eLastFloat && i + 1 == count;
+		if(!scalar && es[i].idtype != type) {
+			if(!(broadcast & (1u << i))) {
+				throwError("Arguments must have the same type", values[i + 1].loc);
+			}
+
+			id = ++cg.id;
+			write(cg.buf, spv::OpCompositeConstruct, type, id,
+				es[i].id, es[i].id, es[i].id, es[i].id);
+		}
+
+		ids.push_back(id);
+	}
+
+	return type;
+}
+
+template<unsigned Instr, unsigned Count, GlslArgs Args = GlslArgs::eSame,
+	unsigned Broadcast = broadcastNone>
+GenExpr generateGlsl(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	auto& cg = ctx.codegen;
+	std::pmr::vector<u32> ids(cg.arena.get());
+	auto type = glslArguments(ctx, loc, args, Count, Args, ids, Broadcast);
+	if(Args == GlslArgs::eReduce) {
+		type = cg.types.tf32;
+	}
+
+	auto oid = ++cg.id;
+	write(cg.buf, spv::OpExtInst, type, oid, cg.idglsl, Instr, ids);
+	return {oid, type, typeOf(cg, type)};
+}
+
+template<unsigned Instr>
+GenExpr generateGlslUnary(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	return generateGlsl<Instr, 1u>(ctx, loc, args);
+}
+
+// dot and mod are core instructions
+GenExpr generateDot(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	auto& cg = ctx.codegen;
+	std::pmr::vector<u32> ids(cg.arena.get());
+	auto type = glslArguments(ctx, loc, args, 2u, GlslArgs::eReduce, ids);
+	auto op = type == cg.types.tf32 ? spv::OpFMul : spv::OpDot;
+
+	auto oid = ++cg.id;
+	write(cg.buf, op, cg.types.tf32, oid, ids);
+	return {oid, cg.types.tf32, PrimitiveType::eFloat};
+}
+
+GenExpr generateMod(const RecContext& ctx, const Location& loc,
+		CallStack args) {
+	auto& cg = ctx.codegen;
+	std::pmr::vector<u32> ids(cg.arena.get());
+	auto type = glslArguments(ctx, loc, args, 2u, GlslArgs::eSame, ids,
+		broadcastSecond);
+
+	auto oid = ++cg.id;
+	write(cg.buf, spv::OpFMod, type, oid, ids);
+	return {oid, type, typeOf(cg, type)};
 }
 
 // TODO: allow to use this as a predefined identifier as opposed
 // to a zero-argument function?
 GenExpr generateFragCoord(const RecContext& ctx, const Location& loc,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.size() != 1) {
 		throwError("Invalid call nesting", loc);
 	}
 
-	if(args[0].values->size() != 1) {
+	if(args[0].values.size() != 1) {
 		throwError("frag-coord expects no arguments", loc);
 	}
 
+	if(ctx.codegen.library) {
+		throwError("frag-coord can't be used in libraries", loc);
+	}
+
 	auto oid = ++ctx.codegen.id;
 	write(ctx.codegen.buf, spv::OpLoad, ctx.codegen.types.tvec4, oid,
 		ctx.codegen.inputs.fragCoord);
 	return {oid, ctx.codegen.types.tvec4, VectorType{4, PrimitiveType::eFloat}};
 }
 
-const std::unordered_map<std::string_view, BuiltinGen> builtins = {
+// Linked functions
+Type typeOf(const Codegen& cg, u32 idtype) {
+	if(idtype == cg.types.tvec4) {
+		return VectorType{4, PrimitiveType::eFloat};
+	} else if(idtype == cg.types.tbool) {
+		return PrimitiveType::eBool;
+	}
+
+	return PrimitiveType::eFloat;
+}
+
+u32 parseType(const Codegen& cg, const Expression& expr) {
+	auto id = std::get_if<Identifier>(&expr.value);
+	if(id && id->name == "float") {
+		return cg.types.tf32;
+	} else if(id && id->name == "bool") {
+		return cg.types.tbool;
+	} else if(id && id->name == "vec4") {
+		return cg.types.tvec4;
+	}
+
+	throwError("Invalid type, expected float, bool or vec4", expr.loc);
+}
+
+// Returns the function type id, types are declared in finish.
+u32 functionType(Codegen& cg, u32 ret, const std::vector<u32>& params) {
+	for(auto& type : cg.functionTypes) {
+		if(type.ret == ret && type.params == params) {
+			return type.id;
+		}
+	}
+
+	auto id = ++cg.id;
+	cg.functionTypes.push_back({id, ret, params});
+	return id;
+}
+
+std::string_view linkageName(const List& list, const char* form) {
+	if(list.values.size() != 4) {
+		auto msg = dlg::format("{} expects 3 arguments", form);
+		throwError(msg, list.values[0].loc);
+	}
+
+	auto name = std::get_if<Identifier>(&list.values[1].value);
+	if(!name) {
+		auto msg = dlg::format("First argument of {} must be a name", form);
+		throwError(msg, list.values[1].loc);
+	}
+
+	if(!std::holds_alternative<List>(list.values[2].value)) {
+		auto msg = dlg::format("Second argument of {} must be a list", form);
+		throwError(msg, list.values[2].loc);
+	}
+
+	return name->name;
+}
+
+GenExpr generateExtern(const Context& ctx, const List& list,
+		const Location&) {
+	auto& cg = ctx.codegen;
+	auto name = linkageName(list, "extern");
+
+	std::vector<u32> params;
+	for(auto& param : std::get<List>(list.values[2].value).values) {
+		params.push_back(parseType(cg, param));
+	}
+
+	auto ret = parseType(cg, list.values[3]);
+	auto ftype = functionType(cg, ret, params);
+
+	auto id = ++cg.id;
+	write(cg.declarations, spv::OpFunction, ret, id,
+		spv::FunctionControlMaskNone, ftype);
+	for(auto param : params) {
+		write(cg.declarations, spv::OpFunctionParameter, param, ++cg.id);
+	}
+
+	write(cg.declarations, spv::OpFunctionEnd);
+	cg.linkage.push_back({id, std::string(name), false});
+	return {id, ftype, PrimitiveType::eFunction};
+}
+
+GenExpr generateExport(const Context& ctx, const List& list,
+		const Location& loc) {
+	auto& cg = ctx.codegen;
+	auto name = linkageName(list, "export");
+	if(!cg.library) {
+		throwError("Functions can only be exported from libraries", loc);
+	}
+
+	for(auto& link : cg.linkage) {
+		if(link.exported && link.name == name) {
+			throwError("Function already exported", loc);
+		}
+	}
+
+	// result and function type are patched after the body
+	auto id = ++cg.id;
+	auto begin = cg.buf.size();
+	cg.fusionBarrier = begin;
+	write(cg.buf, spv::OpFunction, 0u, id, spv::FunctionControlMaskNone, 0u);
+
+	Defs ndefs(&ctx.defs);
+	std::vector<u32> params;
+	for(auto& param : std::get<List>(list.values[2].value).values) {
+		auto pname = std::get_if<Identifier>(&param.value);
+		auto type = cg.types.tf32;
+		if(auto typed = std::get_if<List>(&param.value);
+				typed && typed->values.size() == 2) {
+			pname = std::get_if<Identifier>(&typed->values[0].value);
+			type = parseType(cg, typed->values[1]);
+		}
+
+		if(!pname) {
+			throwError("Parameters must be names or (name type) pairs",
+				param.loc);
+		}
+
+		auto pid = ++cg.id;
+		write(cg.buf, spv::OpFunctionParameter, type, pid);
+		params.push_back(type);
+
+		auto value = GenExpr{pid, type, typeOf(cg, type)};
+		ndefs.insert_or_assign(pname->symbol,
+			DefExpr{{value, param.loc}, &emptyDefs});
+	}
+
+	cg.block = ++cg.id;
+	write(cg.buf, spv::OpLabel, cg.block);
+
+	auto& body = list.values[3];
+	auto ret = generateExpr({cg, ndefs}, body);
+	if(ret.idtype != cg.types.tf32 && ret.idtype != cg.types.tbool &&
+			ret.idtype != cg.types.tvec4) {
+		throwError("Exported functions must return float, bool or vec4",
+			body.loc);
+	}
+
+	write(cg.buf, spv::OpReturnValue, ret.id);
+	write(cg.buf, spv::OpFunctionEnd);
+
+	auto ftype = functionType(cg, ret.idtype, params);
+	cg.buf[begin + 1] = ret.idtype;
+	cg.buf[begin + 4] = ftype;
+	cg.linkage.push_back({id, std::string(name), true});
+	return {id, ftype, PrimitiveType::eFunction};
+}
+
+GenExpr generateFunctionCall(const RecContext& ctx, const GenExpr& function,
+		const Location& loc, CallStack args) {
+	if(args.size() != 1) {
+		throwError("Invalid call nesting", loc);
+	}
+
+	auto& cg = ctx.codegen;
+	auto& type = *std::find_if(cg.functionTypes.begin(), cg.functionTypes.end(),
+		[&](auto& type) { return type.id == function.idtype; });
+	auto& values = args[0].values;
+	if(type.params.size() + 1 != values.size()) {
+		auto msg = dlg::format("Function call with invalid number "
+			"of params: Expected {}, got {}", type.params.size(),
+			values.size() - 1);
+		throwError(msg, loc);
+	}
+
+	auto nctx = RecContext {cg, *args[0].defs, ctx.rec};
+	std::pmr::vector<u32> ids(cg.arena.get());
+	for(auto i = 0u; i < type.params.size(); ++i) {
+		auto arg = generate(nctx, values[i + 1]);
+		if(arg.idtype != type.params[i]) {
+			throwError("Argument has wrong type", values[i + 1].loc);
+		}
+
+		ids.push_back(arg.id);
+	}
+
+	auto oid = ++cg.id;
+	write(cg.buf, spv::OpFunctionCall, type.ret, oid, function.id, ids);
+	return {oid, type.ret, typeOf(cg, type.ret)};
+}
+
+struct Builtin {
+	std::string_view name;
+	BuiltinGen gen;
+};
+
+// Indexed by symbol - 1, see SymbolTable.
+const Builtin builtins[] = {
 	// core: control-flow/bindings
 	{"if", generateIf},
 	{"let", generateLet},
 	{"rec", generateRec},
 	{"func", generateFunc},
 	{"rec-func", generateRecFunc},
+	{"case", generateCase},
 
 	// top-level instructions
 	{"output", generateOutput},
 
+	// static analysis
+	{"budget", generateBudget},
+
 	// core math
 	{"+", &generateBinop<spv::OpFAdd>},
 	{"-", generateBinop<spv::OpFSub>},
@@ -712,42 +3078,100 @@ const std::unordered_map<std::string_view, BuiltinGen> builtins = {
 	{"log2", generateGlslUnary<GLSLstd450Log2>},
 	{"sqrt", generateGlslUnary<GLSLstd450Sqrt>},
 	{"inverse-sqrt", generateGlslUnary<GLSLstd450InverseSqrt>},
+	{"normalize", generateGlslUnary<GLSLstd450Normalize>},
+	{"length", generateGlsl<GLSLstd450Length, 1, GlslArgs::eReduce>},
+	{"distance", generateGlsl<GLSLstd450Distance, 2, GlslArgs::eReduce>},
+	{"dot", generateDot},
+	{"mod", generateMod},
+	{"atan2", generateGlsl<GLSLstd450Atan2, 2>},
+	{"pow", generateGlsl<GLSLstd450Pow, 2>},
+	{"min", generateGlsl<GLSLstd450FMin, 2, GlslArgs::eSame, broadcastSecond>},
+	{"max", generateGlsl<GLSLstd450FMax, 2, GlslArgs::eSame, broadcastSecond>},
+	{"step", generateGlsl<GLSLstd450Step, 2, GlslArgs::eSame, broadcastFirst>},
+	{"reflect", generateGlsl<GLSLstd450Reflect, 2>},
+	{"clamp", generateGlsl<GLSLstd450FClamp, 3, GlslArgs::eSame, broadcastLastTwo>},
+	{"mix", generateGlsl<GLSLstd450FMix, 3, GlslArgs::eSame, broadcastThird>},
+	{"smoothstep", generateGlsl<GLSLstd450SmoothStep, 3, GlslArgs::eSame,
+		broadcastFirstTwo>},
+	{"fma", generateGlsl<GLSLstd450Fma, 3>},
+	{"face-forward", generateGlsl<GLSLstd450FaceForward, 3>},
+	{"refract", generateGlsl<GLSLstd450Refract, 3, GlslArgs::eLastFloat>},
 };
 
+const Symbol builtinCount = std::size(builtins);
+
+Symbol builtinSymbol(std::string_view name) {
+	static const auto symbols = [] {
+		std::unordered_map<std::string_view, Symbol> ret;
+		for(auto i = 0u; i < builtinCount; ++i) {
+			ret.emplace(builtins[i].name, i + 1);
+		}
+
+		return ret;
+	}();
+
+	auto it = symbols.find(name);
+	return it == symbols.end() ? 0u : it->second;
+}
+
 GenExpr generateCall(const RecContext& ctx, const List& list,
-		const Location&, const std::vector<CallArgs>& args) {
-	auto nargs = args;
-	std::vector<CExpression> cargs;
-	for(auto& val : list.values) {
-		cargs.push_back(wrap(val));
+		const Location& loc, CallStack args) {
+	DepthGuard depth(ctx.codegen, loc);
+	if(list.values.empty()) {
+		throwError("Empty application", loc);
 	}
 
-	nargs.push_back({&cargs, &ctx.defs});
-	return generateCall(ctx, cargs[0], nargs);
+	std::array<CallArgs, inlineCallDepth> local;
+	auto nargs = Span<CallArgs>(local.data(), args.size() + 1);
+	if(nargs.size() > local.size()) {
+		nargs = ctx.codegen.arena->alloc<CallArgs>(nargs.size());
+		if(ctx.codegen.stats) {
+			++ctx.codegen.stats->deepCalls;
+		}
+	}
+
+	std::uninitialized_copy(args.begin(), args.end(), nargs.begin());
+	nargs.back() = {list.values, &ctx.defs};
+
+	return generateCall(ctx, wrap(list.values[0]), nargs);
 }
 
 GenExpr generateCall(const RecContext& ctx, const Identifier& identifier,
-		const Location& loc, const std::vector<CallArgs>& args) {
+		const Location& loc, CallStack args) {
 	auto fname = identifier.name;
-	auto it = builtins.find(fname);
-	if(it == builtins.end()) {
-		auto it = ctx.defs.find(fname);
-		if(it == ctx.defs.end()) {
+	auto symbol = identifier.symbol;
+	if(symbol == 0u || symbol > builtinCount) {
+		if(ctx.codegen.lookups) {
+			ctx.codegen.lookups->push_back(symbol);
+		}
+
+		auto def = ctx.defs.find(symbol);
+		if(!def) {
 			std::string msg = "Unknown function identifier '";
 			msg += fname;
 			msg += "'";
 			throwError(msg, loc);
 		}
 
-		auto nctx = RecContext{ctx.codegen, *it->second.scope, ctx.rec};
-		return generateCall(nctx, it->second.expr, args);
-	} else {
-		return it->second(ctx, loc, args);
+		return expand(ctx, fname, *def, [&](const RecContext& nctx) {
+			return generateCall(nctx, expression(*def), args);
+		});
+	}
+
+	auto& builtin = builtins[symbol - 1];
+	auto stats = ctx.codegen.stats;
+	if(!stats) {
+		return builtin.gen(ctx, loc, args);
 	}
+
+	stats->beginBuiltin(ctx.codegen.buf);
+	auto ret = builtin.gen(ctx, loc, args);
+	stats->endBuiltin(builtin.name, ctx.codegen.buf);
+	return ret;
 }
 
 GenExpr generateCall(const RecContext& ctx, const CExpression& expr,
-		const std::vector<CallArgs>& args) {
+		CallStack args) {
 	if(args.empty()) {
 		return generate(ctx, expr);
 	}
@@ -755,6 +3179,19 @@ GenExpr generateCall(const RecContext& ctx, const CExpression& expr,
 	return std::visit(Visitor{
 		[&](const List& list) { return generateCall(ctx, list, expr.loc, args); },
 		[&](const Identifier& id) { return generateCall(ctx, id, expr.loc, args); },
+		[&](const GenExpr& ge) {
+			auto pt = std::get_if<PrimitiveType>(&ge.type);
+			if(pt && *pt == PrimitiveType::eTaggedFunction) {
+				return generateTaggedCall(ctx, ge, expr.loc, args);
+			} else if(pt && (*pt == PrimitiveType::eConstructor ||
+					*pt == PrimitiveType::eAccessor)) {
+				return generateAggregateCall(ctx, ge, expr.loc, args);
+			} else if(!pt || *pt != PrimitiveType::eFunction) {
+				throwError("Invalid application; no function", expr.loc);
+			}
+
+			return generateFunctionCall(ctx, ge, expr.loc, args);
+		},
 		[&](const auto&) {
 			throwError("Invalid application; no function", expr.loc);
 			return GenExpr {};
@@ -775,6 +3212,10 @@ GenExpr generate(const RecContext& ctx, const CExpression& expr) {
 			std::memcpy(&v, &f, 4);
 			auto oid = ++cg.id;
 			cg.constants.push_back({oid, v, cg.types.tf32});
+			if(cg.stats) {
+				++cg.stats->constants;
+			}
+
 			return GenExpr{oid, cg.types.tf32, PrimitiveType::eFloat};
 		},
 		[&](bool val) {
@@ -782,18 +3223,33 @@ GenExpr generate(const RecContext& ctx, const CExpression& expr) {
 			return GenExpr{id, cg.types.tbool, PrimitiveType::eBool};
 		},
 		[&](const Identifier& id) {
-			auto it = ctx.defs.find(id.name);
-			if(it == ctx.defs.end()) {
+			if(cg.lookups) {
+				cg.lookups->push_back(id.symbol);
+			}
+
+			auto def = ctx.defs.find(id.symbol);
+			if(!def) {
 				std::string msg = "Unknown identifier '";
 				msg += id.name;
 				msg += "'";
 				throwError(msg, expr.loc);
 			}
 
-			auto nctx = RecContext{ctx.codegen, *it->second.scope, ctx.rec};
-			return generate(nctx, it->second.expr);
+			return expand(ctx, id.name, *def, [&](const RecContext& nctx) {
+				return generate(nctx, expression(*def));
+			});
 		},
 		[&](const GenExpr& ge) {
+			auto pt = std::get_if<PrimitiveType>(&ge.type);
+			if(pt && *pt == PrimitiveType::eFunction) {
+				throwError("Linked functions can only be called", expr.loc);
+			} else if(pt && *pt == PrimitiveType::eAccessor) {
+				throwError("Field accessors can only be called", expr.loc);
+			} else if(pt && *pt == PrimitiveType::eConstructor) {
+				// alternatives without fields are values as well
+				return construct(ctx, ge, {}, expr.loc);
+			}
+
 			return ge;
 		},
 		[&](std::string_view) {
@@ -801,17 +3257,19 @@ GenExpr generate(const RecContext& ctx, const CExpression& expr) {
 			return GenExpr {};
 		},
 		[&](const List& list) {
-			std::vector<CExpression> args;
-			for(auto& val : list.values) {
-				args.push_back(wrap(val));
+			DepthGuard depth(cg, expr.loc);
+			if(list.values.empty()) {
+				throwError("Empty application", expr.loc);
 			}
 
-			return generateCall(ctx, args[0], {{&args, &ctx.defs}});
+			CallArgs args {list.values, &ctx.defs};
+			return generateCall(ctx, wrap(list.values[0]), {&args, 1u});
 		}
 	}, expr.value);
 }
 
 GenExpr generateExpr(const Context& ctx, const Expression& expr) {
+	ctx.codegen.fusionBarrier = ctx.codegen.buf.size();
 	RecContext rctx{ctx.codegen, ctx.defs, nullptr};
 	return generate(rctx, wrap(expr));
 }
@@ -832,19 +3290,25 @@ void init(Codegen& ctx) {
 	// TODO: only generate when used?
 	ctx.inputs.fragCoord = ++ctx.id;
 
-	// entry point function
-	write(ctx.buf, spv::OpFunction, ctx.types.tvoid, ctx.idmain,
-		spv::FunctionControlMaskNone, ctx.idmaintype);
+	// entry point function, libraries don't have one
+	if(!ctx.library) {
+		write(ctx.buf, spv::OpFunction, ctx.types.tvoid, ctx.idmain,
+			spv::FunctionControlMaskNone, ctx.idmaintype);
+	}
 
 	ctx.entryblock = ++ctx.id;
 	ctx.block = ctx.entryblock;
-	write(ctx.buf, spv::OpLabel, ctx.entryblock);
+	if(!ctx.library) {
+		write(ctx.buf, spv::OpLabel, ctx.entryblock);
+	}
 }
 
 std::vector<u32> finish(Codegen& ctx) {
 	// finish ctx buf (main function)
-	write(ctx.buf, spv::OpReturn);
-	write(ctx.buf, spv::OpFunctionEnd);
+	if(!ctx.library) {
+		write(ctx.buf, spv::OpReturn);
+		write(ctx.buf, spv::OpFunctionEnd);
+	}
 
 	// write header
 	constexpr u32 versionNum = 0x00010300; // 1.3
@@ -859,20 +3323,27 @@ std::vector<u32> finish(Codegen& ctx) {
 	buf.push_back(0); // reserved
 
 	write(buf, spv::OpCapability, spv::CapabilityShader);
+	if(ctx.library || !ctx.linkage.empty()) {
+		write(buf, spv::OpCapability, spv::CapabilityLinkage);
+	}
+
 	write(buf, spv::OpExtInstImport, ctx.idglsl, "GLSL.std.450");
 	write(buf, spv::OpMemoryModel,
 		spv::AddressingModelLogical,
 		spv::MemoryModelGLSL450);
 
-	std::vector<u32> interface;
-	interface.push_back(ctx.inputs.fragCoord);
-	for(auto& output : ctx.outputs) {
-		interface.push_back(output.id);
-	}
+	if(!ctx.library) {
+		std::vector<u32> interface;
+		interface.push_back(ctx.inputs.fragCoord);
+		for(auto& output : ctx.outputs) {
+			interface.push_back(output.id);
+		}
 
-	write(buf, spv::OpEntryPoint, spv::ExecutionModelFragment,
-		ctx.idmain, "main", interface);
-	write(buf, spv::OpExecutionMode, ctx.idmain, spv::ExecutionModeOriginUpperLeft);
+		write(buf, spv::OpEntryPoint, spv::ExecutionModelFragment,
+			ctx.idmain, "main", interface);
+		write(buf, spv::OpExecutionMode, ctx.idmain,
+			spv::ExecutionModeOriginUpperLeft);
+	}
 
 	std::vector<u32> sec8; // annotations (decorations)
 	std::vector<u32> sec9; // types, constants
@@ -881,22 +3352,57 @@ std::vector<u32> finish(Codegen& ctx) {
 	write(sec9, spv::OpTypeVoid, ctx.types.tvoid);
 	write(sec9, spv::OpTypeVector, ctx.types.tvec4, ctx.types.tf32, 4);
 	write(sec9, spv::OpTypeBool, ctx.types.tbool);
-	write(sec9, spv::OpTypeFunction, ctx.idmaintype, ctx.types.tvoid);
+	if(ctx.types.tu32) {
+		write(sec9, spv::OpTypeInt, ctx.types.tu32, 32, 0);
+	}
+
+	// members are declared before the structs that contain them
+	for(auto& type : ctx.structTypes) {
+		write(sec9, spv::OpTypeStruct, type.id, type.members);
+	}
+
+	if(!ctx.library) {
+		write(sec9, spv::OpTypeFunction, ctx.idmaintype, ctx.types.tvoid);
+	}
+
+	for(auto& type : ctx.functionTypes) {
+		write(sec9, spv::OpTypeFunction, type.id, type.ret, type.params);
+	}
 
 	write(sec9, spv::OpConstantTrue, ctx.types.tbool, ctx.idtrue);
 	write(sec9, spv::OpConstantFalse, ctx.types.tbool, ctx.idfalse);
 
 	// inputs
-	auto tid = ++ctx.id;
-	write(sec9, spv::OpTypePointer, tid,
-		spv::StorageClassInput, ctx.types.tvec4);
-	write(sec9, spv::OpVariable, tid, ctx.inputs.fragCoord,
-			spv::StorageClassInput);
-	write(sec8, spv::OpDecorate, ctx.inputs.fragCoord, spv::DecorationBuiltIn,
-		spv::BuiltInFragCoord);
+	if(!ctx.library) {
+		auto tid = ++ctx.id;
+		write(sec9, spv::OpTypePointer, tid,
+			spv::StorageClassInput, ctx.types.tvec4);
+		write(sec9, spv::OpVariable, tid, ctx.inputs.fragCoord,
+				spv::StorageClassInput);
+		write(sec8, spv::OpDecorate, ctx.inputs.fragCoord,
+			spv::DecorationBuiltIn, spv::BuiltInFragCoord);
+	}
+
+	for(auto& link : ctx.linkage) {
+		write(sec8, spv::OpDecorate, link.function,
+			spv::DecorationLinkageAttributes, link.name.c_str(),
+			link.exported ? spv::LinkageTypeExport : spv::LinkageTypeImport);
+	}
 
 	// back-patch the missed global stuff
 	for(auto& constant : ctx.constants) {
+		if(constant.undef) {
+			write(sec9, spv::OpUndef, constant.type, constant.id);
+			continue;
+		}
+
+		if(constant.composite) {
+			auto c = constant.value;
+			write(sec9, spv::OpConstantComposite, constant.type, constant.id,
+				c, c, c, c);
+			continue;
+		}
+
 		write(sec9, spv::OpConstant,
 			constant.type,
 			constant.id,
@@ -918,6 +3424,7 @@ std::vector<u32> finish(Codegen& ctx) {
 	buf[maxboundid] = ctx.id + 1;
 	buf.insert(buf.end(), sec8.begin(), sec8.end());
 	buf.insert(buf.end(), sec9.begin(), sec9.end());
+	buf.insert(buf.end(), ctx.declarations.begin(), ctx.declarations.end());
 	buf.insert(buf.end(), ctx.buf.begin(), ctx.buf.end());
 	return buf;
 }
@@ -1,29 +1,178 @@
 #include "parser.hpp"
+#include "fwd.hpp"
+#include <dlg/dlg.hpp>
+#include <mutex>
 #include <stdexcept>
+#include <algorithm>
+#include <memory>
+#include <charconv>
+#include <cstdint>
 
-void skipws(std::string_view& source, Location& loc) {
-	while(!source.empty() && (std::isspace(source[0]) || source[0] == ';')) {
-		if(source[0] == ';') { // comment
-			auto n = source.find('\n');
-			if(n == source.npos) {
-				// empty the string
-				auto rem = source.length();
-				source = source.substr(rem);
-				loc.col += rem;
-				return;
-			}
+#if defined(__AVX2__)
+	#include <immintrin.h>
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
 
-			++loc.row;
-			loc.col = 0;
-			source = source.substr(n + 1);
-			continue;
-		} else if(source[0] == '\n') {
+// Byte classification. The vectorized versions classify a block of
+// bytes at once, returning a bit per byte; the scalar ones handle the
+// rest and targets without SSE2.
+bool isSpace(char c) {
+	return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+bool isDelimiter(char c) {
+	return isSpace(c) || c == '(' || c == ')';
+}
+
+#if defined(__AVX2__)
+using Block = __m256i;
+using Mask = std::uint32_t;
+constexpr auto blockSize = 32u;
+
+Block load(const char* data) {
+	return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+}
+
+Mask equal(Block v, char c) {
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+Mask space(Block v) {
+	// '\t' to '\r' via signed comparison of the biased bytes
+	auto biased = _mm256_add_epi8(v, _mm256_set1_epi8(char(0x80 - '\t')));
+	auto ctrl = _mm256_cmpgt_epi8(_mm256_set1_epi8(char(-128 + 5)), biased);
+	return _mm256_movemask_epi8(ctrl) | equal(v, ' ');
+}
+#elif defined(__SSE2__)
+using Block = __m128i;
+using Mask = std::uint32_t;
+constexpr auto blockSize = 16u;
+
+Block load(const char* data) {
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+}
+
+Mask equal(Block v, char c) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+Mask space(Block v) {
+	// '\t' to '\r' via signed comparison of the biased bytes
+	auto biased = _mm_add_epi8(v, _mm_set1_epi8(char(0x80 - '\t')));
+	auto ctrl = _mm_cmplt_epi8(biased, _mm_set1_epi8(char(-128 + 5)));
+	return _mm_movemask_epi8(ctrl) | equal(v, ' ');
+}
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+constexpr Mask fullMask = Mask(~0ull >> (64 - blockSize));
+
+// Moves loc over count skipped bytes, given the newline bits in them.
+void advance(Location& loc, unsigned count, Mask newlines) {
+	if(!newlines) {
+		loc.col += count;
+		return;
+	}
+
+	auto last = 31 - __builtin_clz(newlines);
+	loc.row += __builtin_popcount(newlines);
+	loc.col = count - last - 1;
+}
+#endif
+
+// Moves loc over the given text.
+void advance(Location& loc, std::string_view text) {
+	auto newline = text.rfind('\n');
+	if(newline == text.npos) {
+		loc.col += text.size();
+		return;
+	}
+
+	loc.row += std::count(text.begin(), text.end(), '\n');
+	loc.col = text.size() - newline - 1;
+}
+
+// Returns the number of whitespace bytes at the start of source.
+std::size_t skipSpace(std::string_view source, Location& loc) {
+	auto data = source.data();
+	auto i = 0u;
+
+	// tokens are mostly separated by a single space
+	if(source.empty() || !isSpace(data[0])) {
+		return 0u;
+	} else if(data[0] == ' ' && (source.size() == 1 || !isSpace(data[1]))) {
+		++loc.col;
+		return 1u;
+	}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	for(; i + blockSize <= source.size(); i += blockSize) {
+		auto v = load(data + i);
+		auto spaces = space(v);
+		auto newlines = equal(v, '\n');
+		if(spaces != fullMask) {
+			auto count = __builtin_ctz(~spaces);
+			advance(loc, count, newlines & ((Mask(1u) << count) - 1));
+			return i + count;
+		}
+
+		advance(loc, blockSize, newlines);
+	}
+#endif
+
+	for(; i < source.size() && isSpace(data[i]); ++i) {
+		if(data[i] == '\n') {
 			++loc.row;
 			loc.col = 0;
 		} else {
 			++loc.col;
 		}
-		source = source.substr(1);
+	}
+
+	return i;
+}
+
+// Returns the length of the token at the start of source.
+std::size_t findDelimiter(std::string_view source) {
+	auto data = source.data();
+	auto i = 0u;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	for(; i + blockSize <= source.size(); i += blockSize) {
+		auto v = load(data + i);
+		auto delims = space(v) | equal(v, '(') | equal(v, ')');
+		if(delims) {
+			return i + __builtin_ctz(delims);
+		}
+	}
+#endif
+
+	while(i < source.size() && !isDelimiter(data[i])) {
+		++i;
+	}
+
+	return i;
+}
+
+void skipws(std::string_view& source, Location& loc) {
+	while(true) {
+		source.remove_prefix(skipSpace(source, loc));
+		if(source.empty() || source[0] != ';') {
+			return;
+		}
+
+		// comment
+		auto n = source.find('\n');
+		if(n == source.npos) {
+			loc.col += source.size();
+			source = {};
+			return;
+		}
+
+		++loc.row;
+		loc.col = 0;
+		source.remove_prefix(n + 1);
 	}
 }
 
@@ -31,92 +180,325 @@ void skipws(Parser& parser) {
 	skipws(parser.source, parser.loc);
 }
 
-std::string_view consume(std::string_view& source, unsigned n, Location& loc) {
-	auto token = source.substr(0, n);
-	source = source.substr(n);
-	loc.col += n;
-	return token;
+CompileError::CompileError(std::string msg, const Location& l) :
+	std::runtime_error(std::to_string(l.row) + ":" +
+		std::to_string(l.col) + ": " + msg),
+	loc(l), message(std::move(msg)) {
 }
 
 void throwError(std::string msg, const Location& loc) {
-	msg = std::to_string(loc.row) + ":" + std::to_string(loc.col) + ": " + msg;
-	throw std::runtime_error(msg);
+	throw CompileError(std::move(msg), loc);
 }
 
-Expression nextExpression(std::string_view& view, Location& loc) {
-	if(view.empty()) {
-		throwError("Empty expression (unexpected source end)", loc);
+Symbol SymbolTable::intern(std::string_view name) {
+	{
+		std::shared_lock lock(mutex_);
+		auto it = symbols_.find(name);
+		if(it != symbols_.end()) {
+			return it->second;
+		}
+	}
+
+	// builtins keep their fixed symbols, they are only cached here
+	auto symbol = builtinSymbol(name);
+	std::unique_lock lock(mutex_);
+	auto it = symbols_.find(name);
+	if(it != symbols_.end()) {
+		return it->second;
+	}
+
+	if(!symbol) {
+		symbol = builtinCount + ++userCount_;
 	}
 
+	symbols_.emplace(names_.emplace_back(name), symbol);
+	return symbol;
+}
+
+Token nextToken(std::string_view& view, Location& loc) {
 	skipws(view, loc);
-	auto oloc = loc;
-
-	// 1: test whether it's a number
-	const char* end = &*view.end();
-	double value = std::strtod(view.data(), const_cast<char**>(&end));
-	if(end != view.data()) {
-		auto count = end - view.data();
-		view = view.substr(count);
-		loc.col += count;
-		return {value, oloc};
+	Token token {TokenKind::eEnd, {}, loc};
+	if(view.empty()) {
+		return token;
+	}
+
+	auto c = view[0];
+	if(c == '(') {
+		token.kind = TokenKind::eOpen;
+		view.remove_prefix(1);
+		++loc.col;
+		++loc.depth;
+		return token;
 	}
 
-	// 2: test whether it's a string
-	if(view[0] == '"') {
-		consume(view, 1, loc); // skip initial "
-		auto end = view.find('"');
+	if(c == ')') {
+		token.kind = TokenKind::eClose;
+		view.remove_prefix(1);
+		++loc.col;
+		loc.depth -= loc.depth > 0;
+		return token;
+	}
+
+	if(c == '"') {
+		auto end = view.find('"', 1);
 		if(end == view.npos) {
-			throwError("Unterminated '\"'", oloc);
+			throwError("Unterminated '\"'", token.loc);
 		}
 
+		token.kind = TokenKind::eString;
+		token.text = view.substr(1, end - 1);
+		advance(loc, view.substr(0, end + 1));
+		view.remove_prefix(end + 1);
+		return token;
+	}
+
+	auto size = findDelimiter(view);
+	token.kind = TokenKind::eIdentifier;
+	token.text = view.substr(0, size);
+	view.remove_prefix(size);
+	loc.col += size;
 
-		auto str = consume(view, end, loc);
-		consume(view, 1, loc); // skip final "
-		return {str, oloc};
+	if((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.') {
+		auto begin = token.text.data();
+		auto end = begin + size;
+		if(c == '+' && size > 1 && begin[1] != '-' && begin[1] != '+') {
+			++begin; // from_chars doesn't accept the explicit sign
+		}
+
+		auto [ptr, ec] = std::from_chars(begin, end, token.number);
+		if(ptr == end && ec == std::errc {}) {
+			token.kind = TokenKind::eNumber;
+		} else if(ptr != begin || ec == std::errc::result_out_of_range) {
+			throwError("Invalid number", token.loc);
+		}
 	}
 
-	// 3: test if it's application
-	if(view[0] == '(') {
-		consume(view, 1, loc);
-		++loc.depth;
+	return token;
+}
+
+Token nextToken(Parser& p) {
+	return nextToken(p.source, p.loc);
+}
 
-		skipws(view, loc);
-		List list;
-		while(!view.empty() && view[0] != ')') {
-			auto e = nextExpression(view, loc);
-			list.values.push_back(e);
-			skipws(view, loc);
+Symbol intern(Parser& p, std::string_view name) {
+	if(!p.symbols) {
+		return 0u;
+	} else if(!p.symbolCache) {
+		return p.symbols->intern(name);
+	}
+
+	auto [it, inserted] = p.symbolCache->try_emplace(name);
+	if(inserted) {
+		it->second = p.symbols->intern(name);
+	}
+
+	return it->second;
+}
+
+// Expression of a token that isn't '('.
+Expression atom(Parser& p, const Token& token) {
+	switch(token.kind) {
+		case TokenKind::eEnd:
+			throwError("Empty expression (unexpected source end)", token.loc);
+		case TokenKind::eClose:
+			throwError("Unexpected ')'", token.loc);
+		case TokenKind::eNumber:
+			return {token.number, token.loc};
+		case TokenKind::eString:
+			return {token.text, token.loc};
+		case TokenKind::eIdentifier:
+			if(token.text == "true") {
+				return {true, token.loc};
+			} else if(token.text == "false") {
+				return {false, token.loc};
+			}
+
+			return {Identifier{token.text, intern(p, token.text)}, token.loc};
+		case TokenKind::eOpen:
+			break;
+	}
+
+	throw std::logic_error("atom: unexpected '('");
+}
+
+void* Arena::do_allocate(std::size_t bytes, std::size_t alignment) {
+	for(; current_ < blocks_.size(); ++current_, used_ = 0u) {
+		auto& block = blocks_[current_];
+		auto begin = reinterpret_cast<std::uintptr_t>(block.data.get());
+		auto offset = ((begin + used_ + alignment - 1) & ~(alignment - 1)) - begin;
+		if(offset + bytes <= block.size) {
+			used_ = offset + bytes;
+			return block.data.get() + offset;
 		}
+	}
+
+	auto size = blocks_.empty() ? initialBlockSize : 2 * blocks_.back().size;
+	size = std::max(size, bytes + alignment);
+	blocks_.push_back({std::unique_ptr<std::byte[]>(new std::byte[size]), size});
+	return do_allocate(bytes, alignment);
+}
+
+// Iterative, so the nesting is only limited by memory.
+Expression nextExpression(Parser& p) {
+	// elements of the open lists, closed lists are moved into the arena
+	std::vector<Expression> values;
+	std::vector<std::pair<std::size_t, Location>> open; // first value, '('
+
+	auto token = nextToken(p);
+	while(true) {
+		if(token.kind == TokenKind::eOpen) {
+			open.push_back({values.size(), token.loc});
+		} else if(open.empty()) {
+			return atom(p, token);
+		} else if(token.kind == TokenKind::eEnd) {
+			// reported for the innermost list
+			throwError("Unterminted '('", open.back().second);
+		} else if(token.kind == TokenKind::eClose) {
+			auto [begin, loc] = open.back();
+			open.pop_back();
+
+			dlg_assert(p.arena);
+			auto list = p.arena->alloc<Expression>(values.size() - begin);
+			std::uninitialized_copy(values.begin() + begin, values.end(),
+				list.begin());
+			values.resize(begin);
+			if(open.empty()) {
+				return {List{list}, loc};
+			}
 
-		--loc.depth;
-		if(view.empty()) {
-			throwError("Unterminted '('", oloc);
+			values.push_back({List{list}, loc});
+		} else {
+			values.push_back(atom(p, token));
 		}
 
-		if(view[0] != ')') {
-			throwError("Invalid termination of expression", loc);
+		token = nextToken(p);
+	}
+}
+
+// Mirrors nextExpression but doesn't build the expression.
+void skipExpression(Parser& p) {
+	auto token = nextToken(p);
+	if(token.kind == TokenKind::eEnd) {
+		throwError("Empty expression (unexpected source end)", token.loc);
+	} else if(token.kind == TokenKind::eClose) {
+		throwError("Unexpected ')'", token.loc);
+	}
+
+	// open lists, errors are reported for the innermost one
+	std::vector<Location> open;
+	if(token.kind == TokenKind::eOpen) {
+		open.push_back(token.loc);
+	}
+
+	while(!open.empty()) {
+		auto next = nextToken(p);
+		if(next.kind == TokenKind::eOpen) {
+			open.push_back(next.loc);
+		} else if(next.kind == TokenKind::eClose) {
+			open.pop_back();
+		} else if(next.kind == TokenKind::eEnd) {
+			throwError("Unterminted '('", open.back());
 		}
+	}
+}
+
+bool isSpecial(char c) {
+	return c == '(' || c == ')' || c == '"' || c == ';';
+}
 
-		consume(view, 1, loc);
-		return {list, loc};
+// Returns a bit for every '(', ')', '"' and ';' in data[0, count),
+// for up to 32 bytes.
+std::uint32_t findSpecial(const char* data, std::size_t count) {
+	auto ret = std::uint32_t(0u);
+	auto i = 0u;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	for(; i + blockSize <= count; i += blockSize) {
+		auto v = load(data + i);
+		auto special = equal(v, '(') | equal(v, ')') | equal(v, '"') |
+			equal(v, ';');
+		ret |= special << i;
+	}
+#endif
+
+	for(; i < count; ++i) {
+		ret |= std::uint32_t(isSpecial(data[i])) << i;
+	}
+
+	return ret;
+}
+
+// Returns the size of the form at the start of source, see scanForms.
+std::size_t formSize(std::string_view source) {
+	auto npos = source.npos;
+	if(source[0] == ')') {
+		return 1u;
+	} else if(source[0] == '"') {
+		auto end = source.find('"', 1);
+		return end == npos ? source.size() : end + 1;
+	} else if(source[0] != '(') {
+		return findDelimiter(source);
 	}
 
-	// otherwise it's an identifier
-	auto term = view.find_first_of("\n\t\r\v\f ()");
-	if(term == view.npos) {
-		throwError("Invalid expression", oloc);
+	// '"' and ';' inside identifiers don't start strings or comments
+	auto data = source.data();
+	auto depth = 1u;
+	auto stringEnd = npos; // position after the last string
+	auto pos = std::size_t(1u);
+	while(pos < source.size()) {
+		auto count = std::min<std::size_t>(32u, source.size() - pos);
+		auto next = pos + count;
+		for(auto special = findSpecial(data + pos, count); special;
+				special &= special - 1) {
+			auto i = pos + __builtin_ctz(special);
+			auto c = data[i];
+			if(c == '(') {
+				++depth;
+			} else if(c == ')') {
+				if(--depth == 0) {
+					return i + 1;
+				}
+			} else if(isDelimiter(data[i - 1]) || i == stringEnd) {
+				auto end = source.find(c == '"' ? '"' : '\n', i + 1);
+				if(end == npos) {
+					return source.size();
+				}
+
+				stringEnd = c == '"' ? end + 1 : npos;
+				next = end + 1;
+				break;
+			}
+		}
+
+		pos = next;
 	}
 
-	auto name = consume(view, term, loc);
-	if(name == "true") {
-		return {true, oloc};
-	} else if(name == "false") {
-		return {false, oloc};
+	return source.size();
+}
+
+std::vector<SourceForm> scanForms(std::string_view source) {
+	std::vector<SourceForm> ret;
+	Location loc {};
+	skipws(source, loc);
+	while(!source.empty()) {
+		auto text = source.substr(0, formSize(source));
+		ret.push_back({text, loc});
+		advance(loc, text);
+		source.remove_prefix(text.size());
+		skipws(source, loc);
 	}
 
-	return {Identifier{name}, oloc};
+	return ret;
 }
 
-Expression nextExpression(Parser& p) {
-	return nextExpression(p.source, p.loc);
+SourceForm skipForm(Parser& p) {
+	skipws(p);
+	SourceForm ret {p.source, p.loc};
+	if(!p.source.empty()) {
+		ret.text = p.source.substr(0, formSize(p.source));
+		advance(p.loc, ret.text);
+		p.source.remove_prefix(ret.text.size());
+	}
+
+	return ret;
 }
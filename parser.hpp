@@ -1,8 +1,18 @@
 #pragma once
 
+#include <deque>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <stdexcept>
+#include <shared_mutex>
+#include <unordered_map>
+#include <memory>
+#include <memory_resource>
 
 struct Expression;
 
@@ -10,14 +20,107 @@ struct Location {
 	unsigned row {0};
 	unsigned col {0};
 	unsigned depth {0};
+	unsigned file {0}; // imported module, see module.hpp. 0 for the source
 };
 
+// Thrown for all errors in the compiled program.
+// what() contains the location, message just the error itself.
+struct CompileError : public std::runtime_error {
+	Location loc;
+	std::string message;
+
+	CompileError(std::string msg, const Location& loc);
+};
+
+// Non-owning view of contiguous objects, like std::span.
+template<typename T>
+class Span {
+public:
+	Span() = default;
+	Span(T* data, std::size_t size) : data_(data), size_(size) {}
+
+	template<typename U, typename = std::enable_if_t<
+		std::is_convertible_v<U(*)[], T(*)[]>>>
+	Span(const Span<U>& other) : data_(other.data()), size_(other.size()) {}
+
+	T* data() const { return data_; }
+	T* begin() const { return data_; }
+	T* end() const { return data_ + size_; }
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0u; }
+
+	T& operator[](std::size_t i) const { return data_[i]; }
+	T& front() const { return data_[0]; }
+	T& back() const { return data_[size_ - 1]; }
+
+	// Removes the last object from the view.
+	void pop_back() { --size_; }
+
+protected:
+	T* data_ {};
+	std::size_t size_ {};
+};
+
+// Monotonic memory: allocating just bumps a pointer, everything is
+// released at once with the arena. Holds the expressions of a parsed
+// source or the temporaries of a compilation, also usable as memory
+// resource of pmr containers. Not thread-safe.
+class Arena : public std::pmr::memory_resource {
+public:
+	Arena() = default;
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	// Uninitialized storage for count objects.
+	template<typename T>
+	Span<T> alloc(std::size_t count) {
+		static_assert(std::is_trivially_destructible_v<T>);
+		if(count == 0u) {
+			return {};
+		}
+
+		auto data = allocate(count * sizeof(T), alignof(T));
+		return {static_cast<T*>(data), count};
+	}
+
+	// Releases everything allocated so far but keeps the memory for
+	// the next allocations, e.g. of the next compilation.
+	void reset() {
+		current_ = 0u;
+		used_ = 0u;
+	}
+
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+	void do_deallocate(void*, std::size_t, std::size_t) override {}
+	bool do_is_equal(const memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+
+protected:
+	static constexpr std::size_t initialBlockSize = 1024u;
+
+	struct Block {
+		std::unique_ptr<std::byte[]> data;
+		std::size_t size;
+	};
+
+	std::vector<Block> blocks_; // each one twice as big as the last
+	std::size_t current_ {}; // block allocations come from
+	std::size_t used_ {}; // bytes of the current block
+};
+
+// The values are in the arena of the source, see Parser.
 struct List {
-	std::vector<Expression> values;
+	Span<Expression> values;
 };
 
+// Interned identifier name, see SymbolTable.
+using Symbol = std::uint32_t;
+
 struct Identifier {
 	std::string_view name;
+	Symbol symbol {}; // 0 when parsed without symbol table
 };
 
 struct Expression {
@@ -25,10 +128,87 @@ struct Expression {
 	Location loc;
 };
 
+// Maps identifier names to dense symbols, starting at 1. The builtins
+// always have the symbols 1 to builtinCount (see fwd.hpp), so they can
+// be dispatched by symbol. Names are copied, thread-safe.
+class SymbolTable {
+public:
+	Symbol intern(std::string_view name);
+
+protected:
+	std::shared_mutex mutex_;
+	std::unordered_map<std::string_view, Symbol> symbols_;
+	std::deque<std::string> names_; // keys of symbols_
+	Symbol userCount_ {}; // symbols that aren't builtins
+};
+
 struct Parser {
 	std::string_view source;
 	Location loc {};
+
+	// Identifiers are interned into it. Expressions used for codegen
+	// must be parsed with the symbol table of the compilation.
+	SymbolTable* symbols {};
+
+	// Optional cache in front of symbols, e.g. one per thread when
+	// parsing in parallel to not contend on the table. References
+	// the source, so must not outlive it.
+	std::unordered_map<std::string_view, Symbol>* symbolCache {};
+
+	// Lists are allocated in it, it must outlive the expressions.
+	// Only needed for nextExpression.
+	Arena* arena {};
+};
+
+enum class TokenKind {
+	eEnd, // end of source
+	eOpen, // (
+	eClose, // )
+	eNumber,
+	eString,
+	eIdentifier, // also true and false
+};
+
+struct Token {
+	TokenKind kind;
+	std::string_view text; // for strings without the quotes
+	Location loc;
+	double number {}; // for numbers
 };
 
+// Returns the symbol of the name, via the symbol table of the parser
+// and its cache. 0 when it has no symbol table.
+Symbol intern(Parser& p, std::string_view name);
+
+// Lexer. Skips whitespace and comments, returns the next token.
+// Tokens are separated by whitespace and parentheses, comments start
+// with ';' and end with the line. Numbers are tokens that start with a
+// digit, sign or dot and parse completely as number, other tokens
+// starting with those are identifiers.
+Token nextToken(Parser& p);
+
 void skipws(Parser& p);
 Expression nextExpression(Parser& p);
+
+// Skips the next expression, throws on the same errors as nextExpression.
+void skipExpression(Parser& p);
+
+// Source text of a top-level form and its location.
+struct SourceForm {
+	std::string_view text;
+	Location loc;
+};
+
+// Splits the source into its top-level forms without parsing them,
+// e.g. to parse them in parallel. Only tracks parentheses, strings and
+// comments, following the rules of the lexer. Never throws: malformed
+// forms extend to the end of the source (unterminated '(' or '"') or
+// are a single ')', parsing them reports the same error as parsing
+// the whole source.
+std::vector<SourceForm> scanForms(std::string_view source);
+
+// Skips the next expression like skipExpression, but only tracks
+// parentheses, strings and comments like scanForms and doesn't check
+// its tokens. Returns its text, up to the end of the source when it's
+// unterminated.
+SourceForm skipForm(Parser& p);
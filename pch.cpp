@@ -0,0 +1,354 @@
+#include "pch.hpp"
+#include "fwd.hpp"
+#include "cache.hpp"
+
+#include <new>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+constexpr auto pchAlignment = 8u;
+
+std::size_t alignPch(std::size_t offset) {
+	return (offset + pchAlignment - 1) & ~std::size_t(pchAlignment - 1);
+}
+
+struct PchWriter {
+	std::vector<PchModule> modules;
+	std::vector<std::uint32_t> imports;
+	std::vector<PchDefine> defines;
+	std::vector<std::uint32_t> declarations;
+	std::vector<PchNode> nodes;
+	std::string strings;
+
+	std::unordered_map<std::string_view, PchString> stringMap;
+	std::unordered_map<const Module*, std::uint32_t> moduleMap;
+
+	PchString string(std::string_view str) {
+		auto [it, inserted] = stringMap.try_emplace(str);
+		if(inserted) {
+			it->second = {std::uint32_t(strings.size()), std::uint32_t(str.size())};
+			strings += str;
+		}
+
+		return it->second;
+	}
+
+	// Iterative, definitions can be nested arbitrarily deep.
+	void fill(std::uint32_t root, const Expression& rootExpr) {
+		// in the order of a recursive traversal, children before siblings
+		std::vector<std::pair<std::uint32_t, const Expression*>> stack;
+		stack.push_back({root, &rootExpr});
+		while(!stack.empty()) {
+			auto [id, expr] = stack.back();
+			stack.pop_back();
+			fill(id, *expr, stack);
+		}
+	}
+
+	void fill(std::uint32_t id, const Expression& expr,
+			std::vector<std::pair<std::uint32_t, const Expression*>>& stack) {
+		PchNode node {};
+		node.row = expr.loc.row;
+		node.col = expr.loc.col;
+		node.depth = expr.loc.depth;
+
+		std::visit(Visitor{
+			[&](bool val) {
+				node.kind = PchNodeKind::eBool;
+				node.boolean = val;
+			},
+			[&](double val) {
+				node.kind = PchNodeKind::eNumber;
+				node.number = val;
+			},
+			[&](std::string_view val) {
+				node.kind = PchNodeKind::eString;
+				node.string = string(val);
+			},
+			[&](const Identifier& val) {
+				node.kind = PchNodeKind::eIdentifier;
+				node.string = string(val.name);
+			},
+			[&](const List& list) {
+				// reserve all children first so they are consecutive
+				node.kind = PchNodeKind::eList;
+				node.list.first = nodes.size();
+				node.list.count = list.values.size();
+				nodes.resize(nodes.size() + list.values.size());
+				for(auto i = list.values.size(); i-- > 0u;) {
+					stack.push_back({node.list.first + i, &list.values[i]});
+				}
+			},
+		}, expr.value);
+
+		nodes[id] = node;
+	}
+
+	void fill(std::uint32_t id, const CExpression& expr) {
+		std::visit(Visitor{
+			[&](const GenExpr&) {
+				throw std::logic_error("Generated expression in module");
+			},
+			[&](const auto& val) { fill(id, Expression{val, expr.loc}); },
+		}, expr.value);
+	}
+
+	std::uint32_t add(const Module& module) {
+		if(auto it = moduleMap.find(&module); it != moduleMap.end()) {
+			return it->second;
+		}
+
+		std::vector<std::uint32_t> importIds;
+		for(auto& import : module.imports) {
+			importIds.push_back(add(*import));
+		}
+
+		PchModule pm {};
+		pm.path = string(module.path);
+		pm.mtime = module.mtime.time_since_epoch().count();
+		std::memcpy(pm.hash, module.hash.data(), sizeof(pm.hash));
+		pm.importsBegin = imports.size();
+		pm.importCount = importIds.size();
+		imports.insert(imports.end(), importIds.begin(), importIds.end());
+
+		pm.definesBegin = defines.size();
+		pm.defineCount = module.defines.size();
+		for(auto& [name, value] : module.defines) {
+			auto node = std::uint32_t(nodes.size());
+			nodes.emplace_back();
+			fill(node, value.get());
+			defines.push_back({string(name.name), node, 0u});
+		}
+
+		pm.declarationsBegin = declarations.size();
+		pm.declarationCount = module.declarations.size();
+		for(auto& decl : module.declarations) {
+			auto node = std::uint32_t(nodes.size());
+			nodes.emplace_back();
+			fill(node, decl);
+			declarations.push_back(node);
+		}
+
+		auto id = std::uint32_t(modules.size());
+		modules.push_back(pm);
+		moduleMap[&module] = id;
+		return id;
+	}
+};
+
+void writePch(const Module& module, std::string_view path) {
+	PchWriter writer;
+	writer.add(module);
+
+	PchHeader header {};
+	header.magic = pchMagic;
+	header.formatVersion = pchFormatVersion;
+	std::memcpy(header.compiler, compilerId().data(), sizeof(header.compiler));
+	header.moduleCount = writer.modules.size();
+	header.importCount = writer.imports.size();
+	header.defineCount = writer.defines.size();
+	header.declarationCount = writer.declarations.size();
+	header.nodeCount = writer.nodes.size();
+	header.stringsSize = writer.strings.size();
+
+	std::string data;
+	auto append = [&](const void* src, std::size_t size) {
+		data.append(static_cast<const char*>(src), size);
+		data.resize(alignPch(data.size()));
+	};
+
+	append(&header, sizeof(header));
+	append(writer.modules.data(), writer.modules.size() * sizeof(PchModule));
+	append(writer.imports.data(), writer.imports.size() * 4);
+	append(writer.defines.data(), writer.defines.size() * sizeof(PchDefine));
+	append(writer.declarations.data(), writer.declarations.size() * 4);
+	append(writer.nodes.data(), writer.nodes.size() * sizeof(PchNode));
+	append(writer.strings.data(), writer.strings.size());
+
+	std::ofstream ofs(std::string{path}, std::ios::binary);
+	ofs.write(data.data(), data.size());
+	if(!ofs) {
+		throw std::runtime_error("Can't write " + std::string(path));
+	}
+}
+
+std::shared_ptr<const Module> ModuleCache::loadPrecompiled(std::string_view path) {
+	auto file = mapFile(path);
+	auto& storage = file.storage;
+	auto size = file.data.size();
+	auto base = file.data.data();
+	auto invalid = [&](const char* what) {
+		throw std::runtime_error(std::string(path) + ": invalid pch (" + what + ")");
+	};
+
+	// sections
+	std::size_t offset = 0u;
+	auto section = [&](std::size_t bytes) {
+		auto ret = base + offset;
+		if(offset + bytes > size) {
+			invalid("truncated");
+		}
+
+		offset = alignPch(offset + bytes);
+
+		return ret;
+	};
+
+	if(size < sizeof(PchHeader)) {
+		invalid("truncated");
+	}
+
+	auto& header = *reinterpret_cast<const PchHeader*>(section(sizeof(PchHeader)));
+	if(header.magic != pchMagic) {
+		invalid("magic");
+	}
+
+	if(header.formatVersion != pchFormatVersion ||
+			std::memcmp(header.compiler, compilerId().data(),
+				sizeof(header.compiler))) {
+		invalid("written by another compiler build");
+	}
+
+	auto pmodules = reinterpret_cast<const PchModule*>(
+		section(header.moduleCount * sizeof(PchModule)));
+	auto imports = reinterpret_cast<const std::uint32_t*>(
+		section(header.importCount * 4));
+	auto defines = reinterpret_cast<const PchDefine*>(
+		section(header.defineCount * sizeof(PchDefine)));
+	auto declarations = reinterpret_cast<const std::uint32_t*>(
+		section(header.declarationCount * 4));
+	auto nodes = reinterpret_cast<const PchNode*>(
+		section(header.nodeCount * sizeof(PchNode)));
+	auto strings = section(header.stringsSize);
+	if(header.moduleCount == 0) {
+		invalid("no modules");
+	}
+
+	auto string = [&](const PchString& str) {
+		if(std::uint64_t(str.offset) + str.size > header.stringsSize) {
+			invalid("string out of bounds");
+		}
+
+		return std::string_view(strings + str.offset, str.size);
+	};
+
+	// children always come after their list, so this terminates.
+	// Iterative, definitions can be nested arbitrarily deep.
+	auto build = [&](std::uint32_t root, unsigned file, Arena& arena) {
+		struct Open {
+			Span<Expression> values;
+			std::uint32_t first; // node of values[0]
+			std::uint32_t next; // index of the next value
+		};
+
+		Expression ret;
+		std::vector<Open> open;
+		auto id = root;
+		auto slot = &ret;
+		while(true) {
+			if(id >= header.nodeCount) {
+				invalid("node out of bounds");
+			}
+
+			auto& node = nodes[id];
+			Expression expr;
+			expr.loc = {node.row, node.col, node.depth, file};
+			switch(node.kind) {
+				case PchNodeKind::eBool: expr.value = bool(node.boolean); break;
+				case PchNodeKind::eNumber: expr.value = node.number; break;
+				case PchNodeKind::eString: expr.value = string(node.string); break;
+				case PchNodeKind::eIdentifier: {
+					auto name = string(node.string);
+					expr.value = Identifier{name, symbols_.intern(name)};
+					break;
+				}
+				case PchNodeKind::eList: {
+					if(node.list.first <= id ||
+							std::uint64_t(node.list.first) + node.list.count >
+								header.nodeCount) {
+						invalid("list out of bounds");
+					}
+
+					// the values are built next
+					auto values = arena.alloc<Expression>(node.list.count);
+					open.push_back({values, node.list.first, 0u});
+					expr.value = List{values};
+					break;
+				}
+				default:
+					invalid("node kind");
+			}
+
+			new(slot) Expression(expr);
+			while(!open.empty() &&
+					open.back().next == open.back().values.size()) {
+				open.pop_back();
+			}
+
+			if(open.empty()) {
+				return ret;
+			}
+
+			auto& list = open.back();
+			id = list.first + list.next;
+			slot = &list.values[list.next++];
+		}
+	};
+
+	std::lock_guard lock(mutex_);
+	std::vector<std::shared_ptr<const Module>> loaded;
+	for(auto m = 0u; m < header.moduleCount; ++m) {
+		auto& pm = pmodules[m];
+		auto module = std::make_shared<Module>();
+		module->storage = storage;
+		module->precompiled = true;
+		module->path = string(pm.path);
+		module->mtime = fs::file_time_type(fs::file_time_type::duration(pm.mtime));
+		std::memcpy(module->hash.data(), pm.hash, sizeof(pm.hash));
+
+		paths_.push_back(module->path);
+		module->id = paths_.size();
+
+		if(std::uint64_t(pm.importsBegin) + pm.importCount > header.importCount ||
+				std::uint64_t(pm.definesBegin) + pm.defineCount > header.defineCount ||
+				std::uint64_t(pm.declarationsBegin) + pm.declarationCount >
+					header.declarationCount) {
+			invalid("module out of bounds");
+		}
+
+		for(auto i = 0u; i < pm.importCount; ++i) {
+			auto import = imports[pm.importsBegin + i];
+			if(import >= m) {
+				invalid("import order");
+			}
+
+			module->imports.push_back(loaded[import]);
+		}
+
+		for(auto i = 0u; i < pm.defineCount; ++i) {
+			auto& define = defines[pm.definesBegin + i];
+			auto name = string(define.name);
+			module->defines.emplace_back(Identifier{name, symbols_.intern(name)},
+				LazyExpression(build(define.value, module->id, module->arena)));
+		}
+
+		for(auto i = 0u; i < pm.declarationCount; ++i) {
+			auto node = declarations[pm.declarationsBegin + i];
+			auto decl = build(node, module->id, module->arena);
+			if(!asAggregate(decl)) {
+				invalid("declaration");
+			}
+
+			module->declarations.push_back(std::move(decl));
+		}
+
+		modules_[module->path] = module;
+		loaded.push_back(std::move(module));
+	}
+
+	return loaded.back();
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "module.hpp"
+#include <cstdint>
+
+// Precompiled modules, see `lambdav --emit-pch` and `--pch`.
+// A pch is a binary image of a module and everything it imports:
+// their parsed definitions and declarations (struct and variant forms)
+// as one flat node array and all strings
+// in one block. Loading it maps the file and rebuilds the expressions
+// from the nodes; strings aren't copied but reference the mapping.
+//
+// Layout, all in native byte order, sections 8-byte aligned:
+// PchHeader, PchModule[moduleCount], u32 imports[importCount],
+// PchDefine[defineCount], u32 declarations[declarationCount] (nodes),
+// PchNode[nodeCount], char strings[stringsSize].
+// Modules come after the modules they import.
+
+constexpr std::uint32_t pchMagic = 0x4843504C; // "LPCH"
+constexpr std::uint32_t pchFormatVersion = 3;
+
+struct PchHeader {
+	std::uint32_t magic;
+	std::uint32_t formatVersion;
+	std::uint8_t compiler[32]; // compilerId()
+	std::uint32_t moduleCount;
+	std::uint32_t importCount;
+	std::uint32_t defineCount;
+	std::uint32_t declarationCount;
+	std::uint32_t nodeCount;
+	std::uint64_t stringsSize;
+};
+
+struct PchString {
+	std::uint32_t offset; // into strings
+	std::uint32_t size;
+};
+
+struct PchModule {
+	PchString path;
+	std::int64_t mtime; // file_time_type ticks
+	std::uint8_t hash[32];
+	std::uint32_t importsBegin, importCount;
+	std::uint32_t definesBegin, defineCount;
+	std::uint32_t declarationsBegin, declarationCount;
+};
+
+struct PchDefine {
+	PchString name;
+	std::uint32_t value; // node
+	std::uint32_t pad;
+};
+
+enum class PchNodeKind : std::uint32_t {
+	eBool,
+	eNumber,
+	eString,
+	eIdentifier,
+	eList,
+};
+
+struct PchList {
+	std::uint32_t first; // node
+	std::uint32_t count;
+};
+
+// Children of a list are consecutive nodes after it.
+struct PchNode {
+	PchNodeKind kind;
+	std::uint32_t row, col, depth;
+	union {
+		double number;
+		std::uint32_t boolean;
+		PchString string; // also for identifiers
+		PchList list;
+	};
+};
+
+// Writes the module and all its imports as pch to the given file.
+// Throws std::runtime_error on error.
+void writePch(const Module& module, std::string_view path);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include <system_error>
+#include <pthread.h>
+
+// Returns the number of threads to use by default.
+inline unsigned defaultThreadCount() {
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// Runs f on a new thread with a stack of the given size and waits for
+// it, e.g. for deep recursion. Rethrows the exception thrown by f.
+template<typename F>
+void runWithStack(std::size_t stackSize, F&& f) {
+	struct Job {
+		std::remove_reference_t<F>* f;
+		std::exception_ptr error;
+	} job {&f, {}};
+
+	auto run = [](void* data) -> void* {
+		auto& job = *static_cast<Job*>(data);
+		try {
+			(*job.f)();
+		} catch(...) {
+			job.error = std::current_exception();
+		}
+
+		return nullptr;
+	};
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, stackSize);
+
+	pthread_t thread;
+	auto res = pthread_create(&thread, &attr, run, &job);
+	pthread_attr_destroy(&attr);
+	if(res != 0) {
+		throw std::system_error(res, std::generic_category(), "pthread_create");
+	}
+
+	pthread_join(thread, nullptr);
+	if(job.error) {
+		std::rethrow_exception(job.error);
+	}
+}
+
+// Runs job(index, worker) for all indices in [0, count) on the given
+// number of threads. Every worker owns a queue, initially filled
+// round-robin. Workers take jobs from the back of their own queue and,
+// when it runs empty, steal from the front of the other queues.
+// Since no jobs are added while running, workers stop once nothing
+// is left to steal. Rethrows the first exception thrown by a job.
+template<typename F>
+void parallelFor(std::size_t count, unsigned threads, F&& job) {
+	threads = std::max(1u, std::min<unsigned>(threads, count));
+	if(threads <= 1) {
+		for(auto i = 0u; i < count; ++i) {
+			job(i, 0u);
+		}
+		return;
+	}
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::size_t> jobs;
+	};
+
+	std::vector<Queue> queues(threads);
+	for(auto i = 0u; i < count; ++i) {
+		queues[i % threads].jobs.push_back(i);
+	}
+
+	std::mutex errorMutex;
+	std::exception_ptr error;
+
+	auto take = [&](unsigned worker, std::size_t& out) {
+		for(auto i = 0u; i < threads; ++i) {
+			auto& queue = queues[(worker + i) % threads];
+			std::lock_guard lock(queue.mutex);
+			if(queue.jobs.empty()) {
+				continue;
+			}
+
+			if(i == 0) { // own queue
+				out = queue.jobs.back();
+				queue.jobs.pop_back();
+			} else {
+				out = queue.jobs.front();
+				queue.jobs.pop_front();
+			}
+
+			return true;
+		}
+
+		return false;
+	};
+
+	auto run = [&](unsigned worker) {
+		std::size_t index;
+		while(take(worker, index)) {
+			try {
+				job(index, worker);
+			} catch(...) {
+				std::lock_guard lock(errorMutex);
+				if(!error) {
+					error = std::current_exception();
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for(auto i = 1u; i < threads; ++i) {
+		workers.emplace_back(run, i);
+	}
+
+	run(0u);
+	for(auto& worker : workers) {
+		worker.join();
+	}
+
+	if(error) {
+		std::rethrow_exception(error);
+	}
+}
@@ -0,0 +1,459 @@
+#include "server.hpp"
+#include "session.hpp"
+
+#include <map>
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <csignal>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+namespace fs = std::filesystem;
+
+// Interval in which watched files are checked for changes.
+constexpr auto watchInterval = 50; // ms
+
+// Limits of received messages, bigger ones close the connection.
+constexpr std::size_t maxHeader = 4096u;
+constexpr std::size_t maxPayload = 64 * 1024 * 1024;
+
+// Responses queued for a client that doesn't read them, above it
+// the connection is closed.
+constexpr std::size_t maxPending = 4 * maxPayload;
+
+bool readAll(int fd, char* data, std::size_t size) {
+	while(size > 0) {
+		auto res = ::read(fd, data, size);
+		if(res <= 0) {
+			return false;
+		}
+
+		data += res;
+		size -= res;
+	}
+
+	return true;
+}
+
+bool writeAll(int fd, const char* data, std::size_t size) {
+	while(size > 0) {
+		auto res = ::write(fd, data, size);
+		if(res <= 0) {
+			return false;
+		}
+
+		data += res;
+		size -= res;
+	}
+
+	return true;
+}
+
+bool parseHeader(std::string_view header, Message& msg, std::size_t& size) {
+	auto s1 = header.find(' ');
+	auto s2 = header.find(' ', s1 + 1);
+	if(s1 == header.npos || s2 == header.npos || s2 == s1 + 1) {
+		return false;
+	}
+
+	size = 0u;
+	for(auto c : header.substr(s1 + 1, s2 - s1 - 1)) {
+		if(c < '0' || c > '9') {
+			return false;
+		}
+
+		size = 10 * size + (c - '0');
+		if(size > maxPayload) {
+			return false;
+		}
+	}
+
+	msg.kind = header.substr(0, s1);
+	msg.path = header.substr(s2 + 1);
+	return true;
+}
+
+bool readMessage(int fd, Message& msg) {
+	std::string header;
+	char c;
+	while(readAll(fd, &c, 1)) {
+		if(c == '\n') {
+			std::size_t size;
+			if(!parseHeader(header, msg, size)) {
+				return false;
+			}
+
+			msg.payload.resize(size);
+			return readAll(fd, msg.payload.data(), size);
+		}
+
+		if(header.size() == maxHeader) {
+			return false;
+		}
+
+		header += c;
+	}
+
+	return false;
+}
+
+enum class Received {
+	incomplete,
+	message,
+	invalid,
+};
+
+// Takes the first message out of the data received from a connection.
+Received takeMessage(std::string& data, Message& msg) {
+	auto end = data.find('\n');
+	if(end == data.npos) {
+		return data.size() > maxHeader ? Received::invalid : Received::incomplete;
+	}
+
+	std::size_t size;
+	if(end > maxHeader || !parseHeader({data.data(), end}, msg, size)) {
+		return Received::invalid;
+	}
+
+	if(data.size() - (end + 1) < size) {
+		return Received::incomplete;
+	}
+
+	msg.payload = data.substr(end + 1, size);
+	data.erase(0, end + 1 + size);
+	return Received::message;
+}
+
+std::string serialize(const Message& msg) {
+	return msg.kind + " " + std::to_string(msg.payload.size()) + " " +
+		msg.path + "\n" + msg.payload;
+}
+
+bool writeMessage(int fd, const Message& msg) {
+	auto data = serialize(msg);
+	return writeAll(fd, data.data(), data.size());
+}
+
+sockaddr_un socketAddress(std::string_view path) {
+	sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Socket path too long");
+	}
+
+	std::memcpy(addr.sun_path, path.data(), path.size());
+	return addr;
+}
+
+Message response(const std::string& path, const CompileResult& res) {
+	Message msg;
+	msg.path = path;
+	if(auto spirv = std::get_if<std::vector<std::uint32_t>>(&res)) {
+		msg.kind = "spirv";
+		auto data = reinterpret_cast<const char*>(spirv->data());
+		msg.payload.assign(data, spirv->size() * 4);
+		return msg;
+	}
+
+	msg.kind = "errors";
+	for(auto& diag : std::get<std::vector<Diagnostic>>(res)) {
+		msg.payload += (diag.file.empty() ? path : diag.file) + ":";
+		msg.payload += std::to_string(diag.loc.row) + ":";
+		msg.payload += std::to_string(diag.loc.col) + ": ";
+		msg.payload += diag.message + "\n";
+	}
+
+	return msg;
+}
+
+int serve(std::string_view socketPath, ModuleCache& modules,
+		std::ostream& log) {
+	// written responses to closed connections must not kill the server
+	std::signal(SIGPIPE, SIG_IGN);
+
+	auto addr = socketAddress(socketPath);
+	auto listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener < 0) {
+		log << "socket: " << std::strerror(errno) << "\n";
+		return -2;
+	}
+
+	::unlink(addr.sun_path);
+	if(::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+			::listen(listener, 16)) {
+		log << "Can't listen on " << socketPath << ": ";
+		log << std::strerror(errno) << "\n";
+		::close(listener);
+		return -2;
+	}
+
+	struct File {
+		Session session;
+		fs::file_time_type mtime;
+		std::vector<int> watchers;
+	};
+
+	auto running = true;
+
+	// connections are non-blocking, received data is buffered until
+	// a message is complete and responses until the client reads them
+	struct Client {
+		std::string in;
+		std::string out;
+	};
+
+	std::map<std::string, File> files;
+	std::map<int, Client> clients;
+
+	auto getFile = [&](const std::string& path) -> File& {
+		auto it = files.find(path);
+		if(it == files.end()) {
+			Options options;
+			options.path = path;
+			options.modules = &modules;
+			it = files.emplace(path, File{Session(options), {}, {}}).first;
+		}
+
+		return it->second;
+	};
+
+	// whether the file or a module it imports changed
+	auto changed = [&](const std::string& path, const File& file) {
+		std::error_code ec;
+		if(fs::last_write_time(path, ec) != file.mtime && !ec) {
+			return true;
+		}
+
+		for(auto& module : file.session.imports()) {
+			if(!modules.current(*module)) {
+				return true;
+			}
+		}
+
+		return false;
+	};
+
+	auto compileFile = [&](const std::string& path, File& file,
+			const std::string* source) {
+		auto start = std::chrono::steady_clock::now();
+		std::error_code ec;
+		file.mtime = fs::last_write_time(path, ec);
+
+		CompileResult res;
+		try {
+			res = file.session.update(source ? *source : readFile(path));
+		} catch(const std::exception& err) {
+			res = std::vector<Diagnostic>{{{}, err.what()}};
+		}
+
+		using namespace std::chrono;
+		auto ms = duration<double, std::milli>(steady_clock::now() - start);
+		auto& info = file.session.lastUpdate();
+		log << path << ": " << ms.count() << " ms, generated ";
+		log << info.generated << ", parsed " << info.parsed << "/";
+		log << info.forms << " forms\n";
+		return response(path, res);
+	};
+
+	auto disconnect = [&](int fd) {
+		::close(fd);
+		clients.erase(fd);
+		for(auto& [path, file] : files) {
+			auto& w = file.watchers;
+			w.erase(std::remove(w.begin(), w.end(), fd), w.end());
+		}
+	};
+
+	// writes as much of the pending output as the connection takes
+	auto flush = [&](int fd) {
+		auto& out = clients.at(fd).out;
+		auto written = 0u;
+		while(written < out.size()) {
+			auto res = ::write(fd, out.data() + written, out.size() - written);
+			if(res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			} else if(res <= 0) {
+				return false;
+			}
+
+			written += res;
+		}
+
+		out.erase(0, written);
+		return true;
+	};
+
+	auto send = [&](int fd, const Message& msg) {
+		auto& out = clients.at(fd).out;
+		out += serialize(msg);
+		if(out.size() > maxPending) {
+			log << "Client doesn't read its responses, disconnecting\n";
+			disconnect(fd);
+		} else if(!flush(fd)) {
+			disconnect(fd);
+		}
+	};
+
+	auto handle = [&](int fd, Message& req) {
+		if(req.kind == "shutdown") {
+			running = false;
+			return;
+		}
+
+		auto& file = getFile(req.path);
+		auto source = req.kind == "source" ? &req.payload : nullptr;
+		if(req.kind == "watch") {
+			file.watchers.push_back(fd);
+		} else if(req.kind != "compile" && req.kind != "source") {
+			log << "Invalid request '" << req.kind << "'\n";
+			disconnect(fd);
+			return;
+		}
+
+		send(fd, compileFile(req.path, file, source));
+	};
+
+	// reads what's available, then handles all complete messages
+	auto receive = [&](int fd) {
+		char buf[64 * 1024];
+		auto res = ::read(fd, buf, sizeof(buf));
+		if(res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			return;
+		} else if(res <= 0) {
+			disconnect(fd);
+			return;
+		}
+
+		clients.at(fd).in.append(buf, res);
+		while(running && clients.count(fd)) {
+			Message req;
+			auto received = takeMessage(clients.at(fd).in, req);
+			if(received == Received::incomplete) {
+				break;
+			} else if(received == Received::invalid) {
+				log << "Invalid message, disconnecting\n";
+				disconnect(fd);
+				break;
+			}
+
+			handle(fd, req);
+		}
+	};
+
+	log << "Listening on " << socketPath << "\n";
+	while(running) {
+		std::vector<pollfd> fds;
+		fds.push_back({listener, POLLIN, 0});
+		for(auto& [fd, client] : clients) {
+			short events = client.out.empty() ? POLLIN : POLLIN | POLLOUT;
+			fds.push_back({fd, events, 0});
+		}
+
+		if(::poll(fds.data(), fds.size(), watchInterval) < 0 && errno != EINTR) {
+			log << "poll: " << std::strerror(errno) << "\n";
+			break;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			auto fd = ::accept(listener, nullptr, nullptr);
+			if(fd >= 0) {
+				::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+				clients[fd] = {};
+			}
+		}
+
+		for(auto i = 1u; i < fds.size() && running; ++i) {
+			auto fd = fds[i].fd;
+			if(!fds[i].revents || !clients.count(fd)) {
+				continue;
+			}
+
+			if((fds[i].revents & POLLOUT) && !flush(fd)) {
+				disconnect(fd);
+				continue;
+			}
+
+			if(fds[i].revents & ~POLLOUT) {
+				receive(fd);
+			}
+		}
+
+		// push changes of watched files
+		for(auto& [path, file] : files) {
+			if(file.watchers.empty() || !changed(path, file)) {
+				continue;
+			}
+
+			auto msg = compileFile(path, file, nullptr);
+			for(auto fd : std::vector<int>(file.watchers)) {
+				send(fd, msg);
+			}
+		}
+	}
+
+	for(auto& [fd, client] : clients) {
+		::close(fd);
+	}
+
+	::close(listener);
+	::unlink(addr.sun_path);
+	return 0;
+}
+
+int connectServer(std::string_view socketPath) {
+	auto addr = socketAddress(socketPath);
+	auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) {
+		throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+	}
+
+	if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+		auto msg = std::string("Can't connect to ") + std::string(socketPath);
+		msg += ": ";
+		msg += std::strerror(errno);
+		::close(fd);
+		throw std::runtime_error(msg);
+	}
+
+	return fd;
+}
+
+int runClient(std::string_view socketPath, std::string_view input,
+		bool watch, std::ostream& os) {
+	auto fd = connectServer(socketPath);
+	Message req;
+	req.kind = watch ? "watch" : "compile";
+	req.path = fs::absolute(fs::path(input)).lexically_normal().string();
+
+	int ret = -2;
+	Message res;
+	if(writeMessage(fd, req)) {
+		while(readMessage(fd, res)) {
+			if(res.kind == "spirv") {
+				std::vector<std::uint32_t> spirv(res.payload.size() / 4);
+				std::memcpy(spirv.data(), res.payload.data(), spirv.size() * 4);
+				writeFile("test.spv", spirv);
+				os << input << ": wrote test.spv" << std::endl;
+				ret = 0;
+			} else {
+				os << res.payload << std::flush;
+				ret = -3;
+			}
+
+			if(!watch) {
+				break;
+			}
+		}
+	}
+
+	::close(fd);
+	return ret;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <iosfwd>
+
+class ModuleCache;
+
+// Persistent compile server, see `lambdav --serve`.
+// Clients connect to a unix socket and exchange messages, each of them
+// a header line "<kind> <size> <path>\n" followed by size bytes of payload.
+// Requests:
+// - compile: compiles the file at the (absolute) path
+// - source: compiles the payload as content of the file at path,
+//   e.g. for unsaved editor buffers
+// - watch: like compile but answers again whenever the file changes
+// - shutdown: stops the server
+// Responses:
+// - spirv: the generated module
+// - errors: diagnostics, one "file:row:col: message" line each
+// The server keeps a compilation session (see session.hpp) per file,
+// so only the changed forms of a file have to be compiled again, and
+// shares imported modules between all files. Connections don't block
+// each other: the server only handles a request once it was received
+// completely and queues responses until the client reads them.
+
+struct Message {
+	std::string kind;
+	std::string path;
+	std::string payload;
+};
+
+// Blocking, return false on error or when the connection was closed.
+// Messages with payloads above 64 MiB are invalid.
+bool readMessage(int fd, Message& msg);
+bool writeMessage(int fd, const Message& msg);
+
+// Runs the server until it receives a shutdown request, all files share
+// the given module cache. Logs all requests to the given stream.
+// Returns the exit code.
+int serve(std::string_view socketPath, ModuleCache& modules, std::ostream& log);
+
+// Connects to the server, throws on error.
+int connectServer(std::string_view socketPath);
+
+// Compiles input on the server and writes the module to test.spv, like
+// a local compilation. When watch is true, keeps waiting for changes.
+int runClient(std::string_view socketPath, std::string_view input,
+	bool watch, std::ostream& os);
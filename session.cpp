@@ -0,0 +1,477 @@
+#include "session.hpp"
+#include "analysis.hpp"
+#include "pool.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+
+void shiftRows(Expression& expr, int delta) {
+	// iterative, forms can be nested arbitrarily deep
+	std::vector<Expression*> stack {&expr};
+	while(!stack.empty()) {
+		auto next = stack.back();
+		stack.pop_back();
+
+		next->loc.row += delta;
+		if(auto list = std::get_if<List>(&next->value)) {
+			for(auto& val : list->values) {
+				stack.push_back(&val);
+			}
+		}
+	}
+}
+
+Session::Session(Options options) : options_(std::move(options)) {
+	modules_ = options_.modules;
+	if(!modules_) {
+		localModules_ = std::make_unique<ModuleCache>();
+		modules_ = localModules_.get();
+	}
+}
+
+// Thrown when the source has extern or export forms.
+struct LinkageForms {};
+
+CompileResult Session::update(std::string_view source) {
+	try {
+		if(!options_.library) {
+			auto stackSize = codegenStackSize(options_.maxDepth);
+			if(!stackSize) {
+				return compileModule(source);
+			}
+
+			std::vector<u32> ret;
+			runWithStack(stackSize, [&]{ ret = compileModule(source); });
+			return ret;
+		}
+	} catch(const CompileError& err) {
+		return std::vector<Diagnostic>{diagnostic(err, *modules_)};
+	} catch(const LinkageForms&) {
+	} catch(const std::exception& err) {
+		return std::vector<Diagnostic>{diagnostic(err)};
+	}
+
+	// linked functions aren't tracked as fragments,
+	// such sources are always compiled completely
+	info_ = {};
+	auto options = options_;
+	options.modules = modules_;
+	try {
+		imports_ = findImports(source, options_.path, *modules_);
+	} catch(const std::exception& err) {
+		return std::vector<Diagnostic>{diagnostic(err)};
+	}
+
+	return compile(source, options);
+}
+
+// Forms are only moved between lines lazily, when they are needed
+// for code generation.
+const Expression& Session::expression(Form& form) {
+	if(form.parsedLoc.row != form.loc.row) {
+		shiftRows(form.expr, int(form.loc.row) - int(form.parsedLoc.row));
+		form.parsedLoc = form.loc;
+	}
+
+	return form.expr;
+}
+
+// The body is parsed with the locations it had when it was split off,
+// so it's created again when the form moved.
+const LazyExpression& Session::body(Form& form) {
+	if(form.parsedLoc.row != form.loc.row) {
+		form.body->loc.row = form.body->loc.row - form.parsedLoc.row + form.loc.row;
+		form.lazy = LazyExpression(*form.body, modules_->symbols());
+		form.parsedLoc = form.loc;
+	}
+
+	return form.lazy;
+}
+
+// Copies the fragment from codegen_ to the end of cg. Its own ids are
+// moved to the next free ids in cg, references to the block it was
+// generated in to the current block. The tag type and struct types are
+// allocated on first use, references to them are moved to the ones of
+// cg. All other ids are the reserved ones from init.
+// Returns nothing, leaving cg as is, when compile would allocate other
+// types in the fragment, i.e. when it has to be generated again.
+std::optional<Session::Fragment> Session::relocate(Codegen& cg,
+		const Fragment& fragment) const {
+	auto& src = codegen_;
+	u32 delta = cg.id + 1 - fragment.idBegin;
+	auto own = [&](u32 id) {
+		return id >= fragment.idBegin && id < fragment.idEnd;
+	};
+
+	// every use of the tag type comes with a tag constant
+	auto tu32 = src.types.tu32;
+	auto tagged = tu32 && std::any_of(
+		src.constants.begin() + fragment.constantsBegin,
+		src.constants.begin() + fragment.constantsEnd,
+		[&](auto& constant) { return constant.type == tu32; });
+	if(tagged && own(tu32) == bool(cg.types.tu32)) {
+		return std::nullopt;
+	}
+
+	auto tagType = tagged && !cg.types.tu32 ? tu32 + delta : cg.types.tu32;
+
+	// struct types are only used by outputs
+	std::unordered_map<u32, u32> structs;
+	std::vector<Codegen::StructType> added;
+	auto exact = true;
+	auto mapType = [&](auto& self, u32 id) -> u32 {
+		auto it = std::find_if(src.structTypes.begin(), src.structTypes.end(),
+			[&](auto& type) { return type.id == id; });
+		if(it == src.structTypes.end()) {
+			return tagged && id == tu32 ? tagType : id;
+		} else if(auto mapped = structs.find(id); mapped != structs.end()) {
+			return mapped->second;
+		}
+
+		std::vector<u32> members;
+		for(auto member : it->members) {
+			members.push_back(self(self, member));
+		}
+
+		auto equal = [&](auto& type) { return type.members == members; };
+		auto found = std::find_if(cg.structTypes.begin(), cg.structTypes.end(), equal);
+		auto ret = id + delta;
+		if(found != cg.structTypes.end()) {
+			ret = found->id;
+			exact &= !own(id);
+		} else if(auto fadded = std::find_if(added.begin(), added.end(), equal);
+				fadded != added.end()) {
+			ret = fadded->id;
+		} else {
+			added.push_back({ret, std::move(members)});
+			exact &= own(id);
+		}
+
+		return structs[id] = ret;
+	};
+
+	for(auto i = fragment.outputsBegin; i < fragment.outputsEnd; ++i) {
+		mapType(mapType, src.outputs[i].idtype);
+	}
+
+	if(!exact) {
+		return std::nullopt;
+	}
+
+	cg.types.tu32 = tagType;
+	cg.structTypes.insert(cg.structTypes.end(), added.begin(), added.end());
+
+	auto block = cg.block;
+	auto map = [&](u32& id) {
+		auto type = structs.empty() ? structs.end() : structs.find(id);
+		if(type != structs.end()) {
+			id = type->second;
+		} else if(tagged && id == tu32) {
+			id = tagType;
+		} else if(own(id)) {
+			id += delta;
+		} else if(id == fragment.startBlock) {
+			id = block;
+		}
+	};
+
+	Fragment ret = fragment;
+	ret.begin = cg.buf.size();
+	cg.buf.insert(cg.buf.end(), src.buf.begin() + fragment.begin,
+		src.buf.begin() + fragment.end);
+	ret.end = cg.buf.size();
+
+	if(delta != 0 || block != fragment.startBlock || !structs.empty() ||
+			(tagged && tagType != tu32)) {
+		for(auto pos = ret.begin; pos < ret.end;) {
+			auto instr = &cg.buf[pos];
+			forEachId(instr, map);
+			pos += instr[0] >> 16;
+		}
+	}
+
+	ret.constantsBegin = cg.constants.size();
+	for(auto i = fragment.constantsBegin; i < fragment.constantsEnd; ++i) {
+		auto& constant = cg.constants.emplace_back(src.constants[i]);
+		map(constant.id);
+		map(constant.type);
+		if(constant.composite) {
+			map(constant.value);
+		}
+	}
+	ret.constantsEnd = cg.constants.size();
+
+	ret.outputsBegin = cg.outputs.size();
+	for(auto i = fragment.outputsBegin; i < fragment.outputsEnd; ++i) {
+		auto& output = cg.outputs.emplace_back(src.outputs[i]);
+		map(output.id);
+		map(output.idtype);
+		output.begin = output.begin - fragment.begin + ret.begin;
+		output.end = output.end - fragment.begin + ret.begin;
+	}
+	ret.outputsEnd = cg.outputs.size();
+
+	ret.idBegin += delta;
+	ret.idEnd += delta;
+	ret.startBlock = block;
+	map(ret.endBlock);
+
+	cg.id = ret.idEnd - 1;
+	cg.block = ret.endBlock;
+	return ret;
+}
+
+std::vector<u32> Session::compileModule(std::string_view source) {
+	info_ = {};
+
+	// forms of the previous version, by text
+	auto oldForms = std::move(forms_);
+	std::unordered_multimap<std::string_view, std::size_t> oldByText;
+	for(auto i = 0u; i < oldForms.size(); ++i) {
+		oldByText.emplace(oldForms[i]->text, i);
+	}
+
+	auto takeForm = [&](std::string_view text, const Location& loc) {
+		// for duplicates, take the first one to keep the versions in order
+		auto [begin, end] = oldByText.equal_range(text);
+		auto best = end;
+		for(auto it = begin; it != end; ++it) {
+			if(oldForms[it->second]->loc.col == loc.col &&
+					(best == end || it->second < best->second)) {
+				best = it;
+			}
+		}
+
+		if(best != end) {
+			auto form = std::move(oldForms[best->second]);
+			form->loc = loc;
+			oldByText.erase(best);
+			return form;
+		}
+
+		++info_.parsed;
+		auto form = std::make_unique<Form>();
+		form->text = text;
+		form->loc = form->parsedLoc = loc;
+		form->version = nextVersion_++;
+
+		Parser parser {form->text, loc, &modules_->symbols()};
+		parser.arena = &form->arena;
+		if(!options_.strict) {
+			if(auto define = skipDefine(parser)) {
+				form->define = true;
+				form->name = define->name.symbol;
+				form->body = define->body;
+				form->lazy = LazyExpression(define->body, modules_->symbols());
+				return form;
+			}
+		}
+
+		form->expr = nextExpression(parser);
+		if(auto list = asDefine(form->expr)) {
+			form->define = true;
+			form->name = std::get<Identifier>(list->values[1].value).symbol;
+		} else {
+			form->import = asImport(form->expr);
+			form->linkage = asForm(form->expr, "extern") ||
+				asForm(form->expr, "export");
+			form->aggregate = asAggregate(form->expr);
+		}
+
+		return form;
+	};
+
+	// new state, only committed on success
+	std::vector<std::unique_ptr<Form>> forms;
+	std::vector<std::optional<Fragment>> fragments;
+	std::vector<std::pair<std::size_t, Deps>> deps;
+
+	Codegen cg;
+	cg.buf = std::move(spare_);
+	cg.buf.clear();
+
+	std::vector<Symbol> lookups;
+	cg.lookups = &lookups;
+	cg.maxDepth = options_.maxDepth;
+
+	// definitions are only evaluated when something has to be generated
+	struct PendingDefine {
+		Symbol name;
+		Form* form; // defined in the source
+		const LazyExpression* value; // imported
+	};
+
+	Defs defs;
+	Context ctx {cg, defs};
+	std::vector<PendingDefine> pendingDefines;
+	std::unordered_map<Symbol, std::uint64_t> versions;
+
+	// versions of imported definitions, from the module and index
+	constexpr auto importedBit = std::uint64_t(1u) << 63;
+	std::vector<std::shared_ptr<const Module>> imports;
+	std::unordered_set<const Module*> imported;
+	auto version = [&](Symbol name) {
+		auto it = versions.find(name);
+		return it == versions.end() ? std::uint64_t(0u) : it->second;
+	};
+
+	auto definePending = [&]{
+		for(auto& def : pendingDefines) {
+			if(def.form && def.form->body) {
+				defs.insert_or_assign(def.name, DefExpr{{}, &defs, &body(*def.form)});
+			} else if(def.form) {
+				auto& list = std::get<List>(expression(*def.form).value);
+				defs.insert_or_assign(def.name, DefExpr{wrap(list.values[2]), &defs});
+			} else {
+				defs.insert_or_assign(def.name, DefExpr{{}, &defs, def.value});
+			}
+		}
+
+		pendingDefines.clear();
+	};
+
+	try {
+		init(cg);
+		Parser parser {source};
+		skipws(parser);
+
+		while(!parser.source.empty()) {
+			// only split off, the forms are parsed like in compile
+			auto loc = parser.loc;
+			auto begin = parser.source.data();
+			skipForm(parser);
+
+			// for identifiers the parser needs the terminating character
+			std::string_view text(begin, parser.source.data() - begin);
+			if(*begin != '(' && !parser.source.empty()) {
+				text = {begin, text.size() + 1};
+			}
+
+			auto& form = *forms.emplace_back(takeForm(text, loc));
+			auto& fragment = fragments.emplace_back();
+			skipws(parser);
+
+			if(form.define) {
+				versions[form.name] = form.version;
+				pendingDefines.push_back({form.name, &form, nullptr});
+				continue;
+			}
+
+			if(form.linkage) {
+				throw LinkageForms {};
+			}
+
+			// declarations don't generate code, they are simply done again.
+			// Their ids are allocated in order, like in compile.
+			if(form.aggregate) {
+				definePending();
+				auto& list = std::get<List>(expression(form).value);
+				auto declared = declareAggregate(cg, list, modules_->symbols());
+				for(auto& [name, function] : declared) {
+					versions[name] = form.version;
+					defs.insert_or_assign(name, DefExpr{{function, form.loc}, &defs});
+				}
+
+				continue;
+			}
+
+			if(form.import) {
+				auto path = importPath(options_.path, *form.import);
+				auto module = modules_->get(path, form.loc);
+				// versions of declarations are numbered after the definitions
+				auto declare = [&](const Module& mod, unsigned i) {
+					definePending();
+					auto& decl = mod.declarations[i];
+					auto& list = std::get<List>(decl.value);
+					auto declared = declareAggregate(cg, list, modules_->symbols());
+					for(auto& [name, function] : declared) {
+						versions[name] = importedBit | (std::uint64_t(mod.id) << 32) |
+							(mod.defines.size() + i);
+						defs.insert_or_assign(name, DefExpr{{function, decl.loc}, &defs});
+					}
+				};
+
+				forEachDefine(*module, imported, declare, [&](const Module& mod, unsigned i) {
+					auto& [name, value] = mod.defines[i];
+					versions[name.symbol] = importedBit |
+						(std::uint64_t(mod.id) << 32) | i;
+					pendingDefines.push_back({name.symbol, nullptr, &value});
+				});
+
+				imports.push_back(std::move(module));
+				continue;
+			}
+
+			if(form.fragment && std::all_of(form.deps.begin(), form.deps.end(),
+					[&](auto& dep) { return version(dep.first) == dep.second; })) {
+				fragment = relocate(cg, *form.fragment);
+				if(fragment) {
+					continue;
+				}
+			}
+
+			definePending();
+
+			++info_.generated;
+			auto& expr = expression(form);
+			auto& gen = fragment.emplace();
+			gen.begin = cg.buf.size();
+			gen.constantsBegin = cg.constants.size();
+			gen.outputsBegin = cg.outputs.size();
+			gen.idBegin = cg.id + 1;
+			gen.startBlock = cg.block;
+
+			lookups.clear();
+			auto ret = generateExpr(ctx, expr);
+			if(auto pt = std::get_if<PrimitiveType>(&ret.type);
+					!pt || *pt != PrimitiveType::eVoid) {
+				throwError("Expression wasn't toplevel", expr.loc);
+			}
+
+			gen.end = cg.buf.size();
+			gen.constantsEnd = cg.constants.size();
+			gen.outputsEnd = cg.outputs.size();
+			gen.idEnd = cg.id + 1;
+			gen.endBlock = cg.block;
+
+			std::sort(lookups.begin(), lookups.end());
+			lookups.erase(std::unique(lookups.begin(), lookups.end()),
+				lookups.end());
+
+			auto& fdeps = deps.emplace_back(forms.size() - 1, Deps{}).second;
+			for(auto name : lookups) {
+				fdeps.emplace_back(name, version(name));
+			}
+		}
+	} catch(...) {
+		// keep the old fragments valid, keep all forms for reuse
+		info_.forms = forms.size();
+		for(auto& form : oldForms) {
+			if(form) {
+				forms.push_back(std::move(form));
+			}
+		}
+
+		forms_ = std::move(forms);
+		spare_ = std::move(cg.buf);
+		throw;
+	}
+
+	info_.forms = forms.size();
+	cg.lookups = nullptr;
+	auto ret = finish(cg);
+
+	for(auto i = 0u; i < forms.size(); ++i) {
+		forms[i]->fragment = fragments[i];
+	}
+
+	for(auto& [i, fdeps] : deps) {
+		forms[i]->deps = std::move(fdeps);
+	}
+
+	forms_ = std::move(forms);
+	imports_ = std::move(imports);
+	spare_ = std::move(codegen_.buf);
+	codegen_ = std::move(cg);
+	return ret;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "lambdav.hpp"
+#include "fwd.hpp"
+#include "module.hpp"
+#include <memory>
+#include <optional>
+
+// Incremental compilation of a changing source, e.g. for live editing.
+// The source is split into its top-level forms and only new or changed
+// forms are parsed again. While generating code for a top-level
+// expression, all names it looks up in definitions (transitively) are
+// recorded as its dependencies, together with the version of the
+// definition visible at that point. After an edit, only expressions
+// whose source or dependencies changed are generated again, the code of
+// all others is reused with its ids relocated. The generated module is
+// identical to the one compile returns for the same source.
+// Imported modules are loaded again when they changed on disk.
+// Sources with extern or export forms and libraries are always
+// compiled completely. Doesn't support the instrumentation options.
+class Session {
+public:
+	struct UpdateInfo {
+		unsigned forms {}; // top-level forms in the source
+		unsigned parsed {}; // forms that had to be parsed
+		unsigned generated {}; // expressions that had to be generated
+	};
+
+public:
+	// Uses the path and module cache of the given options.
+	Session(Options options = {});
+
+	// Compiles the given (new version of the) source.
+	CompileResult update(std::string_view source);
+	const UpdateInfo& lastUpdate() const { return info_; }
+
+	// Modules imported by the last successful update.
+	const auto& imports() const { return imports_; }
+
+protected:
+	// Code generated for a top-level expression, as ranges in codegen_.
+	struct Fragment {
+		std::size_t begin, end; // buf
+		std::size_t constantsBegin, constantsEnd;
+		std::size_t outputsBegin, outputsEnd;
+		u32 idBegin, idEnd; // all ids allocated by it
+		u32 startBlock; // the block it was generated in
+		u32 endBlock; // the current block after it
+	};
+
+	// Looked up symbol and version of the visible definition, 0 if none.
+	using Deps = std::vector<std::pair<Symbol, std::uint64_t>>;
+
+	struct Form {
+		std::string text; // owned, expr references it
+		Expression expr;
+		Arena arena; // of expr
+		Location loc; // current location of the form
+		Location parsedLoc; // location of the form in expr
+		std::uint64_t version; // unique, changes with the text
+
+		bool define {};
+		Symbol name {}; // only for defines
+		const std::string_view* import {}; // only for imports
+		bool linkage {}; // extern or export
+		bool aggregate {}; // struct or variant
+
+		// Body of a define that is only parsed when it's used, like in
+		// compile. Unset in strict sessions, see Options::strict.
+		std::optional<SourceForm> body;
+		LazyExpression lazy; // of body, see Session::body
+
+		// only for expressions, set when generated successfully
+		std::optional<Fragment> fragment;
+		Deps deps;
+	};
+
+	std::vector<u32> compileModule(std::string_view source);
+	const Expression& expression(Form& form);
+	const LazyExpression& body(Form& form);
+	std::optional<Fragment> relocate(Codegen& cg, const Fragment& fragment) const;
+
+protected:
+	Options options_;
+	std::unique_ptr<ModuleCache> localModules_; // when none was given
+	ModuleCache* modules_;
+
+	std::vector<std::shared_ptr<const Module>> imports_;
+	std::vector<std::unique_ptr<Form>> forms_;
+	Codegen codegen_ {}; // the fragments reference it
+	std::vector<u32> spare_; // buffer reused for the next codegen
+	std::uint64_t nextVersion_ {1};
+	UpdateInfo info_;
+};
@@ -0,0 +1,246 @@
+#include "stats.hpp"
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+// Counts the instructions added to buf since the last call.
+u32 countInstructions(Stats& stats, const std::vector<u32>& buf) {
+	while(stats.scanned < buf.size()) {
+		auto count = buf[stats.scanned] >> 16;
+		stats.scanned += std::max(count, 1u);
+		++stats.instructions;
+	}
+
+	return stats.instructions;
+}
+
+double toMs(Stats::Clock::duration duration) {
+	return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+long long toUs(Stats::Clock::duration duration) {
+	using namespace std::chrono;
+	return duration_cast<microseconds>(duration).count();
+}
+
+void writeEscaped(std::ostream& os, std::string_view str) {
+	for(auto c : str) {
+		if(c == '"' || c == '\\') {
+			os << '\\' << c;
+		} else if(static_cast<unsigned char>(c) < 0x20) {
+			os << ' ';
+		} else {
+			os << c;
+		}
+	}
+}
+
+void Stats::record(std::string name, const char* category,
+		Clock::time_point start) {
+	events.push_back({std::move(name), category, start, Clock::now() - start});
+}
+
+void Stats::inserted(std::size_t pos, std::size_t words, u32 count) {
+	if(pos < scanned) {
+		scanned += words;
+		instructions += count;
+	}
+}
+
+void Stats::rewritten(const std::vector<u32>& buf, std::size_t pos) {
+	auto end = std::min(scanned, buf.size());
+	for(scanned = pos; pos < end; pos += std::max(buf[pos] >> 16, 1u)) {
+		--instructions;
+	}
+}
+
+void Stats::beginBuiltin(const std::vector<u32>& buf) {
+	builtinStack.push_back(countInstructions(*this, buf));
+	childStack.push_back(0u);
+}
+
+void Stats::endBuiltin(std::string_view name, const std::vector<u32>& buf) {
+	auto inclusive = countInstructions(*this, buf) - builtinStack.back();
+	auto exclusive = inclusive - childStack.back();
+	builtinStack.pop_back();
+	childStack.pop_back();
+	if(!childStack.empty()) {
+		childStack.back() += inclusive;
+	}
+
+	auto& b = builtins[name];
+	++b.calls;
+	b.instructions += exclusive;
+}
+
+void SizeReport::push(std::string_view name, const Location& loc, u32 words) {
+	auto& def = defines[{name, loc.row, loc.col}];
+	def.name = name;
+	def.loc = loc;
+	++def.expansions;
+	++def.active;
+	stack.push_back({&def, words, 0u});
+}
+
+void SizeReport::pop(u32 words) {
+	auto frame = stack.back();
+	auto inclusive = words - frame.start;
+	auto exclusive = inclusive - frame.children;
+
+	// recursive expansions are already part of the outer one
+	auto& def = *frame.def;
+	if(--def.active == 0) {
+		def.words += inclusive;
+	}
+
+	def.selfWords += exclusive;
+	if(exclusive > 0) {
+		// only the innermost frames, full chains are mostly unique
+		constexpr auto maxChain = 4u;
+		auto first = stack.size() - std::min<std::size_t>(maxChain, stack.size());
+		std::string chain = first > 0 ? "... > " : "";
+		for(auto i = first; i < stack.size(); ++i) {
+			if(i != first) {
+				chain += " > ";
+			}
+			chain += stack[i].def->name;
+		}
+
+		chains[chain] += exclusive;
+	}
+
+	stack.pop_back();
+	if(!stack.empty()) {
+		stack.back().children += inclusive;
+	}
+}
+
+void printSizeReport(const SizeReport& report, std::ostream& os) {
+	constexpr auto maxEntries = 20u;
+
+	std::vector<const SizeReport::Define*> defines;
+	for(auto& entry : report.defines) {
+		defines.push_back(&entry.second);
+	}
+
+	auto printDefines = [&]{
+		os << "\twords\tself\texpansions\tdefinition\n";
+		auto count = std::min<std::size_t>(maxEntries, defines.size());
+		for(auto i = 0u; i < count; ++i) {
+			auto& def = *defines[i];
+			os << "\t" << def.words << "\t" << def.selfWords << "\t";
+			os << def.expansions << "\t\t" << def.name << " (";
+			os << def.loc.row << ":" << def.loc.col << ")\n";
+		}
+	};
+
+	std::sort(defines.begin(), defines.end(), [](auto* a, auto* b) {
+		return a->words > b->words;
+	});
+	os << "definitions by words:\n";
+	printDefines();
+
+	std::sort(defines.begin(), defines.end(), [](auto* a, auto* b) {
+		return a->expansions > b->expansions;
+	});
+	os << "definitions by expansions:\n";
+	printDefines();
+
+	std::vector<std::pair<std::string_view, u32>> chains(
+		report.chains.begin(), report.chains.end());
+	std::sort(chains.begin(), chains.end(), [](auto& a, auto& b) {
+		return a.second > b.second;
+	});
+
+	os << "definition chains by words:\n";
+	auto count = std::min<std::size_t>(maxEntries, chains.size());
+	for(auto i = 0u; i < count; ++i) {
+		os << "\t" << chains[i].second << "\t" << chains[i].first << "\n";
+	}
+}
+
+void printSummary(const Stats& stats, std::ostream& os) {
+	Stats::Clock::duration parse {}, codegen {}, finish {};
+	std::vector<const Stats::Event*> forms;
+	for(auto& event : stats.events) {
+		std::string_view cat = event.category;
+		if(cat == "parse") {
+			parse += event.duration;
+		} else if(cat == "codegen") {
+			codegen += event.duration;
+			forms.push_back(&event);
+		} else if(cat == "finish") {
+			finish += event.duration;
+		}
+	}
+
+	os << std::fixed << std::setprecision(3);
+	os << "phases:\n";
+	os << "\tparse: " << toMs(parse) << " ms\n";
+	os << "\tcodegen: " << toMs(codegen) << " ms\n";
+	os << "\tfinish: " << toMs(finish) << " ms\n";
+
+	constexpr auto maxForms = 10u;
+	std::sort(forms.begin(), forms.end(), [](auto* a, auto* b) {
+		return a->duration > b->duration;
+	});
+
+	os << "slowest top-level forms:\n";
+	for(auto i = 0u; i < std::min<std::size_t>(maxForms, forms.size()); ++i) {
+		os << "\t" << forms[i]->name << ": " << toMs(forms[i]->duration) << " ms\n";
+	}
+
+	os << "counters:\n";
+	os << "\tscopes: " << stats.scopes << "\n";
+	os << "\tdeep calls: " << stats.deepCalls << "\n";
+	os << "\tdefinitions inlined: " << stats.definitionsInlined << "\n";
+	os << "\trecursions lowered: " << stats.recursionsLowered << "\n";
+	os << "\tfunctions tagged: " << stats.functionsTagged << "\n";
+	os << "\tloops fused: " << stats.loopsFused << "\n";
+	os << "\taggregates built: " << stats.aggregatesBuilt << "\n";
+	os << "\tcases folded: " << stats.casesFolded << "\n";
+	os << "\tconstants created: " << stats.constants << "\n";
+
+	os << "estimated output costs:\n";
+	for(auto& [location, cost] : stats.outputCosts) {
+		os << "\t" << location << ": cost " << cost.cost;
+		os << ", peak live " << cost.peakLive;
+		os << ", branches " << cost.branches;
+		os << ", loops " << cost.loops;
+		if(cost.loops) {
+			os << " (max trips " << cost.maxTrips << ")";
+		}
+		os << "\n";
+	}
+
+	std::vector<std::pair<std::string_view, Stats::BuiltinStats>> builtins(
+		stats.builtins.begin(), stats.builtins.end());
+	std::sort(builtins.begin(), builtins.end(), [](auto& a, auto& b) {
+		return a.second.instructions > b.second.instructions;
+	});
+
+	os << "builtins (calls, instructions emitted):\n";
+	for(auto& [name, b] : builtins) {
+		os << "\t" << name << ": " << b.calls << ", " << b.instructions << "\n";
+	}
+}
+
+void writeTrace(const Stats& stats, std::ostream& os) {
+	os << "{\"traceEvents\":[";
+	auto first = true;
+	for(auto& event : stats.events) {
+		if(!first) {
+			os << ",";
+		}
+
+		first = false;
+		os << "\n{\"name\":\"";
+		writeEscaped(os, event.name);
+		os << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\"";
+		os << ",\"ts\":" << toUs(event.start - stats.begin);
+		os << ",\"dur\":" << toUs(event.duration);
+		os << ",\"pid\":1,\"tid\":1}";
+	}
+
+	os << "\n]}\n";
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "fwd.hpp"
+#include "analysis.hpp"
+#include <chrono>
+#include <string>
+#include <iosfwd>
+#include <map>
+#include <tuple>
+
+// Compile time instrumentation.
+// The compiler only records anything when a Stats object is given
+// (Codegen::stats), otherwise it costs a single null check per site.
+struct Stats {
+	using Clock = std::chrono::steady_clock;
+
+	// Timed region, e.g. parsing or generating a top-level form.
+	struct Event {
+		std::string name;
+		const char* category; // "parse", "codegen", "finish"
+		Clock::time_point start;
+		Clock::duration duration;
+	};
+
+	struct BuiltinStats {
+		u32 calls {};
+		u32 instructions {}; // exclusive, without nested builtins
+	};
+
+	Clock::time_point begin {Clock::now()};
+	std::vector<Event> events;
+
+	u32 scopes {}; // Defs created for let/func/rec-func/case scopes
+	u32 deepCalls {}; // call stacks allocated in Codegen::arena
+	u32 definitionsInlined {}; // identifiers resolved through Defs
+	u32 recursionsLowered {}; // recursive functions generated as loops
+	u32 functionsTagged {}; // loop parameters holding function tags
+	u32 loopsFused {}; // loops merged into the previous one
+	u32 aggregatesBuilt {}; // struct and variant values constructed
+	u32 casesFolded {}; // case expressions with only one possible clause
+	u32 constants {}; // constants created
+	std::unordered_map<std::string_view, BuiltinStats> builtins;
+
+	// static cost estimate per output location
+	std::vector<std::pair<u32, CostEstimate>> outputCosts;
+
+	// internal state for attributing instructions to builtins
+	std::size_t scanned {}; // position in Codegen::buf counted so far
+	u32 instructions {}; // instructions in Codegen::buf[0, scanned)
+	std::vector<u32> builtinStack; // instruction count at builtin start
+	std::vector<u32> childStack; // instructions in nested builtins
+
+	// Adds a timed event that started at 'start' and ends now.
+	void record(std::string name, const char* category, Clock::time_point start);
+
+	// Called when instructions are inserted into Codegen::buf
+	// at the given position instead of being appended.
+	void inserted(std::size_t pos, std::size_t words, u32 instructions);
+
+	// Called before Codegen::buf is rewritten from the given position
+	// on, the rewritten instructions are counted as new ones.
+	void rewritten(const std::vector<u32>& buf, std::size_t pos);
+
+	// Called around the generation of a builtin.
+	void beginBuiltin(const std::vector<u32>& buf);
+	void endBuiltin(std::string_view name, const std::vector<u32>& buf);
+};
+
+// Attribution of generated code to the definitions whose inlining
+// caused it. Since every reference to a definition inlines it again,
+// a small define can end up responsible for most of a module.
+// Sizes are measured in spirv words, including the constants declared
+// for the definition.
+struct SizeReport {
+	struct Define {
+		std::string_view name;
+		Location loc; // location of the defined expression
+		u32 expansions {}; // how often it was inlined
+		u32 words {}; // inclusive, including nested definitions
+		u32 selfWords {}; // exclusive
+		u32 active {}; // current recursion depth
+	};
+
+	struct Frame {
+		Define* def;
+		u32 start; // word count at expansion start
+		u32 children; // words of nested expansions
+	};
+
+	std::map<std::tuple<std::string_view, unsigned, unsigned>, Define> defines;
+	std::unordered_map<std::string, u32> chains; // exclusive words per chain
+	std::vector<Frame> stack;
+
+	// Called around the expansion of a definition, words is the
+	// current number of generated words.
+	void push(std::string_view name, const Location& loc, u32 words);
+	void pop(u32 words);
+};
+
+// Prints a human readable summary.
+void printSummary(const Stats& stats, std::ostream& os);
+
+// Prints the defines responsible for the most words and expansions
+// as well as the most expensive definition chains.
+void printSizeReport(const SizeReport& report, std::ostream& os);
+
+// Writes all events in chrome's trace event format, can be viewed
+// with chrome://tracing or perfetto.
+void writeTrace(const Stats& stats, std::ostream& os);
@@ -0,0 +1,97 @@
+// Stress test of concurrent compilation.
+// Compiles the given sources serially, then many times on many threads
+// at once, sharing one module cache and reusing a workspace per thread,
+// and checks that every concurrent result equals the serial one.
+
+#include "../lambdav.hpp"
+#include "../fwd.hpp"
+#include "../pool.hpp"
+#include "../module.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+// The spirv module, or the diagnostics as text.
+std::string resultString(const CompileResult& res) {
+	std::string ret;
+	if(auto diags = std::get_if<std::vector<Diagnostic>>(&res)) {
+		for(auto& diag : *diags) {
+			ret += diag.file + ":" + std::to_string(diag.loc.row) + ":";
+			ret += std::to_string(diag.loc.col) + ": " + diag.message + "\n";
+		}
+		return ret;
+	}
+
+	auto& spirv = std::get<std::vector<u32>>(res);
+	ret.assign(reinterpret_cast<const char*>(spirv.data()), spirv.size() * 4);
+	return ret;
+}
+
+void printUsage() {
+	std::cout << "Usage: lambdav-concurrent [-j <threads>] [-n <rounds>] <sources...>\n";
+}
+
+int main(int argc, const char** argv) {
+	auto threads = 8u;
+	auto rounds = 64u;
+	auto argi = 1;
+	for(; argi + 1 < argc; argi += 2) {
+		if(!std::strcmp(argv[argi], "-j")) {
+			threads = std::atoi(argv[argi + 1]);
+		} else if(!std::strcmp(argv[argi], "-n")) {
+			rounds = std::atoi(argv[argi + 1]);
+		} else {
+			break;
+		}
+	}
+
+	if(argi >= argc) {
+		printUsage();
+		return -1;
+	}
+
+	std::vector<std::string> paths(argv + argi, argv + argc);
+	std::vector<std::string> sources;
+	std::vector<std::string> expected;
+	for(auto& path : paths) {
+		sources.push_back(readFile(path));
+
+		Options options;
+		options.path = path;
+		expected.push_back(resultString(compile(sources.back(), options)));
+	}
+
+	// every round compiles all sources, jobs of one source are spread
+	// over the rounds so different sources run at the same time
+	ModuleCache modules;
+	std::vector<Workspace> workspaces(threads);
+	std::vector<char> failed(sources.size() * rounds);
+	parallelFor(failed.size(), threads, [&](std::size_t i, unsigned worker) {
+		auto source = i % sources.size();
+
+		Options options;
+		options.path = paths[source];
+		options.modules = &modules;
+		options.workspace = &workspaces[worker];
+		options.threads = 1 + (i / sources.size()) % 2;
+
+		auto res = resultString(compile(sources[source], options));
+		failed[i] = (res != expected[source]);
+	});
+
+	auto failCount = 0u;
+	for(auto i = 0u; i < failed.size(); ++i) {
+		if(failed[i]) {
+			std::cout << paths[i % sources.size()] << ": round ";
+			std::cout << i / sources.size() << " differs from serial compile\n";
+			++failCount;
+		}
+	}
+
+	std::cout << failed.size() - failCount << "/" << failed.size();
+	std::cout << " concurrent compiles matched on " << threads << " threads\n";
+	return failCount == 0 ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+// Differential test of incremental compilation.
+// Updates a session with edited versions of the given sources (and
+// some built-in cases) and checks that every result equals the one
+// compile returns for the same source, see session.hpp.
+
+#include "../lambdav.hpp"
+#include "../fwd.hpp"
+#include "../session.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Sources sessions once handled differently than compile.
+const char* builtinCases[] = {
+	// define bodies are only parsed when used
+	"(define f (vec4 1 2 3 4abc)) (output 0 (vec4 1 2 3 4))",
+	"(define f (vec4 1 2 3 4abc))\n(output 0 (vec4 1 2 3 4))\n(output 1 f)",
+	"(define 1 2) (output 0 (vec4 1 2 3 4))",
+	"(output 0 (vec4 (() 1) 0 0 1))",
+};
+
+// The spirv module, or the diagnostics as text.
+std::string resultString(const CompileResult& res) {
+	std::string ret;
+	if(auto diags = std::get_if<std::vector<Diagnostic>>(&res)) {
+		for(auto& diag : *diags) {
+			ret += diag.file + ":" + std::to_string(diag.loc.row) + ":";
+			ret += std::to_string(diag.loc.col) + ": " + diag.message + "\n";
+		}
+		return ret;
+	}
+
+	auto& spirv = std::get<std::vector<u32>>(res);
+	ret.assign(reinterpret_cast<const char*>(spirv.data()), spirv.size() * 4);
+	return ret;
+}
+
+// The source, then for every form the source without it and with it
+// moved down a row, so reused forms change their location.
+std::vector<std::string> edits(const std::string& source) {
+	std::vector<std::string> ret {source};
+	for(auto& form : scanForms(source)) {
+		auto begin = std::size_t(form.text.data() - source.data());
+		auto removed = source;
+		removed.erase(begin, form.text.size());
+		ret.push_back(removed);
+
+		auto moved = source;
+		moved.insert(begin, "\n");
+		ret.push_back(moved);
+	}
+
+	ret.push_back(source);
+	return ret;
+}
+
+int main(int argc, const char** argv) {
+	std::vector<std::string> paths(builtinCases, std::end(builtinCases));
+	std::vector<std::string> sources(builtinCases, std::end(builtinCases));
+	for(auto i = 1; i < argc; ++i) {
+		paths.push_back(argv[i]);
+		sources.push_back(readFile(argv[i]));
+	}
+
+	auto count = 0u;
+	auto failCount = 0u;
+	for(auto i = 0u; i < sources.size(); ++i) {
+		Options options;
+		options.path = i < std::size(builtinCases) ? "" : paths[i];
+
+		Session session(options);
+		for(auto& source : edits(sources[i])) {
+			auto res = resultString(session.update(source));
+			auto expected = resultString(compile(source, options));
+			++count;
+			if(res != expected) {
+				std::cout << paths[i] << ": update " << count;
+				std::cout << " differs from compile\n";
+				++failCount;
+			}
+		}
+	}
+
+	std::cout << count - failCount << "/" << count;
+	std::cout << " session updates matched compile\n";
+	return failCount == 0 ? 0 : 1;
+}